@@ -0,0 +1,82 @@
+/**
+ * @file stms/affinity.hpp
+ * @brief Thread placement: names, CPU affinity, scheduling priority and NUMA memory policy of the calling thread.
+ * Created by grant on 12/12/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_AFFINITY_HPP
+#define NEWTONIAN_FOOTBALL_2D_AFFINITY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace stms {
+    /**
+     * @brief Where and how a thread (or every worker of a `ThreadPool`) runs. The default leaves everything to the OS.
+     *        Anything the OS refuses (e.g. a real-time priority without `CAP_SYS_NICE`) is logged and skipped.
+     */
+    struct ThreadPlacement {
+        std::string name; //!< Thread name shown by profilers and `top -H`. Pool workers get `-<index>` appended.
+        std::vector<int> cpus; //!< CPUs to run on. Pool workers are pinned to one each, round robin. Empty: any CPU
+        int numaNode = -1; //!< Memory is allocated from this node, and if `cpus` is empty, it runs on its CPUs. -1: any
+        int priority = 0; //!< 1 to 99 for `SCHED_FIFO` at that priority, negative for that nice value, 0 to not touch
+
+        [[nodiscard]] inline bool isDefault() const {
+            return name.empty() && cpus.empty() && numaNode < 0 && priority == 0;
+        }
+    };
+
+    /**
+     * @brief Parse a Linux CPU list, as used by `taskset -c` and `/sys/devices/system/node/node<N>/cpulist`
+     * @param list E.g. `0-3,8,10-11`
+     * @return The CPUs in the list, in order. Malformed entries are logged and ignored.
+     */
+    std::vector<int> parseCpuList(std::string_view list);
+
+    /**
+     * @brief Query the CPUs of a NUMA node
+     * @param node Node to query
+     * @return The CPUs of the node, empty if there is no such node
+     */
+    std::vector<int> getNumaNodeCpus(int node);
+
+    /**
+     * @brief Apply a placement to the calling thread
+     * @param placement Placement to apply
+     * @param index Index of the thread among the threads sharing `placement`, counting from 1, or 0 if it's alone.
+     *              Picks the CPU out of `placement.cpus` and is appended to the name.
+     * @return False if anything couldn't be applied. What and why is logged.
+     */
+    bool applyPlacement(const ThreadPlacement &placement, size_t index = 0);
+
+    /**
+     * @brief Prefer memory from a NUMA node for everything the calling thread touches first while this is alive,
+     *        e.g. to construct per-match state on the node of the thread that will run the match.
+     */
+    class NumaScope {
+    private:
+        int oldMode = -1; //!< Memory policy to restore, -1 if nothing was changed
+        std::vector<unsigned long> oldNodes;
+
+    public:
+        /**
+         * @brief Set the memory policy of the calling thread
+         * @param node Node to prefer. If negative, nothing is changed.
+         */
+        explicit NumaScope(int node);
+
+        virtual ~NumaScope(); //!< Calls `restore()`
+
+        NumaScope(const NumaScope &rhs) = delete; //!< Deleted copy constructor
+        NumaScope &operator=(const NumaScope &rhs) = delete; //!< Deleted copy assignment operator
+
+        void restore(); //!< Restore the memory policy from before the constructor. Must be on the same thread!
+    };
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_AFFINITY_HPP
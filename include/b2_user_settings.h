@@ -0,0 +1,77 @@
+//
+// Created by grant on 11/24/20.
+//
+
+/**
+ * @file b2_user_settings.h
+ * @brief Box2D user settings (enabled with `B2_USER_SETTINGS`). Identical to the stock Box2D 2.4 settings,
+ *        except that `b2Alloc`/`b2Free` are routed through `PhysicsArena` (see `src/phys_arena.cpp`) so that
+ *        each `PhysicsEngine` can own its memory instead of hitting the global heap.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_B2_USER_SETTINGS_H
+#define NEWTONIAN_FOOTBALL_2D_B2_USER_SETTINGS_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+// Tunable Constants (same as the Box2D defaults)
+#define b2_lengthUnitsPerMeter 1.0f
+#define b2_maxPolygonVertices    8
+
+/// You can define this to inject whatever data you want in b2Body
+struct B2_API b2BodyUserData {
+    b2BodyUserData() {
+        pointer = 0;
+    }
+
+    uintptr_t pointer; //!< For legacy compatibility
+};
+
+/// You can define this to inject whatever data you want in b2Fixture
+struct B2_API b2FixtureUserData {
+    b2FixtureUserData() {
+        pointer = 0;
+    }
+
+    uintptr_t pointer; //!< For legacy compatibility
+};
+
+/// You can define this to inject whatever data you want in b2Joint
+struct B2_API b2JointUserData {
+    b2JointUserData() {
+        pointer = 0;
+    }
+
+    uintptr_t pointer; //!< For legacy compatibility
+};
+
+// These are still defined by Box2D's `b2_settings.cpp`, so they have to be declared here.
+B2_API void *b2Alloc_Default(int32 size);
+B2_API void b2Free_Default(void *mem);
+B2_API void b2Log_Default(const char *string, va_list args);
+
+/// Defined in `src/phys_arena.cpp`. Allocates from the calling thread's active `PhysicsArena`, or the heap.
+void *b2ArenaAlloc(int32 size);
+
+/// Defined in `src/phys_arena.cpp`. Returns memory to whatever `b2ArenaAlloc` got it from.
+void b2ArenaFree(void *mem);
+
+inline void *b2Alloc(int32 size) {
+    return b2ArenaAlloc(size);
+}
+
+inline void b2Free(void *mem) {
+    b2ArenaFree(mem);
+}
+
+inline void b2Log(const char *string, ...) {
+    va_list args;
+    va_start(args, string);
+    b2Log_Default(string, args);
+    va_end(args);
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_B2_USER_SETTINGS_H
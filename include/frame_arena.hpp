@@ -0,0 +1,223 @@
+/**
+ * @file stms/frame_arena.hpp
+ * @brief Provides `FrameArena`, a per-frame linear (bump) allocator, and helpers for allocating from it.
+ * Created by grant on 11/26/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_FRAME_ARENA_HPP
+#define NEWTONIAN_FOOTBALL_2D_FRAME_ARENA_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+#include "config.hpp"
+
+namespace stms {
+    /**
+     * @brief Linear allocator for transient per-frame allocations, reset at the top of every loop iteration.
+     *
+     * Allocating is a pointer bump and freeing is a no-op. There are 2 blocks which alternate between frames.
+     * Objects that have to outlive the frame they were created in (e.g. `LogRecord`s consumed on the log pool)
+     * are *pinned*: `reset()` never reuses a block that still has pinned objects in it and keeps bumping the
+     * current block instead. Only the owning thread may allocate; pins may be released from any thread.
+     */
+    class FrameArena {
+    private:
+        struct Block {
+            unsigned char *base = nullptr;
+            size_t used = 0;
+            std::atomic_size_t pins = 0; //!< Number of pinned objects still alive in this block
+        };
+
+        /// On the heap, so that if the arena has to be leaked (see `~FrameArena()`), late pin releases still have
+        /// somewhere to go.
+        Block *blocks = new Block[2];
+        unsigned active = 0; //!< Index of the block currently being allocated from
+        size_t capacity; //!< Size of each block
+
+        size_t peakBytes = 0; //!< Largest number of bytes used in one block
+        size_t overflows = 0; //!< Number of allocations that did not fit and had to go to the heap
+        size_t stalledResets = 0; //!< Number of `reset()`s that couldn't switch blocks due to pinned objects
+
+    public:
+        /// RAII guard that makes an arena the current one (see `FrameArena::current()`) on this thread.
+        class Scope {
+        private:
+            FrameArena *prev; //!< Arena that was active before this scope, restored on destruction
+        public:
+            explicit Scope(FrameArena *arena);
+
+            virtual ~Scope();
+
+            Scope(const Scope &rhs) = delete; //!< Deleted copy constructor
+            Scope &operator=(const Scope &rhs) = delete; //!< Deleted copy assignment operator
+        };
+
+        /**
+         * @brief Create an arena
+         * @param capacity Size of each of the 2 blocks, in bytes
+         */
+        explicit FrameArena(size_t capacity = frameArenaBytes);
+
+        /// Virtual destructor. Waits up to `frameArenaDrainMs` for pinned objects (e.g. queued log records or
+        /// detached tasks) to be released, and leaks the arena if some are still alive after that.
+        virtual ~FrameArena();
+
+        FrameArena(const FrameArena &rhs) = delete; //!< Deleted copy constructor
+        FrameArena &operator=(const FrameArena &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Get the frame arena of this thread, used by `makeFramePtr` and the logging/task paths.
+         * @return Reference to the thread-local pointer. `nullptr` if this thread has no frame arena.
+         */
+        static FrameArena *&current() {
+            thread_local FrameArena *val = nullptr;
+            return val;
+        }
+
+        void reset(); //!< Start a new frame. Everything not pinned from the frame before last becomes invalid!
+
+        /**
+         * @brief Allocate memory valid until the next `reset()`.
+         * @param size Number of bytes
+         * @param align Alignment, must be a power of 2
+         * @return Pointer to the memory, or `nullptr` if the arena is full (counted as an overflow).
+         */
+        void *alloc(size_t size, size_t align = alignof(std::max_align_t));
+
+        /**
+         * @brief Allocate memory that stays valid until the returned pin is released, even across `reset()`s.
+         * @param size Number of bytes
+         * @param align Alignment, must be a power of 2
+         * @param pin Set to the counter to decrement (with release semantics) once the memory is no longer used
+         * @return Pointer to the memory, or `nullptr` if the arena is full (counted as an overflow).
+         */
+        void *allocPinned(size_t size, size_t align, std::atomic_size_t *&pin);
+
+        /**
+         * @brief Query if a pointer points into this arena
+         * @param ptr Pointer to check
+         * @return True if `ptr` is inside one of the blocks
+         */
+        [[nodiscard]] bool owns(const void *ptr) const;
+
+        [[nodiscard]] inline size_t getPeakBytes() const { //!< Largest number of bytes used in one block
+            return peakBytes;
+        }
+
+        [[nodiscard]] inline size_t getOverflows() const { //!< Number of allocations that went to the heap
+            return overflows;
+        }
+
+        [[nodiscard]] inline size_t getStalledResets() const { //!< Resets that couldn't switch blocks
+            return stalledResets;
+        }
+    };
+
+    /**
+     * @brief Deleter for `FramePtr`. Destroys the object in place and releases its pin if it lives in a
+     *        `FrameArena`, otherwise it simply `delete`s it.
+     */
+    struct FrameDeleter {
+        std::atomic_size_t *pin = nullptr; //!< Pin of the arena block the object lives in, `nullptr` if on the heap
+
+        template<typename T>
+        void operator()(T *ptr) const {
+            if (pin == nullptr) {
+                delete ptr;
+            } else {
+                ptr->~T();
+                pin->fetch_sub(1, std::memory_order_release);
+            }
+        }
+    };
+
+    /// Owning pointer to an object that may live in a `FrameArena`. Safe to pass to (and free on) other threads.
+    template<typename T>
+    using FramePtr = std::unique_ptr<T, FrameDeleter>;
+
+    /**
+     * @brief Construct an object in this thread's `FrameArena` (pinned), or on the heap if there is none.
+     * @tparam T Type to construct
+     * @param args Arguments for the constructor of `T`
+     * @return Owning pointer to the new object
+     */
+    template<typename T, typename... Args>
+    FramePtr<T> makeFramePtr(Args &&... args) {
+        FrameArena *arena = FrameArena::current();
+        if (arena != nullptr) {
+            std::atomic_size_t *pin = nullptr;
+            void *mem = arena->allocPinned(sizeof(T), alignof(T), pin);
+            if (mem != nullptr) {
+                try {
+                    return FramePtr<T>(new(mem) T(std::forward<Args>(args)...), FrameDeleter{pin});
+                } catch (...) {
+                    pin->fetch_sub(1, std::memory_order_release);
+                    throw;
+                }
+            }
+        }
+
+        return FramePtr<T>(new T(std::forward<Args>(args)...));
+    }
+
+    /**
+     * @brief Standard allocator that allocates from a `FrameArena`, for containers that only live for one frame.
+     *        Falls back to the heap when the arena is full (or `nullptr`).
+     * @tparam T Type to allocate
+     */
+    template<typename T>
+    class FrameAllocator {
+    public:
+        using value_type = T;
+
+        FrameArena *arena; //!< Arena to allocate from.
+
+        explicit FrameAllocator(FrameArena *arena = FrameArena::current()) noexcept : arena(arena) {}
+
+        template<typename U>
+        FrameAllocator(const FrameAllocator<U> &rhs) noexcept : arena(rhs.arena) {} // NOLINT: Must be implicit
+
+        T *allocate(size_t n) {
+            if (arena != nullptr) {
+                void *mem = arena->alloc(n * sizeof(T), alignof(T));
+                if (mem != nullptr) {
+                    return static_cast<T *>(mem);
+                }
+            }
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *ptr, size_t) noexcept {
+            if (arena == nullptr || !arena->owns(ptr)) {
+                ::operator delete(ptr);
+            }
+        }
+
+        template<typename U>
+        bool operator==(const FrameAllocator<U> &rhs) const noexcept {
+            return arena == rhs.arena;
+        }
+
+        template<typename U>
+        bool operator!=(const FrameAllocator<U> &rhs) const noexcept {
+            return arena != rhs.arena;
+        }
+    };
+
+    /**
+     * @brief Number of global `operator new` calls made by this thread. Only counted if `COUNT_FRAME_ALLOCS`
+     *        is defined (see `config.hpp`); always 0 otherwise.
+     * @return Reference to the thread-local counter
+     */
+    inline size_t &getThreadNewCount() {
+        thread_local size_t val = 0;
+        return val;
+    }
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_FRAME_ARENA_HPP
@@ -9,10 +9,13 @@
 
 
 #include "config.hpp"
+#include "frame_arena.hpp"
 
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <fmt/format.h>
 #include <fmt/chrono.h>
@@ -56,12 +59,14 @@ namespace stms {
     void quitLogging(); //!< Quit logging. If you used `stms::initAll`, you do not have to call this.
 
 #   ifdef ENABLE_LOGGING
-    void insertImpl(std::unique_ptr<LogRecord> rec); //!< Internal implementation detail. Don't touch.
+    void insertImpl(FramePtr<LogRecord> rec); //!< Internal implementation detail. Don't touch.
 
     /**
      * @brief NEVER this function directly. Instead, use the logging macros (`INFO`, `WARN`, etc.).
      *        This function inserts a `LogRecord` into `logQueue` and starts a log-consume task (`consumeLogs`).
      *        The consume task would be asynchronous if `logPool` is not `nullptr`.
+     *        The `LogRecord` is allocated from this thread's `FrameArena` if it has one, so logging from
+     *        a frame loop doesn't touch the heap.
      * @tparam Args Template param allowing fmtlib arguments to be passed in
      * @param lvl Severity of the message. See `LogLevel`.
      * @param line Line of the source file the message is from
@@ -71,7 +76,7 @@ namespace stms {
      */
     template<typename... Args>
     void insertLog(LogLevel lvl, unsigned line, const char *file, const char *fmtStr, const Args &... args) {
-        std::unique_ptr<LogRecord> insert = std::make_unique<LogRecord>(lvl, std::chrono::system_clock::now(), file, line);
+        FramePtr<LogRecord> insert = makeFramePtr<LogRecord>(lvl, std::chrono::system_clock::now(), file, line);
 
         try {
             fmt::format_to(insert->msg, fmtStr, args...);
@@ -133,10 +138,10 @@ namespace stms {
      * would be a hook that just prints the second argument to stdout.
      *
      * If `stms::logToLatestLog` is true, the next hook would be one that writes the second argument
-     * to `latest.log` without flushing the output with `fflush`
+     * to `latest.log` through a `LogFileSink` (asynchronous, rotated and compressed)
      *
      * If `stms::logToUniqueFile` is true, the next hook would be one that writes the second argument to
-     * `${stms::logsDir}/${DATE_TIME}.log`
+     * `${stms::logsDir}/${YYYYmmdd-HHMMSS}.log`, also through a `LogFileSink`
      */
     inline std::vector<std::function<void(LogRecord *, std::string *)>> &getLogHooks() {
         static std::vector<std::function<void(LogRecord *, std::string *)>> val;
@@ -145,6 +150,8 @@ namespace stms {
 
     void consumeLogs(); //!< Process all the logs in `logQueue`, essentially flushing the log message backlog
 
+    size_t getLogQueueLength(); //!< Number of log records waiting to be consumed. Always 0 without `ENABLE_LOGGING`.
+
 }
 
 #endif //NEWTONIAN_FOOTBALL_2D_LOG_HPP
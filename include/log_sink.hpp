@@ -0,0 +1,106 @@
+/**
+ * @file stms/log_sink.hpp
+ * @brief Provides `LogFileSink`, an asynchronous, rotating log file writer.
+ * Created by grant on 12/2/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_LOG_SINK_HPP
+#define NEWTONIAN_FOOTBALL_2D_LOG_SINK_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+
+namespace stms {
+    /**
+     * @brief Log file written from a dedicated I/O thread. `write()` only copies the line into one of
+     *        `logSinkBuffers` preallocated, page-aligned buffers of `logSinkBufferBytes`; full buffers are written
+     *        out by the I/O thread. If the I/O thread falls so far behind that every buffer is full, lines are
+     *        dropped (and counted) instead of blocking the caller.
+     *
+     * The active file is `<base>.log`. Once it reaches `logRotateBytes` or is `logRotateSeconds` old, it is renamed
+     * to `<base>.<n>.log` and a fresh `<base>.log` is started. If `logCompressRotated` is set, rotated segments are
+     * compressed on a background thread: to `.log.gz` if built with zlib (`STMS_HAVE_ZLIB`), otherwise to `.log.lz`
+     * with a small built-in LZ77 codec (see `decompressLogSegment`).
+     */
+    class LogFileSink {
+    private:
+        struct Buffer {
+            char *data = nullptr;
+            size_t size = 0;
+        };
+
+        std::string base;
+
+        std::mutex bufferMtx; //!< Mutex to lock for accessing `active`, `freeBuffers`, `fullBuffers` and `running`
+        std::condition_variable bufferCv; //!< Notified when a buffer is full or the sink is stopping
+        Buffer active;
+        std::vector<Buffer> freeBuffers;
+        std::vector<Buffer> fullBuffers; //!< Oldest first
+        bool running = true;
+        std::atomic_uint64_t dropped = 0;
+
+        std::thread ioThread;
+        int fd = -1;
+        size_t segmentBytes = 0;
+        std::chrono::steady_clock::time_point segmentStart;
+        unsigned nextSegment = 1;
+
+        std::mutex compressMtx; //!< Mutex to lock for accessing `toCompress` and `compressing`
+        std::condition_variable compressCv;
+        std::vector<std::string> toCompress;
+        bool compressing = true;
+        std::thread compressThread;
+
+        void ioFunc(); //!< Main loop of the I/O thread. Internal implementation detail.
+
+        void compressFunc(); //!< Main loop of the compression thread. Internal implementation detail.
+
+        void writeOut(const Buffer &buf); //!< Write a buffer to the file, rotating if needed. I/O thread only.
+
+        void rotate(); //!< Start a new segment. I/O thread only.
+
+        bool openActive(); //!< (Re)open `<base>.log`. I/O thread only.
+
+    public:
+        /**
+         * @brief Open `<base>.log` (truncating it) and start the I/O thread
+         * @param base Path of the log file, without the `.log` extension
+         */
+        explicit LogFileSink(std::string base);
+
+        virtual ~LogFileSink(); //!< Flush everything written so far, close the file and join the threads.
+
+        LogFileSink(const LogFileSink &rhs) = delete; //!< Deleted copy constructor
+        LogFileSink &operator=(const LogFileSink &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Append a line (a newline is added). Never blocks on I/O and never allocates.
+         * @param line Line to write. Truncated to `logSinkBufferBytes - 1` bytes.
+         */
+        void write(std::string_view line);
+
+        [[nodiscard]] inline uint64_t getDropped() const { //!< Number of lines dropped because all buffers were full
+            return dropped.load(std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * @brief Decompress a `.log.lz` segment written by `LogFileSink` without zlib
+     * @param in Compressed file
+     * @param out File to write the original log to
+     * @return True on success
+     */
+    bool decompressLogSegment(const std::string &in, const std::string &out);
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_LOG_SINK_HPP
@@ -0,0 +1,215 @@
+/**
+ * @file stms/metrics.hpp
+ * @brief Lock-free runtime metrics (counters, gauges, histograms) and a tiny Prometheus scrape endpoint.
+ * Created by grant on 11/30/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_METRICS_HPP
+#define NEWTONIAN_FOOTBALL_2D_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.hpp"
+
+namespace stms {
+    /**
+     * @brief Get the shard of the calling thread. Threads are assigned shards round-robin the first time they
+     *        touch a metric, so that threads hammering the same metric mostly hit different cache lines.
+     * @return Index in `[0, metricShards)`
+     */
+    inline size_t getMetricShard() {
+        static std::atomic_size_t nextShard = 0;
+        thread_local size_t val = nextShard.fetch_add(1, std::memory_order_relaxed) % metricShards;
+        return val;
+    }
+
+    /// Monotonically increasing counter. `add()` is a single relaxed atomic add on this thread's shard.
+    class Counter {
+    private:
+        struct alignas(64) Shard {
+            std::atomic_uint64_t val = 0;
+        };
+
+        std::array<Shard, metricShards> shards{};
+
+    public:
+        /**
+         * @brief Increment the counter
+         * @param n Amount to add
+         */
+        inline void add(uint64_t n = 1) {
+            shards[getMetricShard()].val.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] uint64_t get() const; //!< Sum of all shards. Slow-ish, meant for scraping.
+    };
+
+    /// Value that can go up and down. Updates are a single relaxed atomic store or add.
+    class Gauge {
+    private:
+        std::atomic<double> val = 0;
+
+    public:
+        inline void set(double v) { //!< Set the gauge to a value
+            val.store(v, std::memory_order_relaxed);
+        }
+
+        inline void add(double v) { //!< Add to the gauge (negative to subtract)
+            val.fetch_add(v, std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] inline double get() const { //!< Current value of the gauge
+            return val.load(std::memory_order_relaxed);
+        }
+    };
+
+    /// Histogram with fixed bucket upper bounds. `observe()` is 2 relaxed atomic adds on this thread's shard.
+    class Histogram {
+    public:
+        static constexpr size_t maxBuckets = 16; //!< Maximum number of (finite) bucket bounds
+
+    private:
+        struct alignas(64) Shard {
+            std::array<std::atomic_uint64_t, maxBuckets + 1> buckets{}; //!< Non-cumulative, last one is +Inf
+            std::atomic<double> sum = 0;
+        };
+
+        std::array<double, maxBuckets> bounds{};
+        size_t numBounds = 0;
+        std::array<Shard, metricShards> shards{};
+
+    public:
+        /**
+         * @brief Create a histogram
+         * @param bucketBounds Upper bounds of the buckets, in increasing order. At most `maxBuckets` are used.
+         */
+        explicit Histogram(std::initializer_list<double> bucketBounds);
+
+        /**
+         * @brief Record a value
+         * @param v Value to record
+         */
+        inline void observe(double v) {
+            size_t bucket = 0;
+            while (bucket < numBounds && v > bounds[bucket]) {
+                bucket++;
+            }
+
+            Shard &shard = shards[getMetricShard()];
+            shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            shard.sum.fetch_add(v, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Append this histogram in Prometheus text format. Internal implementation detail.
+         * @param name Name of the metric
+         * @param out String to append to
+         */
+        void render(const std::string &name, std::string &out) const;
+    };
+
+    /**
+     * @brief Set of named metrics. Registering takes a lock (do it once, at startup) and returns a reference that
+     *        stays valid for the lifetime of the registry; updating the metric through it is lock-free.
+     *        Registering an existing name again returns the existing metric.
+     */
+    class MetricsRegistry {
+    private:
+        enum class Type {
+            eCounter, eGauge, eHistogram, eCallback
+        };
+
+        struct Entry {
+            std::string name;
+            std::string help;
+            Type type;
+            std::unique_ptr<Counter> counter;
+            std::unique_ptr<Gauge> gauge;
+            std::unique_ptr<Histogram> histogram;
+            std::function<double()> callback;
+        };
+
+        std::mutex mtx; //!< Mutex to lock for accessing `entries`
+        std::vector<std::unique_ptr<Entry>> entries;
+        /// Metrics re-registered with a different type. They work, but aren't rendered: a name has one type.
+        std::vector<std::unique_ptr<Entry>> detached;
+
+        Entry *find(const std::string &name);
+
+    public:
+        // A name only ever has one type. Asking for it with another type logs an error and returns a metric that
+        // works but isn't exported, so a name is never rendered twice.
+
+        Counter &counter(const std::string &name, const std::string &help); //!< Get or register a counter
+        Gauge &gauge(const std::string &name, const std::string &help); //!< Get or register a gauge
+
+        /**
+         * @brief Get or register a histogram
+         * @param name Name of the metric
+         * @param help Description shown by Prometheus
+         * @param bounds Bucket upper bounds, in increasing order. Ignored if the histogram already exists.
+         * @return Reference to the histogram
+         */
+        Histogram &histogram(const std::string &name, const std::string &help, std::initializer_list<double> bounds);
+
+        /**
+         * @brief Register a gauge that is computed at scrape time, for values that are expensive or awkward to
+         *        track on the hot path. The callback runs on the scraping thread!
+         * @param name Name of the metric
+         * @param help Description shown by Prometheus
+         * @param func Function returning the current value
+         */
+        void callbackGauge(const std::string &name, const std::string &help, std::function<double()> func);
+
+        std::string render(); //!< Render all metrics in the Prometheus text exposition format
+    };
+
+    /// The process-wide metrics registry. Everything built into StoneMason registers here.
+    inline MetricsRegistry &getMetrics() {
+        static MetricsRegistry val;
+        return val;
+    }
+
+    /**
+     * @brief Minimal HTTP responder serving `getMetrics().render()` on a localhost TCP port. Every request gets
+     *        the metrics, regardless of method or path. Runs on its own thread.
+     */
+    class MetricsServer {
+    private:
+        std::thread thread;
+        std::atomic_bool running = false;
+        int listenFd = -1;
+
+        void run(); //!< Accept loop. Internal implementation detail.
+
+    public:
+        MetricsServer() = default; //!< Default constructor
+
+        virtual ~MetricsServer(); //!< Virtual destructor. Stops the server.
+
+        MetricsServer(const MetricsServer &rhs) = delete; //!< Deleted copy constructor
+        MetricsServer &operator=(const MetricsServer &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Start serving on `127.0.0.1`
+         * @param port TCP port to listen on
+         * @return True if the server is listening
+         */
+        bool start(uint16_t port = metricsPort);
+
+        void stop(); //!< Stop serving, blocking until the server thread exits
+    };
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_METRICS_HPP
@@ -0,0 +1,111 @@
+/**
+ * @file stms/ring_queue.hpp
+ * @brief Provides `RingQueue`, a FIFO queue that stops allocating once it has grown to its working size.
+ * Created by grant on 11/26/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_RING_QUEUE_HPP
+#define NEWTONIAN_FOOTBALL_2D_RING_QUEUE_HPP
+
+#include <utility>
+#include <vector>
+
+namespace stms {
+    /**
+     * @brief Drop-in for `std::queue` backed by a circular buffer. `std::queue` (i.e. `std::deque`) frees and
+     *        reallocates its chunks as elements flow through it; this only allocates when it has to grow.
+     *        NOT thread safe, lock it yourself.
+     * @tparam T Element type. Must be default constructible and move assignable.
+     */
+    template<typename T>
+    class RingQueue {
+    private:
+        std::vector<T> slots; //!< Circular buffer. Size is always 0 or a power of 2.
+        size_t head = 0; //!< Index of the front element
+        size_t count = 0; //!< Number of elements in the queue
+
+        void grow() {
+            std::vector<T> bigger(slots.empty() ? 16 : slots.size() * 2);
+            for (size_t i = 0; i < count; i++) {
+                bigger[i] = std::move(slots[(head + i) & (slots.size() - 1)]);
+            }
+            slots = std::move(bigger);
+            head = 0;
+        }
+
+    public:
+        RingQueue() = default; //!< Default constructor
+
+        virtual ~RingQueue() = default; //!< Default virtual destructor
+
+        /**
+         * @brief Move constructor
+         * @param rhs Right Hand Side of the `std::move`. Left empty.
+         */
+        RingQueue(RingQueue &&rhs) noexcept : slots(std::move(rhs.slots)), head(rhs.head), count(rhs.count) {
+            rhs.slots.clear();
+            rhs.head = 0;
+            rhs.count = 0;
+        }
+
+        /**
+         * @brief Move operator=
+         * @param rhs Right Hand Side of the `std::move`. Left empty.
+         * @return Reference to this instance
+         */
+        RingQueue &operator=(RingQueue &&rhs) noexcept {
+            if (&rhs != this) {
+                slots = std::move(rhs.slots);
+                head = rhs.head;
+                count = rhs.count;
+                rhs.slots.clear();
+                rhs.head = 0;
+                rhs.count = 0;
+            }
+            return *this;
+        }
+
+        [[nodiscard]] inline bool empty() const { //!< True if there are no elements
+            return count == 0;
+        }
+
+        [[nodiscard]] inline size_t size() const { //!< Number of elements in the queue
+            return count;
+        }
+
+        inline T &front() { //!< Get the oldest element. Undefined if empty!
+            return slots[head];
+        }
+
+        /**
+         * @brief Append an element to the back of the queue
+         * @param val Element to move in
+         */
+        void push(T &&val) {
+            if (count == slots.size()) {
+                grow();
+            }
+            slots[(head + count) & (slots.size() - 1)] = std::move(val);
+            count++;
+        }
+
+        /**
+         * @brief Construct an element in place at the back of the queue
+         * @param args Arguments for the constructor of `T`
+         */
+        template<typename... Args>
+        void emplace(Args &&... args) {
+            push(T(std::forward<Args>(args)...));
+        }
+
+        void pop() { //!< Remove the front element. Its slot is reset to a default `T` to release what it held.
+            slots[head] = T();
+            head = (head + 1) & (slots.size() - 1);
+            count--;
+        }
+    };
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_RING_QUEUE_HPP
@@ -0,0 +1,287 @@
+/**
+ * @file stms/script.hpp
+ * @brief Coroutine scripts (`Script`) resumed by a fixed-timestep loop through a `ScriptScheduler`, for match
+ *        flow and bot behaviors that would otherwise be state machines.
+ * Created by grant on 12/12/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_SCRIPT_HPP
+#define NEWTONIAN_FOOTBALL_2D_SCRIPT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "config.hpp"
+#include "thread.hpp"
+
+namespace stms {
+    class ScriptScheduler;
+
+    /**
+     * @brief Allocate memory for a coroutine frame from the script frame pool: size classes of
+     *        `scriptFrameGranularity` bytes up to `scriptMaxFrameBytes`, each a free list refilled
+     *        `scriptFramesPerChunk` frames at a time. Bigger frames go to the heap (and are counted).
+     *        Used by `Script::promise_type`, so spawning a script usually doesn't touch the heap.
+     * @param size Size of the frame in bytes
+     * @return The frame
+     */
+    void *allocScriptFrame(size_t size);
+
+    /**
+     * @brief Return a frame to the script frame pool
+     * @param ptr Frame from `allocScriptFrame`
+     * @param size Same `size` that was passed to `allocScriptFrame`
+     */
+    void freeScriptFrame(void *ptr, size_t size) noexcept;
+
+    /**
+     * @brief A coroutine run by a `ScriptScheduler`. Write it as a function returning `Script` that uses
+     *        `co_await nextTick()`, `co_await seconds(n)` or `co_await offload(pool, func)`, and hand the result
+     *        to `ScriptScheduler::spawn()`. It starts running on the next `ScriptScheduler::tick()`.
+     */
+    class Script {
+    public:
+        struct promise_type {
+            ScriptScheduler *scheduler = nullptr; //!< Set by `ScriptScheduler::spawn()`
+
+            static void *operator new(size_t size) {
+                return allocScriptFrame(size);
+            }
+
+            static void operator delete(void *ptr, size_t size) noexcept {
+                freeScriptFrame(ptr, size);
+            }
+
+            Script get_return_object() {
+                return Script(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { //!< Scripts only run inside `ScriptScheduler::tick()`
+                return {};
+            }
+
+            std::suspend_always final_suspend() noexcept { //!< The scheduler destroys finished scripts
+                return {};
+            }
+
+            void return_void() noexcept {}
+
+            void unhandled_exception() noexcept; //!< Logs the exception. The script ends, the game goes on.
+        };
+
+        using Handle = std::coroutine_handle<promise_type>;
+
+    private:
+        Handle handle;
+
+        friend class ScriptScheduler;
+
+        explicit Script(Handle h) : handle(h) {}
+
+    public:
+        Script(const Script &rhs) = delete; //!< Deleted copy constructor
+        Script &operator=(const Script &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Move constructor
+         * @param rhs Script to take over. It's left empty.
+         */
+        Script(Script &&rhs) noexcept : handle(std::exchange(rhs.handle, nullptr)) {}
+
+        /**
+         * @brief Move assignment operator
+         * @param rhs Script to take over. It's left empty.
+         * @return A reference to this instance
+         */
+        Script &operator=(Script &&rhs) noexcept {
+            if (this != &rhs) {
+                if (handle) {
+                    handle.destroy();
+                }
+                handle = std::exchange(rhs.handle, nullptr);
+            }
+            return *this;
+        }
+
+        virtual ~Script() { //!< Destroys the coroutine if it was never spawned
+            if (handle) {
+                handle.destroy();
+            }
+        }
+    };
+
+    /**
+     * @brief Resumes `Script`s from a fixed-timestep loop. Call `tick()` once per tick; every script waiting for
+     *        that tick is resumed on the calling thread, in the order they started waiting. All bookkeeping lives
+     *        in preallocated vectors, so a tick allocates nothing unless more scripts wait at once than ever before.
+     *
+     * Spawn, tick and destroy from one thread (or hand the scheduler over with proper synchronization, like
+     * starting a thread). Offloaded work is the exception: it runs on a `ThreadPool`, and the script is resumed on
+     * the ticking thread by the first `tick()` that finds it finished.
+     */
+    class ScriptScheduler {
+    private:
+        struct Sleeper {
+            uint64_t wakeTick;
+            uint64_t order; //!< Tie breaker, so scripts waking on the same tick resume in the order they slept
+            Script::Handle handle;
+
+            inline bool operator>(const Sleeper &rhs) const {
+                return wakeTick != rhs.wakeTick ? wakeTick > rhs.wakeTick : order > rhs.order;
+            }
+        };
+
+        float tickRate;
+        uint64_t tick_ = 0; //!< Number of `tick()`s so far
+        uint64_t sleepCount = 0; //!< Source of `Sleeper::order`
+
+        std::vector<Script::Handle> ready; //!< Resumed on the next `tick()`
+        std::vector<Script::Handle> resuming; //!< Scratch: `ready` is swapped in here while it's being resumed
+        std::vector<Sleeper> sleeping; //!< Min-heap by `wakeTick`
+
+        std::mutex offloadMtx; //!< Mutex to lock for accessing `offloaded`
+        std::vector<Script::Handle> offloaded; //!< Scripts whose offloaded work is done, pushed by pool workers
+        std::vector<Script::Handle> offloadResuming; //!< Scratch: `offloaded` is swapped in here while resumed
+        std::atomic_size_t offloadsInFlight = 0;
+        size_t numScripts = 0; //!< Spawned scripts that haven't finished
+
+        void resume(Script::Handle handle); //!< Resume a script, destroying it if it finished
+
+    public:
+        /**
+         * @brief Create a scheduler
+         * @param tickRate `tick()`s per second, for `seconds()`
+         */
+        explicit ScriptScheduler(float tickRate);
+
+        virtual ~ScriptScheduler(); //!< Waits for offloaded work in flight, then destroys every unfinished script
+
+        ScriptScheduler(const ScriptScheduler &rhs) = delete; //!< Deleted copy constructor
+        ScriptScheduler &operator=(const ScriptScheduler &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Start a script. It first runs on the next `tick()`.
+         * @param script Script to run. The scheduler takes it over.
+         */
+        void spawn(Script &&script);
+
+        void tick(); //!< Resume every script that is done waiting
+
+        [[nodiscard]] inline size_t getNumScripts() const { //!< Scripts spawned and not finished yet
+            return numScripts;
+        }
+
+        [[nodiscard]] inline uint64_t getTick() const { //!< Number of `tick()`s so far
+            return tick_;
+        }
+
+        // Used by the awaitables. Internal implementation details.
+
+        void scheduleNextTick(Script::Handle handle); //!< Resume on the next `tick()`
+
+        void scheduleIn(Script::Handle handle, uint64_t ticks); //!< Resume `ticks` ticks from now
+
+        [[nodiscard]] inline uint64_t secondsToTicks(float seconds) const {
+            return seconds <= 0 ? 0 : static_cast<uint64_t>(seconds * tickRate + 0.5f);
+        }
+
+        void beginOffload(); //!< Count an offload in flight
+
+        void endOffload(Script::Handle handle); //!< Called by a pool worker: the offloaded work of `handle` is done
+    };
+
+    /// Awaitable of `nextTick()`. Internal implementation detail.
+    struct NextTickAwaiter {
+        [[nodiscard]] inline bool await_ready() const noexcept {
+            return false;
+        }
+
+        inline void await_suspend(Script::Handle handle) const {
+            handle.promise().scheduler->scheduleNextTick(handle);
+        }
+
+        inline void await_resume() const noexcept {}
+    };
+
+    /// Awaitable of `seconds()`. Internal implementation detail.
+    struct SleepAwaiter {
+        float duration;
+
+        [[nodiscard]] inline bool await_ready() const noexcept {
+            return duration <= 0;
+        }
+
+        inline void await_suspend(Script::Handle handle) const {
+            ScriptScheduler *scheduler = handle.promise().scheduler;
+            scheduler->scheduleIn(handle, std::max<uint64_t>(1, scheduler->secondsToTicks(duration)));
+        }
+
+        inline void await_resume() const noexcept {}
+    };
+
+    /// Awaitable of `offload()`. Lives in the coroutine frame while the work runs. Internal implementation detail.
+    template<typename F>
+    struct OffloadAwaiter {
+        ThreadPool &pool;
+        F func;
+        TaskLane lane;
+
+        [[nodiscard]] inline bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(Script::Handle handle) {
+            ScriptScheduler *scheduler = handle.promise().scheduler;
+            scheduler->beginOffload();
+            // Only a few pointers are captured, so `submitDetached` fits it in the thread's `FrameArena`.
+            pool.submitDetached([this, scheduler, handle]() {
+                func();
+                scheduler->endOffload(handle);
+            }, lane);
+        }
+
+        inline void await_resume() const noexcept {}
+    };
+
+    /**
+     * @brief `co_await nextTick();` suspends the script until the next `ScriptScheduler::tick()`
+     * @return Awaitable
+     */
+    inline NextTickAwaiter nextTick() {
+        return {};
+    }
+
+    /**
+     * @brief `co_await seconds(n);` suspends the script for `n` seconds of game time, rounded to whole ticks
+     * @param n Seconds to wait. Doesn't suspend at all if it's 0 or less.
+     * @return Awaitable
+     */
+    inline SleepAwaiter seconds(float n) {
+        return SleepAwaiter{n};
+    }
+
+    /**
+     * @brief `co_await offload(pool, func);` runs `func` on a pool worker and resumes the script (on the ticking
+     *        thread, as always) in the first tick that finds it finished. `func` must not touch anything the script or
+     *        the ticking thread uses in the meantime!
+     * @param pool Pool to run `func` on
+     * @param func Work to run, as `func()`. Its result is discarded, capture a reference to return something.
+     * @param lane Priority class of the work
+     * @return Awaitable
+     */
+    template<typename F>
+    inline OffloadAwaiter<std::decay_t<F>> offload(ThreadPool &pool, F &&func, TaskLane lane = TaskLane::eNormal) {
+        return OffloadAwaiter<std::decay_t<F>>{pool, std::forward<F>(func), lane};
+    }
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_SCRIPT_HPP
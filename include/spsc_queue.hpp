@@ -0,0 +1,76 @@
+/**
+ * @file stms/spsc_queue.hpp
+ * @brief Provides `SpscQueue`, a fixed-capacity lock-free single-producer single-consumer FIFO.
+ * Created by grant on 12/3/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_SPSC_QUEUE_HPP
+#define NEWTONIAN_FOOTBALL_2D_SPSC_QUEUE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace stms {
+    /**
+     * @brief Bounded lock-free queue between exactly one producer thread and one consumer thread. Never allocates
+     *        and never blocks: `tryPush()` fails if the queue is full, `tryPop()` fails if it is empty.
+     * @tparam T Element type. Should be trivially copyable, elements are copied in and out.
+     * @tparam N Capacity. Must be a power of 2.
+     */
+    template<typename T, size_t N>
+    class SpscQueue {
+    private:
+        static_assert(N != 0 && (N & (N - 1)) == 0, "SpscQueue capacity must be a power of 2!");
+
+        std::array<T, N> slots{};
+        alignas(64) std::atomic_size_t head = 0; //!< Next slot to pop. Only written by the consumer.
+        alignas(64) std::atomic_size_t tail = 0; //!< Next slot to push. Only written by the producer.
+
+    public:
+        SpscQueue() = default; //!< Default constructor
+
+        virtual ~SpscQueue() = default; //!< Default virtual destructor
+
+        SpscQueue(const SpscQueue &rhs) = delete; //!< Deleted copy constructor
+        SpscQueue &operator=(const SpscQueue &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Append an element. Producer thread only.
+         * @param val Element to append
+         * @return False if the queue was full and nothing was pushed
+         */
+        inline bool tryPush(const T &val) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) >= N) {
+                return false;
+            }
+            slots[t & (N - 1)] = val;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @brief Remove the oldest element. Consumer thread only.
+         * @param out Overwritten with the element, if there is one
+         * @return False if the queue was empty
+         */
+        inline bool tryPop(T &out) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            out = slots[h & (N - 1)];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        [[nodiscard]] static constexpr size_t capacity() { //!< Maximum number of elements in the queue
+            return N;
+        }
+    };
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_SPSC_QUEUE_HPP
@@ -9,13 +9,71 @@
 
 
 #include <queue>
+#include <array>
+#include <chrono>
 #include <cinttypes>
 #include <future>
+#include <type_traits>
+#include "affinity.hpp"
 #include "config.hpp"
+#include "frame_arena.hpp"
+#include "ring_queue.hpp"
 
 namespace stms {
     class ThreadPool;
 
+    /// Type-erased callable for `ThreadPool::submitDetached`. Internal implementation detail.
+    struct DetachedCallableBase {
+        virtual ~DetachedCallableBase() = default;
+
+        virtual void operator()() = 0;
+    };
+
+    /// Type-erased callable for `ThreadPool::submitDetached`. Internal implementation detail.
+    template<typename F>
+    struct DetachedCallable : public DetachedCallableBase {
+        F func;
+
+        explicit DetachedCallable(F &&f) : func(std::move(f)) {}
+
+        explicit DetachedCallable(const F &f) : func(f) {}
+
+        void operator()() override {
+            func();
+        }
+    };
+
+    /**
+     * @brief Priority class of a `ThreadPool` task. Each lane has its own queue; which one a worker picks from next
+     *        is decided by `ThreadPool::setLaneScheduling`.
+     */
+    enum class TaskLane : uint8_t {
+        eFrameCritical, //!< Something a frame or tick is waiting on right now
+        eNormal, //!< Everything else
+        eBackground, //!< Nobody is waiting on it, e.g. logging or writing files. May be delayed indefinitely.
+        eCount
+    };
+
+    constexpr size_t numTaskLanes = static_cast<size_t>(TaskLane::eCount);
+
+    /// A task in the `ThreadPool` queue. Exactly one of the callables is set. Internal implementation detail.
+    struct PoolTask {
+        std::packaged_task<void(void)> packaged; //!< Set by `submitTask`
+        void (*func)(void) = nullptr; //!< Set by `submitDetached` for plain function pointers
+        FramePtr<DetachedCallableBase> callable; //!< Set by `submitDetached` for anything else
+        std::chrono::steady_clock::time_point enqueued; //!< For the queue wait metrics
+
+        inline void operator()() {
+            if (func != nullptr) {
+                func();
+            } else if (callable) {
+                (*callable)();
+            } else {
+                packaged();
+            }
+        }
+    };
+
     static void workerFunc(ThreadPool *parent, size_t index); //!< Internal implementation detail. Don't touch.
 
     /**
@@ -28,19 +86,47 @@ namespace stms {
         std::mutex unfinishedTaskMtx; //!< Mutex to lock for accessing `unfinishedTasks`. Internal impl detail.
 
         std::condition_variable taskQueueCv; //!< Condition variable for blocking workers until there are jobs.
+        /// Like `taskQueueCv`, but for the workers reserved for each lane, so they can be woken without waking
+        /// everyone else (and vice versa). See `setReservedWorkers()`.
+        std::array<std::condition_variable, numTaskLanes> reservedCvs;
         std::condition_variable unfinishedTasksCv; //!< Condition variable used for blocking in `waitIdle()`.
 
         unsigned short unfinishedTasks = 0; //!< Number of tasks that are incomplete.
-        std::queue<std::packaged_task<void(void)>> tasks; //!< Queue of tasks to execute
+        std::array<RingQueue<PoolTask>, numTaskLanes> tasks; //!< Queue of tasks to execute, per lane
         std::deque<std::thread> workers; //!< A list of worker threads.
 
+        bool strictLanes = poolStrictLanes; //!< See `setLaneScheduling()`
+        std::array<unsigned, numTaskLanes> laneWeights{poolLaneWeights[0], poolLaneWeights[1], poolLaneWeights[2]};
+        std::array<int64_t, numTaskLanes> laneCredits{}; //!< Smooth weighted round robin state. Internal impl detail.
+        std::array<unsigned, numTaskLanes> reservedWorkers{}; //!< See `setReservedWorkers()`
+
         std::atomic_bool running = false; //!< True if the thread pool is running. (Duh)
         size_t stopRequest = 0; //!< The thread ID that we request to stop.
+        ThreadPlacement placement; //!< Applied by every worker when it starts
 
         friend void workerFunc(ThreadPool *parent, size_t index); //!< Static worker function. Internal impl detail.
 
         void destroy(); //!< Destroy the thread pool. The functionality of the destructor needs to be invoked elsewhere.
 
+        void enqueue(PoolTask &&task, TaskLane lane); //!< Push a task to `tasks` and wake a worker. Internal detail.
+
+        /// Lane the worker `index` is reserved for, or `TaskLane::eCount` if it isn't. Lock `taskQueueMtx`!
+        [[nodiscard]] TaskLane getReservation(size_t index) const;
+
+        /// Condition variable the worker `index` waits on. Lock `taskQueueMtx`! Internal implementation detail.
+        [[nodiscard]] std::condition_variable &getWaitCv(size_t index);
+
+        void notifyAllWorkers(); //!< Wake every worker, whichever condition variable it waits on. Internal detail.
+
+        /// True if the worker `index` may run any of the queued tasks. Lock `taskQueueMtx`! Internal impl detail.
+        [[nodiscard]] bool hasTaskFor(size_t index) const;
+
+        /// Pick the lane the worker `index` runs a task from next. `hasTaskFor(index)` must be true. Lock
+        /// `taskQueueMtx`! Internal implementation detail.
+        TaskLane pickLane(size_t index);
+
+        static void observeWait(TaskLane lane, const PoolTask &task); //!< Record queue wait time. Internal impl detail.
+
     public:
         /// Deleted copy constructor
         ThreadPool &operator=(const ThreadPool &rhs) = delete;
@@ -82,9 +168,58 @@ namespace stms {
         /**
          * @brief Submit a function to the thread pool for execution (if the `ThreadPool` is started).
          * @param func Function to execute
+         * @param lane Priority class of the task
          * @return A void future that you can wait on to block until the task is finished.
          */
-        std::future<void> submitTask(const std::function<void(void)> &func);
+        std::future<void> submitTask(const std::function<void(void)> &func, TaskLane lane = TaskLane::eNormal);
+
+        /**
+         * @brief Submit a function for execution without a future, for fire-and-forget tasks on hot paths.
+         *        Plain function pointers are queued without allocating anything. Other callables are copied
+         *        into this thread's `FrameArena` (see `makeFramePtr`), or onto the heap if there is none.
+         *        Unlike `submitTask`, there's no `std::function` or `std::packaged_task` involved.
+         * @param func Function to execute
+         * @param lane Priority class of the task
+         */
+        template<typename F>
+        void submitDetached(F &&func, TaskLane lane = TaskLane::eNormal) {
+            PoolTask task;
+            if constexpr (std::is_convertible_v<F, void (*)(void)>) {
+                task.func = func;
+            } else {
+                task.callable = makeFramePtr<DetachedCallable<std::decay_t<F>>>(std::forward<F>(func));
+            }
+            enqueue(std::move(task), lane);
+        }
+
+        /**
+         * @brief Choose how idle workers pick between lanes that all have tasks queued
+         * @param strict If true, a lane is only picked when every higher priority lane is empty. Otherwise lanes
+         *               are picked in proportion to `weights` (smooth weighted round robin), so lower lanes can't
+         *               starve.
+         * @param weights Weight of each lane, in `TaskLane` order. Ignored if `strict`.
+         */
+        void setLaneScheduling(bool strict, const std::array<unsigned, numTaskLanes> &weights);
+
+        /**
+         * @brief Reserve workers for one lane: they run that lane's tasks only, so it's never stuck behind others.
+         *        Workers are reserved by index (the first ones for `eFrameCritical`, then `eNormal`, then
+         *        `eBackground`); the rest take tasks from every lane. Keep at least one unreserved worker, or lanes
+         *        without a reservation are never run!
+         * @param lane Lane to reserve workers for
+         * @param count Number of workers to reserve, 0 to remove the reservation
+         */
+        void setReservedWorkers(TaskLane lane, unsigned count);
+
+        /**
+         * @brief Set where the workers run. Only affects workers started afterwards, so call it before `start()`!
+         * @param newPlacement Placement of the workers. Worker `i` (counting from 1) is pinned to
+         *                     `cpus[(i - 1) % cpus.size()]`.
+         */
+        inline void setPlacement(ThreadPlacement newPlacement) {
+            std::lock_guard<std::mutex> lg(this->workerMtx);
+            placement = std::move(newPlacement);
+        }
 
         void pushThread(); //!< Add 1 worker thread to the thread pool
 
@@ -113,6 +248,31 @@ namespace stms {
             return unfinishedTasks;
         }
 
+        /**
+         * @brief Query the number of tasks waiting in the queue (i.e. not yet picked up by a worker)
+         * @param lane Lane to query, or `TaskLane::eCount` for all of them
+         * @return Length of the task queue
+         */
+        inline size_t getQueueDepth(TaskLane lane = TaskLane::eCount) {
+            std::lock_guard<std::mutex> lg(this->taskQueueMtx);
+            if (lane != TaskLane::eCount) {
+                return tasks[static_cast<size_t>(lane)].size();
+            }
+
+            size_t ret = 0;
+            for (const auto &queue : tasks) {
+                ret += queue.size();
+            }
+            return ret;
+        }
+
+        /**
+         * @brief Register callback gauges for this pool's queue depth (per lane) and unfinished tasks in
+         *        `getMetrics()`. The pool must outlive any scrape of the registry!
+         * @param name Name of the pool, used as part of the metric names (e.g. `main` for `stms_pool_main_...`)
+         */
+        void registerMetrics(const std::string &name);
+
         /**
          * @brief Block until all tasks in the thread pool are finished (aka the thread pool is *idle*)
          * @param timeout Maximum number of milliseconds to block for. If set to 0, this will block infinitely
@@ -129,6 +289,15 @@ namespace stms {
     };
 
     static void workerFunc(ThreadPool *parent, size_t index) {
+        ThreadPlacement placement;
+        {
+            std::lock_guard<std::mutex> lg(parent->workerMtx);
+            placement = parent->placement;
+        }
+        if (!placement.isDefault()) {
+            applyPlacement(placement, index);
+        }
+
         while (parent->running) {
             if (index == parent->stopRequest) {
                 parent->stopRequest = 0;
@@ -136,17 +305,22 @@ namespace stms {
             }
 
             std::unique_lock<std::mutex> tlg(parent->taskQueueMtx);
-            // Block until there are tasks to consume or we are requested to stop
-            if (parent->tasks.empty()) {
-                parent->taskQueueCv.wait_for(tlg, std::chrono::milliseconds(threadPoolConvarTimeoutMs), [&]() {
-                    return (!parent->tasks.empty()) || index == parent->stopRequest || (!parent->running);
+            // Block until there are tasks this worker may run, or we are requested to stop
+            if (!parent->hasTaskFor(index)) {
+                parent->getWaitCv(index).wait_for(tlg, std::chrono::milliseconds(threadPoolConvarTimeoutMs), [&]() {
+                    return parent->hasTaskFor(index) || index == parent->stopRequest || (!parent->running);
                 });
-            } else if (!parent->tasks.empty()) {
-                auto front = std::move(parent->tasks.front());
-                parent->tasks.pop();
-                tlg.unlock();
-
-                front(); // execute the task UwU
+            } else {
+                TaskLane lane = parent->pickLane(index);
+                auto &queue = parent->tasks[static_cast<size_t>(lane)];
+                {
+                    auto front = std::move(queue.front());
+                    queue.pop();
+                    tlg.unlock();
+
+                    ThreadPool::observeWait(lane, front);
+                    front(); // execute the task UwU
+                } // destroyed before it counts as finished, so its `FrameArena` pin is released by `waitIdle()`
 
                 std::lock_guard<std::mutex> lg(parent->unfinishedTaskMtx);
                 parent->unfinishedTasks--;
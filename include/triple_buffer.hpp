@@ -0,0 +1,81 @@
+/**
+ * @file stms/triple_buffer.hpp
+ * @brief Provides `TripleBuffer`, a lock-free single-producer single-consumer "latest value" channel.
+ * Created by grant on 11/25/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_TRIPLE_BUFFER_HPP
+#define NEWTONIAN_FOOTBALL_2D_TRIPLE_BUFFER_HPP
+
+#include <atomic>
+#include <cinttypes>
+
+namespace stms {
+    /**
+     * @brief Lock-free triple buffer. One thread writes into the back buffer and `publish()`es it, another
+     *        thread `update()`s to grab the most recently published buffer. Neither side ever blocks or waits
+     *        on the other; if the writer is faster, intermediate buffers are simply skipped.
+     * @tparam T Type of the buffered value. Should be cheap to overwrite in place (no per-publish allocations).
+     */
+    template<typename T>
+    class TripleBuffer {
+    private:
+        static constexpr uint8_t indexMask = 0b11; //!< Bits of `middle` holding the buffer index
+        static constexpr uint8_t dirtyBit = 0b100; //!< Set in `middle` if it holds a buffer not yet read
+
+        T buffers[3]{}; //!< The three buffers. Which one is which is tracked by the indices below.
+
+        /// Index of the buffer that is neither being written nor read (plus `dirtyBit`). The only shared state.
+        alignas(64) std::atomic_uint8_t middle = 1;
+
+        alignas(64) uint8_t back = 0; //!< Index of the buffer the writer owns. Only touched by the writer.
+        alignas(64) uint8_t front = 2; //!< Index of the buffer the reader owns. Only touched by the reader.
+
+    public:
+        TripleBuffer() = default; //!< Default constructor
+
+        virtual ~TripleBuffer() = default; //!< Default virtual destructor
+
+        TripleBuffer(const TripleBuffer &rhs) = delete; //!< Deleted copy constructor
+        TripleBuffer &operator=(const TripleBuffer &rhs) = delete; //!< Deleted copy assignment operator
+
+        /**
+         * @brief Get the buffer to write into. Writer thread only. Its contents are stale (from an older publish),
+         *        so it should be overwritten entirely.
+         * @return Reference to the back buffer
+         */
+        inline T &getWriteBuffer() {
+            return buffers[back];
+        }
+
+        /// Publish the back buffer, making it the latest value for the reader. Writer thread only.
+        inline void publish() {
+            back = middle.exchange(back | dirtyBit, std::memory_order_acq_rel) & indexMask;
+        }
+
+        /**
+         * @brief Grab the latest published buffer, if there is a new one. Reader thread only. Never blocks.
+         * @return True if the read buffer changed, false if nothing new was published since the last call.
+         */
+        inline bool update() {
+            if (!(middle.load(std::memory_order_relaxed) & dirtyBit)) {
+                return false;
+            }
+
+            front = middle.exchange(front, std::memory_order_acq_rel) & indexMask;
+            return true;
+        }
+
+        /**
+         * @brief Get the buffer most recently grabbed by `update()`. Reader thread only.
+         * @return Reference to the front buffer
+         */
+        inline const T &getReadBuffer() const {
+            return buffers[front];
+        }
+    };
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_TRIPLE_BUFFER_HPP
@@ -0,0 +1,134 @@
+/**
+ * @file stms/watchdog.hpp
+ * @brief Provides `FrameProfiler` (scoped timing zones for the last few frames) and `TickWatchdog`, which dumps
+ *        diagnostics to a file whenever a tick goes over budget.
+ * Created by grant on 12/1/20.
+ */
+
+#pragma once
+
+#ifndef NEWTONIAN_FOOTBALL_2D_WATCHDOG_HPP
+#define NEWTONIAN_FOOTBALL_2D_WATCHDOG_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+
+namespace stms {
+    class ThreadPool;
+
+    /**
+     * @brief Records named timing zones for the last `profilerFrames` frames of ONE thread. Recording a zone is
+     *        two clock reads and a store into a preallocated ring; nothing is allocated or locked.
+     */
+    class FrameProfiler {
+    public:
+        struct Zone {
+            const char *name; //!< Must be a string literal (or otherwise outlive the profiler)
+            float startMs; //!< Start of the zone, relative to the start of the frame
+            float durationMs;
+            uint8_t depth; //!< Nesting depth, 0 for top-level zones
+        };
+
+        struct Frame {
+            uint64_t index = 0; //!< Number of the frame, counting from 1. 0 if this slot was never used.
+            std::chrono::steady_clock::time_point start;
+            std::array<Zone, maxProfilerZones> zones{};
+            uint32_t numZones = 0;
+        };
+
+        /// RAII zone. Times everything from construction to destruction.
+        class Scope {
+        private:
+            FrameProfiler &parent;
+            uint32_t slot; //!< Index of the zone in the current frame, or `UINT32_MAX` if the frame was full
+            std::chrono::steady_clock::time_point start;
+
+        public:
+            Scope(FrameProfiler &profiler, const char *name);
+
+            virtual ~Scope();
+
+            Scope(const Scope &rhs) = delete; //!< Deleted copy constructor
+            Scope &operator=(const Scope &rhs) = delete; //!< Deleted copy assignment operator
+        };
+
+    private:
+        std::array<Frame, profilerFrames> frames{};
+        uint64_t frameCount = 0;
+        uint8_t depth = 0; //!< Current nesting depth of `Scope`s
+
+        inline Frame &current() {
+            return frames[frameCount % profilerFrames];
+        }
+
+    public:
+        void beginFrame(); //!< Start recording a new frame, overwriting the oldest one
+
+        /**
+         * @brief Append the recorded frames, oldest first, in a human readable format
+         * @param out String to append to
+         */
+        void dump(std::string &out) const;
+    };
+
+    /**
+     * @brief Watches tick durations. When one exceeds the budget, a report is written to
+     *        `${watchdogDir}/<date>-<time>_tick<n>.txt` with the profiler zones of the last frames, the
+     *        `ThreadPool` backlog, the log queue depth and whatever the dump hooks add (e.g. a physics summary).
+     *
+     * Within budget, `check()` is a single comparison. Reports are rate limited by `watchdogCooldownMs`, and the
+     * file is written on the pool so the already late thread isn't slowed down further.
+     */
+    class TickWatchdog {
+    private:
+        float budgetMs;
+        FrameProfiler *profiler;
+        ThreadPool *pool;
+        std::vector<std::function<void(std::string &)>> hooks;
+
+        std::chrono::steady_clock::time_point lastDump{};
+        uint64_t tick = 0;
+        uint64_t overruns = 0;
+
+        void report(float tickMs); //!< Collect diagnostics and write them out. Internal implementation detail.
+
+    public:
+        /**
+         * @brief Create a watchdog
+         * @param budgetMs Maximum duration of a tick in milliseconds before diagnostics are captured
+         * @param profiler Profiler of the watched thread, or `nullptr` to not dump any zones
+         * @param pool Pool whose backlog to report and to write the file on. If `nullptr`, the file is written
+         *             synchronously.
+         */
+        TickWatchdog(float budgetMs, FrameProfiler *profiler, ThreadPool *pool);
+
+        /**
+         * @brief Add a function that appends extra diagnostics to every report. Called on the watched thread.
+         * @param hook Function appending to the report
+         */
+        void addDumpHook(std::function<void(std::string &)> hook);
+
+        /**
+         * @brief Register the duration of a tick. Call once per tick, e.g. with `Stopwatch::getTime()`.
+         * @param tickMs How long the tick took, in milliseconds
+         */
+        inline void check(float tickMs) {
+            tick++;
+            if (tickMs > budgetMs) {
+                report(tickMs);
+            }
+        }
+
+        [[nodiscard]] inline uint64_t getOverruns() const { //!< Number of ticks that went over budget
+            return overruns;
+        }
+    };
+}
+
+#endif //NEWTONIAN_FOOTBALL_2D_WATCHDOG_HPP
@@ -0,0 +1,174 @@
+//
+// Created by grant on 12/12/20.
+//
+
+#include "affinity.hpp"
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <fstream>
+
+#include "log.hpp"
+
+namespace stms {
+
+    /// Node masks passed to the kernel have room for this many nodes, way more than any machine we run on.
+    static constexpr size_t maxNumaNodes = 1024;
+    static constexpr size_t nodeMaskLongs = maxNumaNodes / (sizeof(unsigned long) * CHAR_BIT);
+
+    std::vector<int> parseCpuList(std::string_view list) {
+        std::vector<int> ret;
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view entry = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            while (!entry.empty() && (entry.back() == '\n' || entry.back() == ' ')) {
+                entry.remove_suffix(1);
+            }
+            if (entry.empty()) {
+                continue;
+            }
+
+            const char *entryEnd = entry.data() + entry.size();
+            int first = 0, last = 0;
+            std::from_chars_result res = std::from_chars(entry.data(), entryEnd, first);
+            last = first;
+            if (res.ec == std::errc() && res.ptr != entryEnd && *res.ptr == '-') {
+                res = std::from_chars(res.ptr + 1, entryEnd, last);
+            }
+            if (res.ec != std::errc() || res.ptr != entryEnd || first < 0 || last < first) {
+                WARN("Ignoring malformed CPU list entry `{}`!", entry);
+                continue;
+            }
+
+            for (int cpu = first; cpu <= last; cpu++) {
+                ret.push_back(cpu);
+            }
+        }
+        return ret;
+    }
+
+    std::vector<int> getNumaNodeCpus(int node) {
+        std::ifstream in(fmt::format("/sys/devices/system/node/node{}/cpulist", node));
+        std::string list;
+        if (node < 0 || !std::getline(in, list)) {
+            return {};
+        }
+        return parseCpuList(list);
+    }
+
+    static bool preferNode(int node) {
+        unsigned long mask[nodeMaskLongs]{};
+        mask[node / (sizeof(unsigned long) * CHAR_BIT)] = 1ul << (node % (sizeof(unsigned long) * CHAR_BIT));
+        // +1: the kernel ignores the last bit of `maxnode`, see the BUGS section of set_mempolicy(2)
+        return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, maxNumaNodes + 1) == 0;
+    }
+
+    bool applyPlacement(const ThreadPlacement &placement, size_t index) {
+        bool ok = true;
+
+        if (!placement.name.empty()) {
+            std::string name = index == 0 ? placement.name : fmt::format("{}-{}", placement.name, index);
+            name.resize(std::min<size_t>(name.size(), 15)); // the kernel's limit, longer names are refused
+            pthread_setname_np(pthread_self(), name.c_str());
+        }
+
+        std::vector<int> cpus = placement.cpus.empty() ? getNumaNodeCpus(placement.numaNode) : placement.cpus;
+        if (!cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (index != 0 && !placement.cpus.empty()) {
+                CPU_SET(cpus[(index - 1) % cpus.size()], &set); // pool workers get one CPU each, round robin
+            } else {
+                // Lone threads, and workers placed by node only, may use all of them, so the scheduler can still
+                // balance within the node.
+                for (int cpu : cpus) {
+                    CPU_SET(cpu, &set);
+                }
+            }
+
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (err != 0) {
+                WARN("Failed to pin thread `{}` (#{}) to its CPUs: {}", placement.name, index, std::strerror(err));
+                ok = false;
+            }
+        }
+
+        if (placement.numaNode >= 0) {
+            if (placement.numaNode >= static_cast<int>(maxNumaNodes) || !preferNode(placement.numaNode)) {
+                WARN("Failed to prefer memory from NUMA node {} for thread `{}`: {}", placement.numaNode,
+                     placement.name, std::strerror(errno));
+                ok = false;
+            }
+        }
+
+        if (placement.priority > 0) {
+            sched_param param{};
+            param.sched_priority = placement.priority;
+            int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (err != 0) {
+                WARN("Failed to give thread `{}` SCHED_FIFO priority {}: {}. Grant CAP_SYS_NICE or raise "
+                     "RLIMIT_RTPRIO to allow it.", placement.name, placement.priority, std::strerror(err));
+                ok = false;
+            }
+        } else if (placement.priority < 0) {
+            // On Linux, nice values are per thread, so this leaves the rest of the process alone.
+            if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), placement.priority) != 0) {
+                WARN("Failed to set the nice value of thread `{}` to {}: {}", placement.name, placement.priority,
+                     std::strerror(errno));
+                ok = false;
+            }
+        }
+
+        return ok;
+    }
+
+    NumaScope::NumaScope(int node) {
+        if (node < 0) {
+            return;
+        }
+        if (node >= static_cast<int>(maxNumaNodes)) {
+            WARN("NUMA node {} is out of range, ignoring it!", node);
+            return;
+        }
+
+        int mode = 0;
+        oldNodes.assign(nodeMaskLongs, 0);
+        if (syscall(SYS_get_mempolicy, &mode, oldNodes.data(), maxNumaNodes, nullptr, 0) != 0) {
+            WARN("Failed to query the memory policy: {}", std::strerror(errno));
+            return;
+        }
+        if (!preferNode(node)) {
+            WARN("Failed to prefer memory from NUMA node {}: {}", node, std::strerror(errno));
+            return;
+        }
+        oldMode = mode;
+    }
+
+    NumaScope::~NumaScope() {
+        restore();
+    }
+
+    void NumaScope::restore() {
+        if (oldMode < 0) {
+            return;
+        }
+
+        bool noNodes = oldMode == MPOL_DEFAULT || oldMode == MPOL_LOCAL;
+        if (syscall(SYS_set_mempolicy, oldMode, noNodes ? nullptr : oldNodes.data(), noNodes ? 0 : maxNumaNodes + 1)
+            != 0) {
+            WARN("Failed to restore the memory policy: {}", std::strerror(errno));
+        }
+        oldMode = -1;
+    }
+}
@@ -0,0 +1,38 @@
+//
+// Created by grant on 11/26/20.
+//
+
+#pragma once
+
+#ifndef ALLOC_COUNTER_CPP_INCLUDED
+#define ALLOC_COUNTER_CPP_INCLUDED
+
+#include "config.hpp"
+#include "frame_arena.hpp"
+
+#include <cstdlib>
+#include <new>
+
+#ifdef COUNT_FRAME_ALLOCS
+// Replacements of the global `operator new`/`operator delete` that count allocations per thread.
+// The game loop compares `stms::getThreadNewCount()` across a frame to catch steady-state heap allocations.
+
+void *operator new(size_t size) {
+    stms::getThreadNewCount()++;
+    void *ret = std::malloc(size == 0 ? 1 : size);
+    if (ret == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+#endif
@@ -0,0 +1,139 @@
+//
+// Created by grant on 12/11/20.
+//
+
+#pragma once
+
+#ifndef ASSETS_CPP_INCLUDED
+#define ASSETS_CPP_INCLUDED
+
+#include "config.hpp"
+#include "log.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Bundle layout: a `BundleHeader`, `numImages` `BundleImage`s, then the pixels of every image. Pixels are
+// `SDL_PIXELFORMAT_RGBA32` (bytes R, G, B, A), rows tightly packed, each image starting on a `bundleAlignment`
+// boundary. Everything is in host byte order; bundles are built on the machine (or at least the arch) using them.
+
+constexpr char bundleMagic[4] = {'N', 'F', '2', 'B'};
+constexpr uint32_t bundleVersion = 1;
+constexpr uint64_t bundleAlignment = 64;
+
+struct BundleHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numImages;
+    uint32_t reserved;
+};
+
+struct BundleImage {
+    char name[48]; //!< File name in `res/`, e.g. `ball.png`. Null-terminated.
+    uint32_t width, height;
+    uint64_t offset; //!< From the start of the bundle
+    uint64_t bytes; //!< `width * height * 4`
+};
+
+/**
+ * @brief Read-only view of an asset bundle made by `pack_assets`. The whole file is mapped; pixels are handed out
+ *        as pointers into the mapping, so loading an image copies nothing until it is uploaded as a texture.
+ */
+class AssetBundle {
+private:
+    void *map = nullptr;
+    size_t size = 0;
+    const BundleHeader *header = nullptr;
+    const BundleImage *images = nullptr;
+
+public:
+    AssetBundle() = default;
+
+    AssetBundle(const AssetBundle &rhs) = delete; //!< Deleted copy constructor
+    AssetBundle &operator=(const AssetBundle &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~AssetBundle() {
+        if (map != nullptr) {
+            munmap(map, size);
+        }
+    }
+
+    /**
+     * @brief Map a bundle
+     * @param path Bundle to map
+     * @return False if the bundle is missing or invalid. Invalid bundles are logged, missing ones are not.
+     */
+    bool open(const char *path = assetBundlePath) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(BundleHeader)) {
+            WARN("Asset bundle `{}` is truncated!", path);
+            close(fd);
+            return false;
+        }
+
+        size = static_cast<size_t>(st.st_size);
+        map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping keeps the file alive
+        if (map == MAP_FAILED) {
+            WARN("Failed to map asset bundle `{}`: {}", path, std::strerror(errno));
+            map = nullptr;
+            return false;
+        }
+        madvise(map, size, MADV_WILLNEED); // every image is used right away
+
+        header = static_cast<const BundleHeader *>(map);
+        images = reinterpret_cast<const BundleImage *>(header + 1);
+        bool valid = std::memcmp(header->magic, bundleMagic, sizeof(bundleMagic)) == 0
+                     && header->version == bundleVersion
+                     && sizeof(BundleHeader) + header->numImages * sizeof(BundleImage) <= size;
+        for (uint32_t i = 0; valid && i < header->numImages; i++) {
+            valid = images[i].offset + images[i].bytes <= size
+                    && images[i].bytes == static_cast<uint64_t>(images[i].width) * images[i].height * 4;
+        }
+
+        if (!valid) {
+            WARN("Asset bundle `{}` is invalid or from another version, ignoring it!", path);
+            munmap(map, size);
+            map = nullptr;
+            header = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline bool isOpen() const {
+        return header != nullptr;
+    }
+
+    /**
+     * @brief Find an image
+     * @param name File name the image was packed from, e.g. `ship.png`
+     * @return The image, or `nullptr` if it isn't in the bundle
+     */
+    [[nodiscard]] const BundleImage *find(std::string_view name) const {
+        for (uint32_t i = 0; header != nullptr && i < header->numImages; i++) {
+            if (name == std::string_view(images[i].name, strnlen(images[i].name, sizeof(images[i].name)))) {
+                return &images[i];
+            }
+        }
+        return nullptr;
+    }
+
+    [[nodiscard]] inline const void *getPixels(const BundleImage &image) const { //!< RGBA32, pitch `width * 4`
+        return static_cast<const char *>(map) + image.offset;
+    }
+};
+
+#endif
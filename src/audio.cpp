@@ -0,0 +1,218 @@
+//
+// Created by grant on 12/8/20.
+//
+
+#pragma once
+
+#ifndef AUDIO_CPP_INCLUDED
+#define AUDIO_CPP_INCLUDED
+
+#include "game.cpp"
+#include "sound.cpp"
+#include "metrics.hpp"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_mixer.h>
+
+#include <algorithm>
+#include <array>
+
+/**
+ * @brief Plays `SoundEvent`s through SDL_mixer with a fixed pool of voices. Every sound is decoded once, when the
+ *        system is created. Events are drained once per frame and merged per source, so a scrum of bodies
+ *        hitting each other over several ticks is one voice per body pair. When every voice is busy, the one with
+ *        the lowest priority (weakest and closest to finishing) is stolen if the new sound beats it.
+ *
+ * Looped sounds (thrust) keep their voice for as long as events from the same source keep coming, and fade out
+ * once none came for `soundLoopTimeoutMs`. Events come once per tick, so a frame often has none.
+ */
+class AudioSystem {
+private:
+    struct Voice {
+        SoundId sound = SoundId::eCount;
+        uint64_t key = 0; //!< `SoundEvent::key()` of the source
+        float priority = 0; //!< Priority when started. One-shots lose it as they play, see `effectivePriority()`.
+        uint32_t startMs = 0; //!< `SDL_GetTicks()` when started
+        uint32_t lastEventMs = 0; //!< `SDL_GetTicks()` when a looped voice was last refreshed
+        bool looping = false;
+    };
+
+    struct Sound {
+        Mix_Chunk *chunk = nullptr; //!< `nullptr` if it failed to load. It is silent then.
+        uint32_t durationMs = 0;
+        float basePriority = 0; //!< Added to the 0-1 volume to get the priority of a voice
+        bool loop = false;
+    };
+
+    bool open = false;
+    std::array<Sound, static_cast<size_t>(SoundId::eCount)> sounds{};
+    std::array<Voice, soundVoices> voices{};
+    SoundBatch batch;
+
+    stms::Counter &stolen = stms::getMetrics().counter("nf2_audio_voices_stolen_total",
+                                                       "Voices cut off to play a higher priority sound");
+    stms::Counter &dropped = stms::getMetrics().counter("nf2_audio_sounds_dropped_total",
+                                                        "Sounds not played because every voice had a higher priority");
+    stms::Gauge &active = stms::getMetrics().gauge("nf2_audio_voices_active", "Voices playing");
+
+    void load(SoundId id, const char *path, float basePriority, bool loop) {
+        Sound &sound = sounds[static_cast<size_t>(id)];
+        sound.basePriority = basePriority;
+        sound.loop = loop;
+
+        sound.chunk = Mix_LoadWAV(path); // decodes the whole file into the output format
+        if (sound.chunk == nullptr) {
+            WARN("Failed to load sound `{}`: {}. It won't play!", path, Mix_GetError());
+            return;
+        }
+
+        int freq, channels;
+        uint16_t format;
+        if (Mix_QuerySpec(&freq, &format, &channels) != 0) {
+            uint32_t bytesPerFrame = SDL_AUDIO_BITSIZE(format) / 8 * channels;
+            sound.durationMs = static_cast<uint32_t>(static_cast<uint64_t>(sound.chunk->alen) * 1000
+                                                     / (bytesPerFrame * freq));
+        }
+    }
+
+    [[nodiscard]] float effectivePriority(int ch, uint32_t nowMs) const {
+        const Voice &voice = voices[ch];
+        if (voice.looping) {
+            return voice.priority;
+        }
+
+        const Sound &sound = sounds[static_cast<size_t>(voice.sound)];
+        float left = sound.durationMs == 0 ? 1 : 1 - std::min(1.0f, static_cast<float>(nowMs - voice.startMs)
+                                                                    / static_cast<float>(sound.durationMs));
+        return sound.basePriority + (voice.priority - sound.basePriority) * left;
+    }
+
+    /// Get a free voice, or steal the lowest priority one below `priority`. -1 if there is none.
+    int pickVoice(float priority) {
+        uint32_t nowMs = SDL_GetTicks();
+        int best = -1;
+        float lowest = priority;
+        for (int ch = 0; ch < soundVoices; ch++) {
+            if (!Mix_Playing(ch)) {
+                return ch;
+            }
+
+            float cur = effectivePriority(ch, nowMs);
+            if (cur < lowest) {
+                lowest = cur;
+                best = ch;
+            }
+        }
+
+        if (best != -1) {
+            Mix_HaltChannel(best);
+            stolen.add();
+        }
+        return best;
+    }
+
+    static void setPan(int ch, const b2Vec2 &pos) {
+        float x = std::clamp((pos.x - getCamera().center.x) / getCamera().size.x, -1.0f, 1.0f);
+        auto right = static_cast<uint8_t>(127 + x * 127);
+        Mix_SetPanning(ch, static_cast<uint8_t>(254 - right), right);
+    }
+
+    void play(const SoundEvent &ev) {
+        const Sound &sound = sounds[static_cast<size_t>(ev.sound)];
+        if (sound.chunk == nullptr) {
+            return;
+        }
+
+        float volume = std::min(1.0f, ev.sound == SoundId::eImpact ? ev.strength / soundFullImpulse : ev.strength);
+        uint64_t key = ev.key();
+
+        if (sound.loop) {
+            for (int ch = 0; ch < soundVoices; ch++) {
+                Voice &voice = voices[ch];
+                if (voice.looping && voice.sound == ev.sound && voice.key == key) {
+                    voice.lastEventMs = SDL_GetTicks();
+                    Mix_Volume(ch, static_cast<int>(volume * MIX_MAX_VOLUME));
+                    setPan(ch, ev.pos);
+                    return;
+                }
+            }
+        }
+
+        float priority = sound.basePriority + volume;
+        int ch = pickVoice(priority);
+        if (ch == -1 || Mix_PlayChannel(ch, sound.chunk, sound.loop ? -1 : 0) == -1) {
+            dropped.add();
+            return;
+        }
+
+        Mix_Volume(ch, static_cast<int>(volume * MIX_MAX_VOLUME));
+        setPan(ch, ev.pos);
+        voices[ch] = Voice{ev.sound, key, priority, SDL_GetTicks(), SDL_GetTicks(), sound.loop};
+    }
+
+public:
+    /// Open the audio device and decode every sound. Failures are logged and leave the system (or a sound) silent.
+    AudioSystem() {
+        if (Mix_OpenAudio(soundFrequency, MIX_DEFAULT_FORMAT, 2, soundBufferSamples) != 0) {
+            WARN("Failed to open audio device: {}. Audio is disabled!", Mix_GetError());
+            return;
+        }
+        open = true;
+        Mix_AllocateChannels(soundVoices);
+
+        load(SoundId::eImpact, soundImpactPath, 0, false);
+        load(SoundId::eThrust, soundThrustPath, 1, true); // a ship's own engine beats any impact
+    }
+
+    AudioSystem(const AudioSystem &rhs) = delete; //!< Deleted copy constructor
+    AudioSystem &operator=(const AudioSystem &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~AudioSystem() {
+        if (!open) {
+            return;
+        }
+
+        Mix_HaltChannel(-1);
+        for (Sound &sound : sounds) {
+            if (sound.chunk != nullptr) {
+                Mix_FreeChunk(sound.chunk);
+            }
+        }
+        Mix_CloseAudio();
+    }
+
+    /**
+     * @brief Play everything the simulation queued since the last call. Call once per frame, on the render thread.
+     * @param queue Queue to drain, usually `Simulation::sounds`
+     */
+    void update(SoundQueue &queue) {
+        batch.clear();
+        SoundEvent ev{};
+        while (queue.tryPop(ev)) {
+            batch.add(ev);
+        }
+
+        if (!open) {
+            return;
+        }
+
+        for (const auto &event : batch.getEvents()) {
+            play(event);
+        }
+
+        int playing = 0;
+        uint32_t nowMs = SDL_GetTicks();
+        for (int ch = 0; ch < soundVoices; ch++) {
+            Voice &voice = voices[ch];
+            if (voice.looping && nowMs - voice.lastEventMs > soundLoopTimeoutMs) {
+                Mix_FadeOutChannel(ch, soundLoopFadeMs);
+                voice.looping = false;
+                voice.priority = 0; // fading out, free to steal
+            }
+            playing += Mix_Playing(ch) != 0;
+        }
+        active.set(playing);
+    }
+};
+
+#endif
@@ -7,25 +7,150 @@
 #ifndef NEWTONIAN_FOOTBALL_2D_CONFIG_HPP
 #define NEWTONIAN_FOOTBALL_2D_CONFIG_HPP
 
+#include <cstddef>
+#include <cstdint>
+
 #define ENABLE_LOGGING
 
+#ifndef NDEBUG
+#   define COUNT_FRAME_ALLOCS // count global `new` calls and warn about any made during a frame
+#endif
+
 
 constexpr int threadPoolConvarTimeoutMs = 1000;
+constexpr bool poolStrictLanes = false; // `ThreadPool` lanes: strict priority, or weighted by `poolLaneWeights`
+constexpr unsigned poolLaneWeights[] = {16, 4, 1}; // frame-critical, normal, background: share of picks when all wait
+constexpr unsigned poolCriticalWorkers = 1; // workers of the main pool that only run frame-critical tasks
+
+// Thread placement, see `stms::ThreadPlacement`. CPU lists are like `taskset -c`, e.g. "2-7,10". The CPU lists and
+// NUMA nodes can be overridden on the command line (`--pool-cpus`, `--sim-cpus`, `--numa-node`).
+constexpr auto poolThreadName = "nf2-pool"; // workers of the main `ThreadPool` are named `nf2-pool-<n>`
+constexpr auto poolCpus = ""; // workers are pinned to these, one CPU each. Empty lets the OS move them around
+constexpr auto poolNumaNode = -1; // workers run on (and allocate from) this NUMA node, -1 for any
+constexpr auto poolPriority = 0; // 1-99 for SCHED_FIFO, negative for a nice value, 0 to leave it alone
+constexpr auto simThreadName = "nf2-sim"; // the simulation thread, or the tick loop of a server
+constexpr auto simCpus = ""; // CPUs the simulation thread may run on. Empty lets the OS move it around
+constexpr auto simNumaNode = -1; // per-match state is allocated on this NUMA node, -1 for any
+constexpr auto simPriority = 0; // like `poolPriority`. SCHED_FIFO needs CAP_SYS_NICE, otherwise it's just logged
+
+constexpr auto maxLogQueueSize = 1u << 16u; // log records waiting to be consumed. Past this, new ones are dropped
 
 constexpr bool logToStdout = true;
 constexpr auto logToLatestLog = false;
 constexpr auto logToUniqueFile = false;
 
+constexpr size_t metricShards = 16; // per-thread shards of each counter/histogram, to avoid cache line bouncing
+constexpr auto metricsPort = 9464; // localhost TCP port of the Prometheus scrape endpoint, 0 to disable it
+constexpr auto metricsPollTimeoutMs = 250;
+
 constexpr auto versionString = "v0.0.1";
 
 constexpr char logsDir[] = "logs";
 
+constexpr size_t logSinkBufferBytes = 1u << 20u; // log files are written from buffers this big, by a `LogFileSink`
+constexpr size_t logSinkBuffers = 4; // if all of them are waiting to be written, log lines are dropped
+constexpr auto logSinkFlushMs = 250; // partially filled buffers are written after this long
+constexpr size_t logRotateBytes = 64u << 20u; // start a new log file segment past this size, 0 to disable
+constexpr auto logRotateSeconds = 24 * 60 * 60; // or when the segment is this old, 0 to disable
+constexpr bool logCompressRotated = true; // compress rotated segments (gzip with zlib, built-in LZ otherwise)
+constexpr char watchdogDir[] = "logs/watchdog";
+
 constexpr auto fieldHeight = 480;
 constexpr auto fieldWidth = 300;
 constexpr auto wallWidth = 1;
 constexpr auto fbuf = 10;
 
+constexpr auto gridCellSize = 20.0f; // cell size of `GridBroadPhase`, should be around the size of a body
+
+constexpr auto maxContactEvents = 1024; // contact events collected per physics tick, extras are dropped
+
+constexpr auto physArenaBytes = 4u << 20u; // bytes of memory backing each `PhysicsEngine`. 0 uses the heap.
+constexpr auto physSafeTravel = 0.5f; // bodies may move this fraction of the thinnest wall per (sub-)step
+constexpr auto physMaxSubSteps = 8; // a physics step is split into at most this many. Past that, CCD takes over
+
 constexpr auto targetFps = 0; // set to 0 for vsync, -1 for unlimited
+constexpr auto tickRate = 60.0f; // physics ticks per second, independent of the frame rate
+
+constexpr auto tickBudgetMs = 1000.0f / tickRate; // ticks slower than this make `TickWatchdog` dump diagnostics
+constexpr auto watchdogCooldownMs = 5000; // minimum time between 2 watchdog dumps, so a slow patch isn't 1000 files
+constexpr auto profilerFrames = 8; // frames of profiler zones kept around (and dumped) by `FrameProfiler`
+constexpr auto maxProfilerZones = 32; // zones recorded per frame, extras are ignored
+
+constexpr size_t inputQueueSize = 256; // input events in flight from the render thread to the sim. Must be a power of 2
+constexpr auto gamepadDeadzone = 0.3f; // stick/trigger values below this are ignored
+constexpr auto shipThrustAccel = 200.0f; // acceleration of a ship at full thrust, in m/s^2
+constexpr auto shipTurnAccel = 8.0f; // angular acceleration of a ship while turning, in rad/s^2
+
+constexpr size_t maxParticles = 1u << 16u; // capacity of a `ParticleSystem`
+constexpr size_t particleParallelMin = 16384; // minimum particles per task when updating on the thread pool
+constexpr auto particleDrag = 2.0f; // particles lose velocity at this exponential rate, per second
+constexpr auto particleSize = 1.5f; // side length of a particle, in m
+constexpr auto particlesPerThrust = 6; // exhaust particles per tick at full thrust
+constexpr size_t effectQueueSize = 1024; // effect events in flight from the sim to the render thread. Power of 2
+constexpr auto sparkMinImpulse = 20000.0f; // impacts weaker than this don't make sparks
+constexpr auto sparksPerImpulse = 1.0f / 2000.0f;
+constexpr size_t maxSparksPerImpact = 64;
+
+constexpr auto predictionHorizonTicks = 300.0f; // how far ahead `BallPredictor` predicts the ball's path
+constexpr size_t maxPredictedBounces = 16; // wall bounces per predicted path, the path ends early past this
+
+constexpr size_t debugDrawReserve = 4096; // primitives reserved per `DebugDrawList`, so it rarely has to grow
+constexpr auto debugDrawCircleSegments = 16; // segments per circle in the physics debug overlay
+
+constexpr auto soundImpactPath = "./res/impact.wav"; // sounds are decoded once, when `AudioSystem` is created
+constexpr auto soundThrustPath = "./res/thrust.wav";
+constexpr auto soundFrequency = 44100; // output sample rate, in Hz
+constexpr auto soundBufferSamples = 1024; // samples per audio callback, smaller is lower latency
+constexpr auto soundVoices = 16; // sounds that can play at once, past this the lowest priority one is stolen
+constexpr size_t soundQueueSize = 256; // sound events in flight from the sim to the render thread. Power of 2
+constexpr size_t maxSoundsPerBatch = 32; // distinct sound sources per tick (sim) or frame (audio), weakest dropped
+constexpr auto soundMinImpulse = 5000.0f; // impacts weaker than this are silent
+constexpr auto soundFullImpulse = 100000.0f; // impacts at least this strong play at full volume
+constexpr auto soundLoopFadeMs = 60; // looped sounds fade out over this long when their events stop
+constexpr uint32_t soundLoopTimeoutMs = static_cast<uint32_t>(3000 / tickRate); // 3 ticks without events = stopped
+
+constexpr uint16_t serverPort = 27015; // default UDP port of `GameServer`
+constexpr size_t serverMaxClients = 1024; // packets from new addresses are ignored past this many clients
+constexpr uint64_t serverClientTimeoutTicks = 5 * 60; // clients silent for this many ticks are dropped
+constexpr size_t serverMaxPacketBytes = 1200; // biggest datagram the server sends, kept under the usual MTU
+constexpr auto serverSocketBufferBytes = 4 << 20; // kernel send/receive buffer of the server socket
+constexpr auto serverShipHalfWidth = fieldWidth / 32.0f; // ships of network clients are smaller, so more fit
+constexpr auto serverShipHalfHeight = fieldHeight / 32.0f;
+constexpr auto largeArenaScale = 8.0f; // `--server --large-arena` makes the field this many times wider and higher
+
+// Interest management: each client is only sent the entities that matter to it, by priority, within a byte budget.
+constexpr auto interestCellSize = 64.0f; // cell size of the `InterestGrid` spatial hash, in m
+constexpr auto interestRadius = 600.0f; // entities farther than this from a client's ship are never sent to it
+constexpr auto interestNearRadius = 100.0f; // priority halves at this distance, and keeps falling off past it
+constexpr uint64_t interestMaxAge = 30; // ticks since an entity was last sent to a client add priority, up to this
+constexpr size_t interestBudgetBytes = 600; // snapshot bytes per client per tick. The ball and own ship always fit
+
+constexpr uint64_t spectatorDelayTicks = 10 * 60; // spectators see the game this late, so they can't ghost for a team
+constexpr uint64_t spectatorKeyframeTicks = 60; // a spectator frame with every entity is sent at least this often
+constexpr size_t spectatorMaxCount = 4096; // verified `eSpectate`s from new addresses are ignored past this many
+
+constexpr auto telemetryDir = "telemetry"; // `--telemetry` writes each match's columns to a directory in here
+constexpr size_t telemetryBatchRows = 1u << 16u; // rows per column write. Columns are appended to in batches this big
+constexpr size_t telemetryBatches = 4; // if all of them are waiting to be written, rows are dropped
+
+constexpr auto assetBundlePath = "./assets.bundle"; // made by the `pack_assets` build step. Without it, ./res/ is used
+
+constexpr auto hudFontPath = "./res/hud.ttf"; // font of the HUD text. If it can't be loaded, the HUD isn't drawn
+constexpr auto hudFontSize = 16; // in points
+constexpr auto hudAtlasSize = 512; // width and height of the glyph atlas texture, in pixels
+
+constexpr auto frameArenaBytes = 1u << 20u; // size of each of the 2 blocks of a `FrameArena`
+constexpr auto frameArenaDrainMs = 2000; // a dying `FrameArena` waits this long for its pinned objects to be freed
+
+constexpr size_t scriptFrameGranularity = 64; // coroutine frames of `Script`s are pooled in size classes this far apart
+constexpr size_t scriptMaxFrameBytes = 1024; // bigger frames come from the heap
+constexpr size_t scriptFramesPerChunk = 64; // an empty size class is refilled with this many frames at once
+constexpr size_t scriptReserve = 4096; // a `ScriptScheduler` doesn't allocate until more scripts than this wait at once
+
+constexpr auto maxRenderEntities = 256; // capacity of a `RenderSnapshot`
+
+constexpr auto replayChunksPerWorker = 4; // `renderReplay` splits the frames into this many chunks per worker
+constexpr auto replayMinChunkFrames = 32; // but no chunk is smaller than this many frames
 
 
 #endif //NEWTONIAN_FOOTBALL_2D_CONFIG_HPP
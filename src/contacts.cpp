@@ -0,0 +1,114 @@
+//
+// Created by grant on 11/27/20.
+//
+
+#pragma once
+
+#ifndef CONTACTS_CPP_INCLUDED
+#define CONTACTS_CPP_INCLUDED
+
+#include <box2d/box2d.h>
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include "config.hpp"
+
+/// A collision that happened during `PhysicsEngine::step()`.
+struct ContactEvent {
+    enum class Type : uint8_t {
+        eBegin, //!< Two bodies started touching this tick. `impulse` is 0.
+        eImpact //!< The solver pushed two touching bodies apart this tick. Reported every tick they touch.
+    };
+
+    Type type;
+    uint32_t bodyA; //!< Id of the first body (see `PhysicsEngine::getBodyId()`)
+    uint32_t bodyB; //!< Id of the second body
+    float impulse; //!< Sum of the normal impulses over all contact points
+    b2Vec2 point; //!< World-space contact point (the first manifold point, or between the bodies if there's none)
+    /// Set on the first `eImpact` of a contact, i.e. on the tick it began. Resting contact keeps reporting big
+    /// impulses every tick (a thrusting ship leaning on a wall), so one-shot effects should only look at these.
+    bool first;
+};
+
+/**
+ * @brief Collects Box2D contact callbacks into one preallocated, contiguous batch per tick. The only virtual
+ *        calls are the ones Box2D makes into this class; game code reads the whole batch after the step.
+ *        Events past `maxContactEvents` in one tick are dropped (and counted).
+ */
+class ContactBatch : public b2ContactListener {
+private:
+    std::array<ContactEvent, maxContactEvents> events{};
+    uint32_t numEvents = 0;
+    uint64_t dropped = 0;
+
+    std::array<b2Contact *, maxContactEvents> begun{}; //!< Contacts that began this step and weren't solved yet
+    uint32_t numBegun = 0;
+
+    /// Forget that `contact` began this step. Returns true if it had, i.e. this is its first impact.
+    inline bool takeBegun(b2Contact *contact) {
+        for (uint32_t i = 0; i < numBegun; i++) {
+            if (begun[i] == contact) {
+                begun[i] = begun[--numBegun];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void push(ContactEvent::Type type, b2Contact *contact, float impulse, bool first) {
+        if (numEvents >= events.size()) {
+            dropped++;
+            return;
+        }
+
+        b2Body *a = contact->GetFixtureA()->GetBody(), *b = contact->GetFixtureB()->GetBody();
+        b2Vec2 point = 0.5f * (a->GetWorldCenter() + b->GetWorldCenter());
+        if (contact->GetManifold()->pointCount > 0) { // sensors have none, and the points are left uninitialized
+            b2WorldManifold manifold;
+            contact->GetWorldManifold(&manifold);
+            point = manifold.points[0];
+        }
+
+        auto idA = static_cast<uint32_t>(a->GetUserData().pointer);
+        auto idB = static_cast<uint32_t>(b->GetUserData().pointer);
+        events[numEvents++] = ContactEvent{.type = type, .bodyA = idA, .bodyB = idB, .impulse = impulse,
+                                           .point = point, .first = first};
+    }
+
+public:
+    void clear() { //!< Forget the last tick's events. Called at the start of every `PhysicsEngine::step()`.
+        numEvents = 0;
+        numBegun = 0;
+    }
+
+    void BeginContact(b2Contact *contact) override {
+        if (numBegun < begun.size()) {
+            begun[numBegun++] = contact;
+        }
+        push(ContactEvent::Type::eBegin, contact, 0, false);
+    }
+
+    void PostSolve(b2Contact *contact, const b2ContactImpulse *impulse) override {
+        float sum = 0;
+        for (int32 i = 0; i < impulse->count; i++) {
+            sum += impulse->normalImpulses[i];
+        }
+        push(ContactEvent::Type::eImpact, contact, sum, numBegun > 0 && takeBegun(contact));
+    }
+
+    /**
+     * @brief Get all the events of the last tick
+     * @return View of the events, valid until the next step
+     */
+    [[nodiscard]] inline std::span<const ContactEvent> getEvents() const {
+        return {events.data(), numEvents};
+    }
+
+    [[nodiscard]] inline uint64_t getDropped() const { //!< Total number of events dropped for lack of space
+        return dropped;
+    }
+};
+
+#endif
@@ -0,0 +1,219 @@
+//
+// Created by grant on 12/6/20.
+//
+
+#pragma once
+
+#ifndef DEBUG_DRAW_CPP_INCLUDED
+#define DEBUG_DRAW_CPP_INCLUDED
+
+#include "game.cpp"
+
+#include <box2d/box2d.h>
+#include <SDL2/SDL.h>
+
+#include <cmath>
+#include <vector>
+
+/// Box2D debug primitives of one tick, in real-space. Capacity sticks around, so refilling it doesn't allocate.
+struct DebugDrawList {
+    struct Line {
+        b2Vec2 a, b;
+        SDL_Color color;
+    };
+
+    struct Triangle {
+        b2Vec2 a, b, c;
+        SDL_Color color;
+    };
+
+    struct Point {
+        b2Vec2 pos;
+        float size; //!< Side length, in pixels
+        SDL_Color color;
+    };
+
+    std::vector<Line> lines;
+    std::vector<Triangle> triangles;
+    std::vector<Point> points;
+
+    DebugDrawList() {
+        lines.reserve(debugDrawReserve);
+        triangles.reserve(debugDrawReserve);
+        points.reserve(debugDrawReserve / 8);
+    }
+
+    inline void clear() {
+        lines.clear();
+        triangles.clear();
+        points.clear();
+    }
+};
+
+/// `b2Draw` that records everything into a `DebugDrawList`. Lives on the simulation thread.
+class PhysicsDebugDraw : public b2Draw {
+private:
+    static inline SDL_Color toSdl(const b2Color &c, float alpha = 1) {
+        return SDL_Color{static_cast<uint8_t>(c.r * 255), static_cast<uint8_t>(c.g * 255),
+                         static_cast<uint8_t>(c.b * 255), static_cast<uint8_t>(c.a * alpha * 255)};
+    }
+
+    static inline b2Vec2 circlePoint(const b2Vec2 &center, float radius, int i) {
+        float angle = static_cast<float>(i) * 2 * b2_pi / debugDrawCircleSegments;
+        return center + radius * b2Vec2(std::cos(angle), std::sin(angle));
+    }
+
+public:
+    DebugDrawList *out = nullptr; //!< List to record into. Must be set before `b2World::DebugDraw()`.
+
+    PhysicsDebugDraw() {
+        SetFlags(e_shapeBit | e_jointBit | e_aabbBit | e_centerOfMassBit);
+    }
+
+    void DrawPolygon(const b2Vec2 *vertices, int32 vertexCount, const b2Color &color) override {
+        for (int32 i = 0; i < vertexCount; i++) {
+            out->lines.push_back({vertices[i], vertices[(i + 1) % vertexCount], toSdl(color)});
+        }
+    }
+
+    void DrawSolidPolygon(const b2Vec2 *vertices, int32 vertexCount, const b2Color &color) override {
+        for (int32 i = 1; i + 1 < vertexCount; i++) { // fan, Box2D polygons are convex
+            out->triangles.push_back({vertices[0], vertices[i], vertices[i + 1], toSdl(color, 0.5f)});
+        }
+        DrawPolygon(vertices, vertexCount, color);
+    }
+
+    void DrawCircle(const b2Vec2 &center, float radius, const b2Color &color) override {
+        for (int i = 0; i < debugDrawCircleSegments; i++) {
+            out->lines.push_back({circlePoint(center, radius, i), circlePoint(center, radius, i + 1), toSdl(color)});
+        }
+    }
+
+    void DrawSolidCircle(const b2Vec2 &center, float radius, const b2Vec2 &axis, const b2Color &color) override {
+        for (int i = 0; i < debugDrawCircleSegments; i++) {
+            out->triangles.push_back({center, circlePoint(center, radius, i), circlePoint(center, radius, i + 1),
+                                      toSdl(color, 0.5f)});
+        }
+        DrawCircle(center, radius, color);
+        out->lines.push_back({center, center + radius * axis, toSdl(color)});
+    }
+
+    void DrawSegment(const b2Vec2 &p1, const b2Vec2 &p2, const b2Color &color) override {
+        out->lines.push_back({p1, p2, toSdl(color)});
+    }
+
+    void DrawTransform(const b2Transform &xf) override {
+        constexpr float axisScale = 4.0f;
+        out->lines.push_back({xf.p, xf.p + axisScale * xf.q.GetXAxis(), SDL_Color{255, 0, 0, 255}});
+        out->lines.push_back({xf.p, xf.p + axisScale * xf.q.GetYAxis(), SDL_Color{0, 255, 0, 255}});
+    }
+
+    void DrawPoint(const b2Vec2 &p, float size, const b2Color &color) override {
+        out->points.push_back({p, size, toSdl(color)});
+    }
+
+    /**
+     * @brief Record a whole world: shapes, joints, AABBs and centers of mass through `b2World::DebugDraw()`,
+     *        plus the points of every touching contact (which Box2D doesn't draw itself)
+     * @param world World to draw. Its debug draw is set to this.
+     * @param list List to overwrite
+     */
+    void record(b2World &world, DebugDrawList &list) {
+        out = &list;
+        list.clear();
+
+        world.SetDebugDraw(this);
+        world.DebugDraw();
+
+        b2WorldManifold manifold;
+        for (b2Contact *contact = world.GetContactList(); contact != nullptr; contact = contact->GetNext()) {
+            if (!contact->IsTouching()) {
+                continue;
+            }
+
+            contact->GetWorldManifold(&manifold);
+            for (int32 i = 0; i < contact->GetManifold()->pointCount; i++) {
+                DrawPoint(manifold.points[i], 6.0f, b2Color(1.0f, 0.2f, 0.2f));
+            }
+        }
+    }
+};
+
+/// Draws a `DebugDrawList` on the render thread, with one `SDL_RenderGeometry` call.
+class DebugOverlay {
+private:
+    std::vector<SDL_Vertex> verts;
+    std::vector<int> indices;
+
+    inline void pushQuad(const b2Vec2 &a, const b2Vec2 &b, const b2Vec2 &c, const b2Vec2 &d, SDL_Color color) {
+        int base = static_cast<int>(verts.size());
+        for (const b2Vec2 *p : {&a, &b, &c, &d}) {
+            verts.push_back(SDL_Vertex{SDL_FPoint{p->x, p->y}, color, SDL_FPoint{0, 0}});
+        }
+        for (int i : {0, 1, 2, 0, 2, 3}) {
+            indices.push_back(base + i);
+        }
+    }
+
+public:
+    /**
+     * @brief Draw a list. Everything is transformed with the camera in one pass; lines become 1 pixel wide quads.
+     * @param ren Renderer to draw with
+     * @param list Primitives to draw
+     * @param w Width of the render target in pixels
+     * @param h Height of the render target in pixels
+     */
+    void draw(SDL_Renderer *ren, const DebugDrawList &list, int w = winWidth(), int h = winHeight()) {
+        verts.clear();
+        indices.clear();
+
+        // `transformCam`, hoisted out of the loops
+        b2Vec2 topLeft = getCamera().center - getCamera().size;
+        b2Vec2 scale(w / (getCamera().size.x * 2), h / (getCamera().size.y * 2));
+        auto toScreen = [&](const b2Vec2 &p) {
+            return b2Vec2((p.x - topLeft.x) * scale.x, (p.y - topLeft.y) * scale.y);
+        };
+
+        for (const auto &tri : list.triangles) {
+            int base = static_cast<int>(verts.size());
+            for (const b2Vec2 *p : {&tri.a, &tri.b, &tri.c}) {
+                b2Vec2 s = toScreen(*p);
+                verts.push_back(SDL_Vertex{SDL_FPoint{s.x, s.y}, tri.color, SDL_FPoint{0, 0}});
+            }
+            indices.insert(indices.end(), {base, base + 1, base + 2});
+        }
+
+        for (const auto &line : list.lines) {
+            b2Vec2 a = toScreen(line.a), b = toScreen(line.b);
+            b2Vec2 normal(a.y - b.y, b.x - a.x);
+            float len = normal.Length();
+            if (len < 1e-3f) {
+                continue;
+            }
+            normal *= 0.5f / len; // half a pixel to each side
+            pushQuad(a + normal, b + normal, b - normal, a - normal, line.color);
+        }
+
+        for (const auto &point : list.points) {
+            b2Vec2 s = toScreen(point.pos);
+            float r = point.size / 2;
+            pushQuad(s + b2Vec2(-r, -r), s + b2Vec2(r, -r), s + b2Vec2(r, r), s + b2Vec2(-r, r), point.color);
+        }
+
+        if (indices.empty()) {
+            return;
+        }
+
+        SDL_BlendMode prevMode;
+        SDL_GetRenderDrawBlendMode(ren, &prevMode);
+        SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND);
+        if (SDL_RenderGeometry(ren, nullptr, verts.data(), static_cast<int>(verts.size()), indices.data(),
+                               static_cast<int>(indices.size())) != 0) {
+            FATAL("Failed to render debug overlay: {}", SDL_GetError());
+            throw std::runtime_error("Rendering failed");
+        }
+        SDL_SetRenderDrawBlendMode(ren, prevMode);
+    }
+};
+
+#endif
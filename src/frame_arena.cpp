@@ -0,0 +1,103 @@
+//
+// Created by grant on 11/26/20.
+//
+
+#include "frame_arena.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <thread>
+
+namespace stms {
+
+    FrameArena::Scope::Scope(FrameArena *arena) : prev(current()) {
+        current() = arena;
+    }
+
+    FrameArena::Scope::~Scope() {
+        current() = prev;
+    }
+
+    FrameArena::FrameArena(size_t capacity) : capacity(capacity) {
+        for (unsigned i = 0; i < 2; i++) {
+            blocks[i].base = static_cast<unsigned char *>(std::malloc(capacity));
+            if (blocks[i].base == nullptr) {
+                for (unsigned j = 0; j < i; j++) {
+                    std::free(blocks[j].base);
+                }
+                delete[] blocks;
+                throw std::bad_alloc();
+            }
+        }
+    }
+
+    FrameArena::~FrameArena() {
+        // Pinned objects are usually log records or detached tasks queued on a pool, which are released soon.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(frameArenaDrainMs);
+        auto pinned = [this]() {
+            return blocks[0].pins.load(std::memory_order_acquire) + blocks[1].pins.load(std::memory_order_acquire);
+        };
+        while (pinned() != 0) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                // Can't log here, the log record could land in this very arena. `blocks` is leaked too, so the
+                // pins released later still point to valid memory.
+                std::fputs("FrameArena destroyed while objects in it are still alive! Leaking it!\n", stderr);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        for (unsigned i = 0; i < 2; i++) {
+            std::free(blocks[i].base);
+        }
+        delete[] blocks;
+    }
+
+    void FrameArena::reset() {
+        Block &next = blocks[active ^ 1u];
+        if (next.pins.load(std::memory_order_acquire) != 0) {
+            // Something from the frame before last is still in flight. Keep filling the current block.
+            stalledResets++;
+            return;
+        }
+
+        active ^= 1u;
+        next.used = 0;
+    }
+
+    void *FrameArena::alloc(size_t size, size_t align) {
+        Block &block = blocks[active];
+        auto start = (reinterpret_cast<uintptr_t>(block.base) + block.used + align - 1) & ~(uintptr_t) (align - 1);
+        size_t end = start + size - reinterpret_cast<uintptr_t>(block.base);
+        if (end > capacity) {
+            overflows++;
+            return nullptr;
+        }
+
+        block.used = end;
+        if (end > peakBytes) {
+            peakBytes = end;
+        }
+        return reinterpret_cast<void *>(start);
+    }
+
+    void *FrameArena::allocPinned(size_t size, size_t align, std::atomic_size_t *&pin) {
+        void *ret = alloc(size, align);
+        if (ret != nullptr) {
+            pin = &blocks[active].pins;
+            pin->fetch_add(1, std::memory_order_relaxed);
+        }
+        return ret;
+    }
+
+    bool FrameArena::owns(const void *ptr) const {
+        for (unsigned i = 0; i < 2; i++) {
+            if (ptr >= blocks[i].base && ptr < blocks[i].base + capacity) {
+                return true;
+            }
+        }
+        return false;
+    }
+}
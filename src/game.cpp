@@ -2,12 +2,19 @@
 // Created by grant on 11/22/20.
 //
 
+#pragma once
+
+#ifndef GAME_CPP_INCLUDED
+#define GAME_CPP_INCLUDED
+
 #include "phys.cpp"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
 #include "globals.cpp"
+#include "assets.cpp"
 
+#include <array>
 #include <utility>
 #include <string>
 #include <log.hpp>
@@ -23,113 +30,175 @@ NF2Cam &getCamera() {
     return cam;
 }
 
-b2Vec2 transformCam(const b2Vec2 &in) {
+b2Vec2 transformCam(const b2Vec2 &in, int w = winWidth(), int h = winHeight()) {
     b2Vec2 topLeft = getCamera().center - getCamera().size; // get the top-left corner of the camera
     b2Vec2 relative = in - topLeft; // get the coord in a translated coord system with top left of cam as (0, 0)
 
     // Simply scale this coord up by mapping range [1-cam.size*2] to [1-winSize]
     b2Vec2 ret;
-    ret.x = (relative.x * winWidth()) / (getCamera().size.x * 2);
-    ret.y = (relative.y * winHeight()) / (getCamera().size.y * 2);
+    ret.x = (relative.x * w) / (getCamera().size.x * 2);
+    ret.y = (relative.y * h) / (getCamera().size.y * 2);
 
     return ret;
 }
 
 
-class Ball {
+/// Which texture a `RenderEntity` is drawn with. Indexes `SpriteSheet`.
+enum class SpriteId : uint8_t {
+    eBall = 0, //!< `./res/ball.png`
+    eShip = 1, //!< `./res/ship.png`, color modded with the team color
+    eCount //!< Number of sprites. Not a valid sprite!
+};
+
+struct Team {
+public:
+    uint8_t r, g, b;
+};
+
+/// Everything needed to draw one body, copied out of the simulation so rendering never touches Box2D.
+struct RenderEntity {
+    b2Vec2 pos; //!< Center of the body in real-space
+    b2Vec2 halfSize; //!< Half-width and half-height in real-space
+    float angle; //!< Rotation of the body, as returned by `b2Body::GetAngle()`
+    SpriteId sprite;
+    Team team; //!< Color mod of the sprite. White for no tint.
+};
+
+/// Compact render state of a whole tick. Fixed size, so publishing one never allocates.
+struct RenderSnapshot {
+    uint64_t tick = 0; //!< Simulation tick this snapshot was taken at
+    uint64_t inputSeq = 0; //!< Number of input events applied up to this tick, see `InputSystem::onPresent`
+    uint32_t numEntities = 0; //!< Number of valid entries in `entities`
+    std::array<RenderEntity, maxRenderEntities> entities{};
+
+    inline void clear(uint64_t newTick) {
+        tick = newTick;
+        numEntities = 0;
+    }
+
+    inline void push(const RenderEntity &ent) {
+        if (numEntities < entities.size()) {
+            entities[numEntities++] = ent;
+        }
+    }
+};
+
+/// Owns one texture per `SpriteId` for a renderer, and draws `RenderEntity`s with them.
+class SpriteSheet {
 public:
-    CircleRigidBody body;
-    SDL_Texture *tex;
-    SDL_Rect rect;
     SDL_Renderer *ren;
+    std::array<SDL_Texture *, static_cast<size_t>(SpriteId::eCount)> textures{};
+
+    int viewW = 0, viewH = 0; //!< Size of the render target in pixels. If 0, the window size is used.
+
+    /**
+     * @brief Load every sprite
+     * @param ren Renderer to create the textures with
+     * @param bundle If not `nullptr`, sprites are uploaded straight from this bundle's pixels. Sprites missing from
+     *               it are decoded from `./res/`.
+     */
+    explicit SpriteSheet(SDL_Renderer *ren, const AssetBundle *bundle = nullptr) : ren(ren) {
+        textures[static_cast<size_t>(SpriteId::eBall)] = load("ball.png", bundle);
+        textures[static_cast<size_t>(SpriteId::eShip)] = load("ship.png", bundle);
+    }
+
+    SDL_Texture *load(const char *name, const AssetBundle *bundle) {
+        const BundleImage *image = bundle != nullptr ? bundle->find(name) : nullptr;
+        if (image == nullptr) {
+            return IMG_LoadTexture(ren, (std::string("./res/") + name).c_str());
+        }
 
-    Ball(CircleRigidBody b, SDL_Renderer *ren, const std::string &img = "./res/ball.png") : body(std::move(b)), ren(ren) {
-        tex = IMG_LoadTexture(ren, img.c_str());
+        SDL_Texture *tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC,
+                                             static_cast<int>(image->width), static_cast<int>(image->height));
+        if (tex == nullptr || SDL_UpdateTexture(tex, nullptr, bundle->getPixels(*image),
+                                                static_cast<int>(image->width * 4)) != 0) {
+            ERROR("Failed to upload sprite `{}` from the asset bundle: {}", name, SDL_GetError());
+            if (tex != nullptr) {
+                SDL_DestroyTexture(tex);
+            }
+            return IMG_LoadTexture(ren, (std::string("./res/") + name).c_str());
+        }
+        SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND); // like `IMG_LoadTexture` does for images with alpha
+        return tex;
     }
-    void draw() {
+
+    SpriteSheet(const SpriteSheet &rhs) = delete; //!< Deleted copy constructor
+    SpriteSheet &operator=(const SpriteSheet &rhs) = delete; //!< Deleted copy assignment operator
+
+    void draw(const RenderEntity &ent) {
         // B---A
         // | O |
         // C---D
         // Figure
 
-        b2Vec2 pos = body.body->GetPosition(); // get position of ball in real-space (Point O in figure above)
-        b2Vec2 size = b2Vec2(body.shape.m_radius, body.shape.m_radius); // Vector from O -> D in figure above
+        int w = viewW > 0 ? viewW : winWidth();
+        int h = viewH > 0 ? viewH : winHeight();
+
+        b2Vec2 pos = ent.pos; // get position of the body in real-space (Point O in figure above)
+        b2Vec2 size = ent.halfSize; // Vector from O -> D in figure above
         pos -= size; // Subtract size to find corner B in figure above, and transform that into screen-space
         size *= 2; // Transform the half-dimensions into full dimensions.
         b2Vec2 d = pos + size; // Find point D by adding pos and size vecs together.
-        pos = transformCam(pos); // Transform position into screen-space
-        d = transformCam(d); // Transform opposite corner into screen-space
+        pos = transformCam(pos, w, h); // Transform position into screen-space
+        d = transformCam(d, w, h); // Transform opposite corner into screen-space
         size = d - pos; // Find the difference between D and B!
 
-        b2Vec2 center = transformCam(body.body->GetPosition());
-
+        b2Vec2 center = transformCam(ent.pos, w, h);
 
-        INFO("BALL DRAW: angle={}  pos=[{}, {}]", body.body->GetAngle(), pos.x, pos.y);
+        INFO("Sprite {} DRAW: angle={}  pos=[{}, {}]", static_cast<int>(ent.sprite), ent.angle, pos.x, pos.y);
+        SDL_Rect rect;
         rect.x = pos.x;
         rect.y = pos.y;
         rect.w = size.x;
         rect.h = size.y;
 
+        SDL_Texture *tex = textures[static_cast<size_t>(ent.sprite)];
+        SDL_SetTextureColorMod(tex, ent.team.r, ent.team.g, ent.team.b);
+
         SDL_Point point = {static_cast<int>(center.x), static_cast<int>(center.y)};
-        if (SDL_RenderCopyEx(ren, tex, nullptr, &rect, body.body->GetAngle(), &point, SDL_FLIP_NONE) != 0) {
-            FATAL("Failed to render ship: {}", SDL_GetError());
+        if (SDL_RenderCopyEx(ren, tex, nullptr, &rect, ent.angle, &point, SDL_FLIP_NONE) != 0) {
+            FATAL("Failed to render sprite: {}", SDL_GetError());
             throw std::runtime_error("Rendering failed");
         }
     }
 
-    virtual ~Ball() {
-        SDL_DestroyTexture(tex);
+    void draw(const RenderSnapshot &snap) {
+        for (uint32_t i = 0; i < snap.numEntities; i++) {
+            draw(snap.entities[i]);
+        }
+    }
+
+    virtual ~SpriteSheet() {
+        for (auto *tex : textures) {
+            SDL_DestroyTexture(tex);
+        }
     }
 };
 
-struct Team {
+class Ball {
 public:
-    uint8_t r, g, b;
+    CircleRigidBody body;
+
+    explicit Ball(CircleRigidBody b) : body(std::move(b)) {}
+
+    void snapshot(RenderSnapshot &out) const {
+        out.push(RenderEntity{body.body->GetPosition(), b2Vec2(body.shape.m_radius, body.shape.m_radius),
+                              body.body->GetAngle(), SpriteId::eBall, Team{255, 255, 255}});
+    }
 };
 
 class Ship {
 public:
     Team team;
     RigidBody body;
-    SDL_Texture *tex;
-    SDL_Rect rect;
-    SDL_Renderer *ren;
 
     float turnImpulse;
 
-    Ship(RigidBody b, SDL_Renderer *ren, Team t, const std::string &img = "./res/ship.png") : body(std::move(b)), team(t), ren(ren) {
-        tex = IMG_LoadTexture(ren, img.c_str());
-        SDL_SetTextureColorMod(tex, team.r, team.g, team.b);
-    }
-
-    void draw() {
-        // B---A
-        // | O |
-        // C---D
-        // Figure
+    Ship(RigidBody b, Team t) : team(t), body(std::move(b)) {}
 
-        b2Vec2 pos = body.body->GetPosition(); // get position of ball in real-space (Point O in figure above)
-        b2Vec2 size = b2Vec2(body.w, body.h); // Vector from O -> D in figure above
-        pos -= size; // Subtract size to find corner B in figure above, and transform that into screen-space
-        size *= 2; // Transform the half-dimensions into full dimensions.
-        b2Vec2 d = pos + size; // Find point D by adding pos and size vecs together.
-        pos = transformCam(pos); // Transform position into screen-space
-        d = transformCam(d); // Transform opposite corner into screen-space
-        size = d - pos; // Find the difference between D and B!
-
-        b2Vec2 center = transformCam(body.body->GetPosition());
-
-        INFO("Ship DRAW: angle={}  pos=[{}, {}]", body.body->GetAngle(), pos.x, pos.y);
-        rect.x = pos.x;
-        rect.y = pos.y;
-        rect.w = size.x;
-        rect.h = size.y;
-
-        SDL_Point point = {static_cast<int>(center.x), static_cast<int>(center.y)};
-        if (SDL_RenderCopyEx(ren, tex, nullptr, &rect, body.body->GetAngle(), &point, SDL_FLIP_NONE) != 0) {
-            FATAL("Failed to render ship: {}", SDL_GetError());
-            throw std::runtime_error("Rendering failed");
-        }
+    void snapshot(RenderSnapshot &out) const {
+        out.push(RenderEntity{body.body->GetPosition(), b2Vec2(body.w, body.h), body.body->GetAngle(),
+                              SpriteId::eShip, team});
     }
 
     void turn(int accl) const {
@@ -145,9 +214,6 @@ public:
         b2Vec2 forward(std::sin(angle) * amt, std::cos(angle) * amt);
         body.body->ApplyForceToCenter(forward, true);
     }
-
-    virtual ~Ship() {
-        SDL_DestroyTexture(tex);
-    }
 };
 
+#endif
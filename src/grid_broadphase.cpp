@@ -0,0 +1,166 @@
+//
+// Created by grant on 11/24/20.
+//
+
+#pragma once
+
+#ifndef GRID_BROADPHASE_CPP_INCLUDED
+#define GRID_BROADPHASE_CPP_INCLUDED
+
+#include <box2d/b2_collision.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "config.hpp"
+
+/**
+ * @brief Broadphase over a fixed uniform grid covering the walled-in field.
+ *
+ * Unlike Box2D's dynamic tree, nothing is rebalanced. Every tick the proxies are re-inserted and bucketed into
+ * cells with a counting sort, which is O(n) and allocation free once the buffers have grown. This only works
+ * because everything is guaranteed to stay inside the walls; proxies outside the field are clamped into the
+ * border cells, which stays correct but gets slow if that ever stops being true.
+ */
+class GridBroadPhase {
+public:
+    static constexpr float halfW = fieldWidth + wallWidth + fbuf; //!< Half-width of the area the grid covers
+    static constexpr float halfH = fieldHeight + wallWidth + fbuf; //!< Half-height of the area the grid covers
+
+private:
+    struct Proxy {
+        b2AABB aabb;
+        uintptr_t userData;
+        int32_t x0, y0, x1, y1; //!< Inclusive range of cells that the proxy touches
+    };
+
+    float invCellSize;
+    int32_t cellsX, cellsY;
+
+    std::vector<Proxy> proxies;
+    std::vector<uint32_t> cellStart; //!< Index into `cellItems` of the first proxy in each cell (+1 sentinel)
+    std::vector<uint32_t> cellItems; //!< Proxy indices, grouped by cell
+
+    [[nodiscard]] inline int32_t cellX(float x) const {
+        return std::clamp(static_cast<int32_t>((x + halfW) * invCellSize), 0, cellsX - 1);
+    }
+
+    [[nodiscard]] inline int32_t cellY(float y) const {
+        return std::clamp(static_cast<int32_t>((y + halfH) * invCellSize), 0, cellsY - 1);
+    }
+
+public:
+    /**
+     * @brief Create a grid covering the field, walls included
+     * @param cellSize Side length of a grid cell, in world units. Should be around the size of a typical body.
+     */
+    explicit GridBroadPhase(float cellSize = gridCellSize) : invCellSize(1.0f / cellSize) {
+        cellsX = static_cast<int32_t>(halfW * 2 / cellSize) + 1;
+        cellsY = static_cast<int32_t>(halfH * 2 / cellSize) + 1;
+        cellStart.resize(static_cast<size_t>(cellsX * cellsY) + 1);
+    }
+
+    void clear() { //!< Remove all proxies. Keeps the memory around for the next tick.
+        proxies.clear();
+    }
+
+    /**
+     * @brief Add a proxy. It is not visible to queries until `rebuild()` is called.
+     * @param aabb Bounding box of the proxy
+     * @param userData Arbitrary value handed back by the queries (e.g. a `b2Body *`)
+     */
+    inline void insert(const b2AABB &aabb, uintptr_t userData) {
+        proxies.push_back(Proxy{aabb, userData, cellX(aabb.lowerBound.x), cellY(aabb.lowerBound.y),
+                                cellX(aabb.upperBound.x), cellY(aabb.upperBound.y)});
+    }
+
+    void rebuild() { //!< Bucket all proxies into their cells. Call this after inserting everything for a tick.
+        std::fill(cellStart.begin(), cellStart.end(), 0);
+        for (const auto &p : proxies) {
+            for (int32_t y = p.y0; y <= p.y1; y++) {
+                for (int32_t x = p.x0; x <= p.x1; x++) {
+                    cellStart[y * cellsX + x + 1]++;
+                }
+            }
+        }
+
+        for (size_t i = 1; i < cellStart.size(); i++) {
+            cellStart[i] += cellStart[i - 1];
+        }
+
+        cellItems.resize(cellStart.back());
+        // Scatter, using `cellStart[c]` as the write cursor of cell `c`. This shifts the starts by one cell,
+        // which is undone right after.
+        for (uint32_t i = 0; i < proxies.size(); i++) {
+            const auto &p = proxies[i];
+            for (int32_t y = p.y0; y <= p.y1; y++) {
+                for (int32_t x = p.x0; x <= p.x1; x++) {
+                    cellItems[cellStart[y * cellsX + x]++] = i;
+                }
+            }
+        }
+
+        for (size_t i = cellStart.size() - 1; i > 0; i--) {
+            cellStart[i] = cellStart[i - 1];
+        }
+        cellStart[0] = 0;
+    }
+
+    /**
+     * @brief Report every pair of overlapping proxies exactly once.
+     * @param callback Called as `callback(uintptr_t userDataA, uintptr_t userDataB)`
+     */
+    template<typename F>
+    void queryPairs(F &&callback) const {
+        for (int32_t c = 0; c < cellsX * cellsY; c++) {
+            for (uint32_t i = cellStart[c]; i < cellStart[c + 1]; i++) {
+                const Proxy &a = proxies[cellItems[i]];
+                for (uint32_t j = i + 1; j < cellStart[c + 1]; j++) {
+                    const Proxy &b = proxies[cellItems[j]];
+                    if (!b2TestOverlap(a.aabb, b.aabb)) {
+                        continue;
+                    }
+
+                    // Pairs sharing several cells are only reported from the cell holding the
+                    // lower corner of their overlap.
+                    float ox = std::max(a.aabb.lowerBound.x, b.aabb.lowerBound.x);
+                    float oy = std::max(a.aabb.lowerBound.y, b.aabb.lowerBound.y);
+                    if (cellY(oy) * cellsX + cellX(ox) == c) {
+                        callback(a.userData, b.userData);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Report every proxy overlapping an AABB exactly once.
+     * @param aabb Area to query
+     * @param callback Called as `callback(uintptr_t userData)`
+     */
+    template<typename F>
+    void query(const b2AABB &aabb, F &&callback) const {
+        int32_t x0 = cellX(aabb.lowerBound.x), y0 = cellY(aabb.lowerBound.y);
+        int32_t x1 = cellX(aabb.upperBound.x), y1 = cellY(aabb.upperBound.y);
+
+        for (int32_t y = y0; y <= y1; y++) {
+            for (int32_t x = x0; x <= x1; x++) {
+                int32_t c = y * cellsX + x;
+                for (uint32_t i = cellStart[c]; i < cellStart[c + 1]; i++) {
+                    const Proxy &p = proxies[cellItems[i]];
+                    // Only report from the first cell that both the proxy and the query touch.
+                    if (std::max(p.x0, x0) == x && std::max(p.y0, y0) == y && b2TestOverlap(p.aabb, aabb)) {
+                        callback(p.userData);
+                    }
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] inline size_t getNumProxies() const { //!< Number of proxies inserted since the last `clear()`
+        return proxies.size();
+    }
+};
+
+#endif
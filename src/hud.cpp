@@ -0,0 +1,251 @@
+//
+// Created by grant on 12/7/20.
+//
+
+#pragma once
+
+#ifndef HUD_CPP_INCLUDED
+#define HUD_CPP_INCLUDED
+
+#include "game.cpp"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Printable ASCII of one font, rasterized once into a single texture. Strings are drawn as one textured
+ *        quad per glyph, so drawing text never touches SDL_ttf after construction.
+ */
+class GlyphAtlas {
+public:
+    static constexpr char firstGlyph = ' ';
+    static constexpr char lastGlyph = '~';
+
+    struct Glyph {
+        SDL_Rect src{}; //!< Where the glyph is in the atlas. Includes the space above and below it in the line.
+        int advance = 0; //!< How far to move the pen after this glyph
+    };
+
+    SDL_Texture *texture = nullptr; //!< `nullptr` if the font couldn't be loaded. Nothing is drawn then.
+    int atlasW = 0, atlasH = 0;
+    int lineSkip = 0;
+    std::array<Glyph, lastGlyph - firstGlyph + 1> glyphs{};
+
+    /**
+     * @brief Load a font and rasterize it. Failures are logged, and leave the atlas empty instead of throwing.
+     * @param ren Renderer to create the texture with
+     * @param path TTF file to load
+     * @param ptSize Size of the font, in points
+     */
+    GlyphAtlas(SDL_Renderer *ren, const char *path, int ptSize) {
+        if (!TTF_WasInit() && TTF_Init() != 0) {
+            ERROR("Failed to initialize SDL_ttf: {}", TTF_GetError());
+            return;
+        }
+
+        TTF_Font *font = TTF_OpenFont(path, ptSize);
+        if (font == nullptr) {
+            WARN("Failed to open HUD font `{}`: {}. HUD text is disabled!", path, TTF_GetError());
+            return;
+        }
+        lineSkip = TTF_FontLineSkip(font);
+
+        SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(0, hudAtlasSize, hudAtlasSize, 32,
+                                                            SDL_PIXELFORMAT_RGBA32);
+        if (atlas == nullptr) {
+            ERROR("Failed to create glyph atlas surface: {}", SDL_GetError());
+            TTF_CloseFont(font);
+            return;
+        }
+
+        // Shelf packing: glyphs left to right, starting a new row when one doesn't fit.
+        int x = 0, y = 0, rowH = 0;
+        for (char ch = firstGlyph; ch <= lastGlyph; ch++) {
+            Glyph &glyph = glyphs[ch - firstGlyph];
+            int minX, maxX, minY, maxY;
+            TTF_GlyphMetrics(font, static_cast<uint16_t>(ch), &minX, &maxX, &minY, &maxY, &glyph.advance);
+
+            SDL_Surface *rendered = TTF_RenderGlyph_Blended(font, static_cast<uint16_t>(ch), SDL_Color{255, 255, 255, 255});
+            if (rendered == nullptr) {
+                continue; // e.g. a space with nothing to draw. Still has an advance.
+            }
+
+            if (x + rendered->w > hudAtlasSize) {
+                x = 0;
+                y += rowH + 1;
+                rowH = 0;
+            }
+            if (y + rendered->h > hudAtlasSize) {
+                WARN("Glyph atlas is full at `{}`! Raise `hudAtlasSize`.", ch);
+                SDL_FreeSurface(rendered);
+                break;
+            }
+
+            glyph.src = SDL_Rect{x, y, rendered->w, rendered->h};
+            SDL_SetSurfaceBlendMode(rendered, SDL_BLENDMODE_NONE); // copy alpha as is
+            SDL_BlitSurface(rendered, nullptr, atlas, &glyph.src);
+
+            x += rendered->w + 1;
+            rowH = std::max(rowH, rendered->h);
+            SDL_FreeSurface(rendered);
+        }
+        TTF_CloseFont(font);
+
+        atlasW = atlas->w;
+        atlasH = atlas->h;
+        texture = SDL_CreateTextureFromSurface(ren, atlas);
+        SDL_FreeSurface(atlas);
+        if (texture == nullptr) {
+            ERROR("Failed to create glyph atlas texture: {}", SDL_GetError());
+            return;
+        }
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    }
+
+    GlyphAtlas(const GlyphAtlas &rhs) = delete; //!< Deleted copy constructor
+    GlyphAtlas &operator=(const GlyphAtlas &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~GlyphAtlas() {
+        if (texture != nullptr) {
+            SDL_DestroyTexture(texture);
+        }
+    }
+
+    /**
+     * @brief Append the quads of a string
+     * @param str String to lay out. Characters outside of printable ASCII are drawn as `?`.
+     * @param x Left of the first glyph, in pixels
+     * @param y Top of the line, in pixels
+     * @param color Color to tint the glyphs with
+     * @param out Appended to, 4 vertices per glyph
+     */
+    void layout(std::string_view str, float x, float y, SDL_Color color, std::vector<SDL_Vertex> &out) const {
+        float startX = x;
+        for (char ch : str) {
+            if (ch == '\n') {
+                x = startX;
+                y += static_cast<float>(lineSkip);
+                continue;
+            }
+            if (ch < firstGlyph || ch > lastGlyph) {
+                ch = '?';
+            }
+
+            const Glyph &glyph = glyphs[ch - firstGlyph];
+            if (glyph.src.w > 0) {
+                float u0 = static_cast<float>(glyph.src.x) / atlasW, v0 = static_cast<float>(glyph.src.y) / atlasH;
+                float u1 = static_cast<float>(glyph.src.x + glyph.src.w) / atlasW;
+                float v1 = static_cast<float>(glyph.src.y + glyph.src.h) / atlasH;
+                auto w = static_cast<float>(glyph.src.w), h = static_cast<float>(glyph.src.h);
+
+                out.push_back(SDL_Vertex{SDL_FPoint{x, y}, color, SDL_FPoint{u0, v0}});
+                out.push_back(SDL_Vertex{SDL_FPoint{x + w, y}, color, SDL_FPoint{u1, v0}});
+                out.push_back(SDL_Vertex{SDL_FPoint{x + w, y + h}, color, SDL_FPoint{u1, v1}});
+                out.push_back(SDL_Vertex{SDL_FPoint{x, y + h}, color, SDL_FPoint{u0, v1}});
+            }
+            x += static_cast<float>(glyph.advance);
+        }
+    }
+};
+
+/**
+ * @brief HUD made of text slots. Each slot caches its string and its laid out quads; setting a slot to the string it
+ *        already shows is a string compare and nothing else. All slots are drawn with one `SDL_RenderGeometry` call.
+ */
+class HudText {
+private:
+    struct Slot {
+        float x, y;
+        SDL_Color color;
+        std::string str; //!< What is currently laid out. Keeps its capacity.
+        std::vector<SDL_Vertex> quads; //!< 4 vertices per glyph of `str`, in screen-space
+    };
+
+    SDL_Renderer *ren;
+    GlyphAtlas atlas;
+    std::vector<Slot> slots;
+
+    bool dirty = false; //!< True if a slot changed since `verts` was built
+    std::vector<SDL_Vertex> verts; //!< All slots' quads, back to back
+    std::vector<int> indices; //!< 6 per quad, only ever grows
+
+public:
+    /**
+     * @brief Create a HUD
+     * @param ren Renderer to draw with
+     * @param fontPath TTF file to use
+     * @param ptSize Size of the font, in points
+     */
+    explicit HudText(SDL_Renderer *ren, const char *fontPath = hudFontPath, int ptSize = hudFontSize)
+            : ren(ren), atlas(ren, fontPath, ptSize) {}
+
+    HudText(const HudText &rhs) = delete; //!< Deleted copy constructor
+    HudText &operator=(const HudText &rhs) = delete; //!< Deleted copy assignment operator
+
+    /**
+     * @brief Add a text slot. Do this once per piece of text, then update it with `set()`.
+     * @param x Left of the text, in pixels
+     * @param y Top of the text, in pixels
+     * @param color Color of the text
+     * @return Handle of the slot
+     */
+    size_t add(float x, float y, SDL_Color color = SDL_Color{0, 0, 0, 255}) {
+        slots.push_back(Slot{x, y, color, {}, {}});
+        return slots.size() - 1;
+    }
+
+    /**
+     * @brief Change the text of a slot. Only lays it out again if it actually changed.
+     * @param slot Handle from `add()`
+     * @param str New text
+     */
+    void set(size_t slot, std::string_view str) {
+        Slot &s = slots[slot];
+        if (s.str == str) {
+            return;
+        }
+
+        s.str.assign(str.data(), str.size());
+        s.quads.clear();
+        atlas.layout(str, s.x, s.y, s.color, s.quads);
+        dirty = true;
+    }
+
+    /// Draw every slot
+    void draw() {
+        if (atlas.texture == nullptr) {
+            return;
+        }
+
+        if (dirty) {
+            verts.clear();
+            for (const auto &slot : slots) {
+                verts.insert(verts.end(), slot.quads.begin(), slot.quads.end());
+            }
+
+            for (auto quad = static_cast<int>(indices.size() / 6); quad < static_cast<int>(verts.size() / 4); quad++) {
+                int v = quad * 4;
+                indices.insert(indices.end(), {v, v + 1, v + 2, v, v + 2, v + 3});
+            }
+            dirty = false;
+        }
+
+        if (verts.empty()) {
+            return;
+        }
+
+        if (SDL_RenderGeometry(ren, atlas.texture, verts.data(), static_cast<int>(verts.size()), indices.data(),
+                               static_cast<int>(verts.size() / 4 * 6)) != 0) {
+            FATAL("Failed to render HUD text: {}", SDL_GetError());
+            throw std::runtime_error("Rendering failed");
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,237 @@
+//
+// Created by grant on 12/3/20.
+//
+
+#pragma once
+
+#ifndef INPUT_CPP_INCLUDED
+#define INPUT_CPP_INCLUDED
+
+#include "game.cpp"
+#include "metrics.hpp"
+#include "spsc_queue.hpp"
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <vector>
+
+/// Ship control that input can set
+enum class Control : uint8_t {
+    eThrust, //!< Value in `[0, 1]`
+    eTurn //!< -1 (left), 0 or 1 (right)
+};
+
+/// A change of one `Control`, with the time of the keyboard/gamepad event that caused it.
+struct InputEvent {
+    Control control;
+    float value; //!< New value of the control
+    uint64_t timeNs; //!< When the event happened, in nanoseconds since the `steady_clock` epoch
+};
+
+/// Handoff of `InputEvent`s from the render thread (which owns SDL's event queue) to the simulation thread.
+using InputQueue = stms::SpscQueue<InputEvent, inputQueueSize>;
+
+/// Current value of every `Control`, as seen by the simulation.
+struct InputState {
+    float thrust = 0;
+    int turn = 0;
+    uint64_t applied = 0; //!< Number of `InputEvent`s applied so far. Stamped into every `RenderSnapshot`.
+
+    void apply(const InputEvent &ev) {
+        if (ev.control == Control::eThrust) {
+            thrust = ev.value;
+        } else {
+            turn = static_cast<int>(ev.value);
+        }
+        applied++;
+    }
+};
+
+/**
+ * @brief Translates SDL keyboard and gamepad events into `InputEvent`s on the render thread, and measures
+ *        input-to-photon latency: the time from an event to the `SDL_RenderPresent` that first shows a snapshot
+ *        of a tick that applied it.
+ *
+ * Keyboard: W/Up to thrust, A/Left and D/Right to turn. Gamepad: A or the right trigger to thrust, left stick to turn.
+ */
+class InputSystem {
+private:
+    InputQueue &queue;
+
+    bool thrustKey = false, leftKey = false, rightKey = false;
+    float padThrust = 0, padTurn = 0;
+    float sentThrust = 0;
+    int sentTurn = 0;
+
+    std::array<uint64_t, inputQueueSize> pushTimes{}; //!< `timeNs` of pushed event `i`, at `i % inputQueueSize`
+    uint64_t pushed = 0; //!< Number of events pushed to `queue`
+    uint64_t shown = 0; //!< Number of pushed events that made it to the screen
+
+    std::vector<SDL_GameController *> controllers;
+
+    stms::Histogram &latencyMs = stms::getMetrics().histogram(
+            "nf2_input_to_photon_ms", "Time from an input event to the first presented frame showing its effect",
+            {5, 10, 16, 20, 25, 33, 50, 75, 100, 200});
+    stms::Counter &dropped = stms::getMetrics().counter("nf2_input_dropped_total",
+                                                        "Input events dropped because the input queue was full");
+
+    bool push(Control control, float value, uint64_t timeNs) { //!< False if the queue was full
+        if (!queue.tryPush(InputEvent{control, value, timeNs})) {
+            dropped.add();
+            return false;
+        }
+        pushTimes[pushed % inputQueueSize] = timeNs;
+        pushed++;
+        return true;
+    }
+
+    /// Push an event for every control whose value changed. Dropped ones stay "changed", see `retry()`.
+    void update(uint64_t timeNs) {
+        float thrust = std::max(thrustKey ? 1.0f : 0.0f, padThrust);
+        int turn = (rightKey || padTurn > gamepadDeadzone) - (leftKey || padTurn < -gamepadDeadzone);
+
+        if (thrust != sentThrust && push(Control::eThrust, thrust, timeNs)) {
+            sentThrust = thrust;
+        }
+        if (turn != sentTurn && push(Control::eTurn, static_cast<float>(turn), timeNs)) {
+            sentTurn = turn;
+        }
+    }
+
+    /// Convert an SDL event timestamp (ms since `SDL_Init`) into `steady_clock` nanoseconds.
+    static uint64_t toSteadyNs(uint32_t sdlTimestamp) {
+        auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        uint64_t age = static_cast<uint64_t>(SDL_GetTicks() - sdlTimestamp) * 1000000u;
+        return now - std::min(now, age);
+    }
+
+public:
+    /**
+     * @brief Create an input system. Gamepads are opened as SDL reports them.
+     * @param queue Queue to push events into, usually `Simulation::input`
+     */
+    explicit InputSystem(InputQueue &queue) : queue(queue) {}
+
+    InputSystem(const InputSystem &rhs) = delete; //!< Deleted copy constructor
+    InputSystem &operator=(const InputSystem &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~InputSystem() {
+        for (SDL_GameController *pad : controllers) {
+            SDL_GameControllerClose(pad);
+        }
+    }
+
+    /**
+     * @brief Handle an SDL event, if it is an input event. Call for every event from `SDL_PollEvent`.
+     * @param event Event to handle
+     * @return True if the event was an input event
+     */
+    bool handleEvent(const SDL_Event &event) {
+        switch (event.type) {
+            case SDL_KEYDOWN:
+            case SDL_KEYUP: {
+                if (event.key.repeat) {
+                    return true;
+                }
+
+                bool down = event.type == SDL_KEYDOWN;
+                switch (event.key.keysym.scancode) {
+                    case SDL_SCANCODE_W:
+                    case SDL_SCANCODE_UP:
+                        thrustKey = down;
+                        break;
+                    case SDL_SCANCODE_A:
+                    case SDL_SCANCODE_LEFT:
+                        leftKey = down;
+                        break;
+                    case SDL_SCANCODE_D:
+                    case SDL_SCANCODE_RIGHT:
+                        rightKey = down;
+                        break;
+                    default:
+                        return true;
+                }
+                update(toSteadyNs(event.key.timestamp));
+                return true;
+            }
+
+            case SDL_CONTROLLERAXISMOTION: {
+                float value = event.caxis.value / 32767.0f;
+                if (event.caxis.axis == SDL_CONTROLLER_AXIS_LEFTX) {
+                    padTurn = value;
+                } else if (event.caxis.axis == SDL_CONTROLLER_AXIS_TRIGGERRIGHT) {
+                    padThrust = value > gamepadDeadzone ? value : 0;
+                } else {
+                    return true;
+                }
+                update(toSteadyNs(event.caxis.timestamp));
+                return true;
+            }
+
+            case SDL_CONTROLLERBUTTONDOWN:
+            case SDL_CONTROLLERBUTTONUP:
+                if (event.cbutton.button == SDL_CONTROLLER_BUTTON_A) {
+                    padThrust = event.type == SDL_CONTROLLERBUTTONDOWN ? 1.0f : 0.0f;
+                    update(toSteadyNs(event.cbutton.timestamp));
+                }
+                return true;
+
+            case SDL_CONTROLLERDEVICEADDED: {
+                SDL_GameController *pad = SDL_GameControllerOpen(event.cdevice.which);
+                if (pad == nullptr) {
+                    WARN("Failed to open gamepad {}: {}", event.cdevice.which, SDL_GetError());
+                } else {
+                    INFO("Gamepad connected: {}", SDL_GameControllerName(pad));
+                    controllers.push_back(pad);
+                }
+                return true;
+            }
+
+            case SDL_CONTROLLERDEVICEREMOVED: {
+                SDL_GameController *pad = SDL_GameControllerFromInstanceID(event.cdevice.which);
+                auto it = std::find(controllers.begin(), controllers.end(), pad);
+                if (it != controllers.end()) {
+                    INFO("Gamepad disconnected: {}", SDL_GameControllerName(pad));
+                    SDL_GameControllerClose(pad);
+                    controllers.erase(it);
+                }
+                return true;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    /// Push control changes that were dropped because the queue was full, so e.g. a released key can't stay stuck
+    /// down. Call once per frame, after handling the events.
+    void retry() {
+        update(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count()));
+    }
+
+    /**
+     * @brief Record input-to-photon latency. Call right after `SDL_RenderPresent`.
+     * @param inputSeq `RenderSnapshot::inputSeq` of the snapshot that was just presented
+     */
+    void onPresent(uint64_t inputSeq) {
+        if (inputSeq <= shown) {
+            return;
+        }
+
+        auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+
+        // Events older than the queue capacity had their timestamps overwritten, skip them.
+        shown = std::max(shown, pushed > inputQueueSize ? pushed - inputQueueSize : 0);
+        for (; shown < inputSeq; shown++) {
+            latencyMs.observe(static_cast<double>(now - pushTimes[shown % inputQueueSize]) / 1000000.0);
+        }
+    }
+};
+
+#endif
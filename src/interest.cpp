@@ -0,0 +1,127 @@
+//
+// Created by grant on 12/12/20.
+//
+
+#pragma once
+
+#ifndef INTEREST_CPP_INCLUDED
+#define INTEREST_CPP_INCLUDED
+
+#include "config.hpp"
+#include "metrics.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Spatial hash of the entities a `GameServer` sends, for finding what's near each client. It's updated
+ *        incrementally: `update()` every entity every tick, and only the ones that crossed into another cell are
+ *        moved, so an unchanged world costs one hash lookup per entity.
+ */
+class InterestGrid {
+private:
+    struct Item {
+        uint32_t id;
+        uint32_t index; //!< Index of the entity in the caller's list of this tick, see `update()`
+    };
+
+    struct Location {
+        uint64_t cell;
+        uint32_t slot; //!< Index in `cells[cell]`
+    };
+
+    float cellSize;
+    std::unordered_map<uint64_t, std::vector<Item>> cells; //!< Emptied cells are kept, so moving back is cheap
+    std::unordered_map<uint32_t, Location> locations; //!< By entity id
+
+    stms::Counter &moves = stms::getMetrics().counter("nf2_interest_cell_moves_total",
+                                                      "Entities that moved to another cell of an InterestGrid");
+
+    static inline uint64_t cellKey(int32_t cx, int32_t cy) {
+        return static_cast<uint64_t>(static_cast<uint32_t>(cx)) << 32u | static_cast<uint32_t>(cy);
+    }
+
+    [[nodiscard]] inline int32_t toCell(float v) const {
+        return static_cast<int32_t>(std::floor(v / cellSize));
+    }
+
+    void unlink(const Location &loc) { //!< Swap-remove an item from its cell
+        std::vector<Item> &cell = cells[loc.cell];
+        if (loc.slot + 1 != cell.size()) {
+            cell[loc.slot] = cell.back();
+            locations[cell[loc.slot].id].slot = loc.slot;
+        }
+        cell.pop_back();
+    }
+
+public:
+    explicit InterestGrid(float cellSize = interestCellSize) : cellSize(cellSize) {}
+
+    InterestGrid(const InterestGrid &rhs) = delete; //!< Deleted copy constructor
+    InterestGrid &operator=(const InterestGrid &rhs) = delete; //!< Deleted copy assignment operator
+
+    /**
+     * @brief Insert an entity, or update its position and index
+     * @param id Id of the entity
+     * @param index What `query()` reports for the entity until the next `update()` of it
+     * @param x Position of the entity
+     * @param y Position of the entity
+     */
+    void update(uint32_t id, uint32_t index, float x, float y) {
+        uint64_t key = cellKey(toCell(x), toCell(y));
+        auto it = locations.find(id);
+        if (it != locations.end() && it->second.cell == key) {
+            cells[key][it->second.slot].index = index;
+            return;
+        }
+
+        if (it != locations.end()) {
+            unlink(it->second);
+            moves.add();
+        }
+        std::vector<Item> &cell = cells[key];
+        locations[id] = Location{key, static_cast<uint32_t>(cell.size())};
+        cell.push_back(Item{id, index});
+    }
+
+    void remove(uint32_t id) { //!< Remove an entity, if it's in the grid
+        auto it = locations.find(id);
+        if (it != locations.end()) {
+            unlink(it->second);
+            locations.erase(id);
+        }
+    }
+
+    /**
+     * @brief Call `func(index)` for every entity in a cell that overlaps a square. Entities outside of the
+     *        circle inscribed in the square may be reported too, check their distance if it matters.
+     * @param x Center of the square
+     * @param y Center of the square
+     * @param radius Half the side length of the square
+     * @param func Called with the `index` of every entity found
+     */
+    template<typename F>
+    void query(float x, float y, float radius, F &&func) const {
+        int32_t x0 = toCell(x - radius), x1 = toCell(x + radius);
+        int32_t y0 = toCell(y - radius), y1 = toCell(y + radius);
+        for (int32_t cx = x0; cx <= x1; cx++) {
+            for (int32_t cy = y0; cy <= y1; cy++) {
+                auto it = cells.find(cellKey(cx, cy));
+                if (it == cells.end()) {
+                    continue;
+                }
+                for (const Item &item : it->second) {
+                    func(item.index);
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] inline size_t size() const {
+        return locations.size();
+    }
+};
+
+#endif
@@ -12,6 +12,15 @@
 #include "log.hpp"
 
 #include "thread.cpp"
+#include "affinity.cpp"
+#include "frame_arena.cpp"
+#include "metrics.cpp"
+#include "watchdog.cpp"
+#include "log_sink.cpp"
+#include "script.cpp"
+#include "ring_queue.hpp"
+
+#include <ctime>
 
 namespace stms {
 
@@ -19,32 +28,55 @@ namespace stms {
             : level(lvl), time(iTime), file(iFile), line(iLine) {}
 
 #   ifdef ENABLE_LOGGING
-    static FILE *&getLatestLogFile() {
-        static FILE *fp = nullptr;
-        return fp;
+    static std::unique_ptr<LogFileSink> &getLatestLogSink() {
+        static std::unique_ptr<LogFileSink> val;
+        return val;
     }
 
-    static FILE *&getUniqueLogFile() {
-        static FILE *fp = nullptr;
-        return fp;
+    static std::unique_ptr<LogFileSink> &getUniqueLogSink() {
+        static std::unique_ptr<LogFileSink> val;
+        return val;
     }
 
-    void quitLogging() {
-        if (logToLatestLog) {
-            std::fclose(getLatestLogFile());
-        }
+    static Counter &getLogRecordCounter() {
+        static Counter &val = getMetrics().counter("stms_log_records_total", "Log records inserted");
+        return val;
+    }
 
-        if (logToUniqueFile) {
-            std::fclose(getUniqueLogFile());
-        }
+    static Counter &getLogDropCounter() {
+        static Counter &val = getMetrics().counter("stms_log_dropped_total",
+                                                   "Log records dropped because the log queue was full");
+        return val;
+    }
 
+    static Gauge &getLogQueueGauge() {
+        static Gauge &val = getMetrics().gauge("stms_log_queue_length", "Log records waiting to be consumed");
+        return val;
+    }
+
+    void quitLogging() {
         if (getLogPool() != nullptr) {
             getLogPool()->waitIdle(1000); // make sure all in-flight log records are processed!
             getLogPool()->stop(false);
         }
+
+        // Flushes whatever is still buffered, and joins the I/O threads.
+        getLatestLogSink().reset();
+        getUniqueLogSink().reset();
     }
 
     void initLogging() {
+        // Register the logging metrics up front, so they show up in scrapes before anything happens to them.
+        getLogRecordCounter();
+        getLogDropCounter();
+        getLogQueueGauge();
+        getMetrics().callbackGauge("stms_log_sink_dropped_lines", "Log lines dropped because a file sink fell behind",
+                                   []() {
+                                       uint64_t ret = 0;
+                                       ret += getLatestLogSink() ? getLatestLogSink()->getDropped() : 0;
+                                       ret += getUniqueLogSink() ? getUniqueLogSink()->getDropped() : 0;
+                                       return static_cast<double>(ret);
+                                   });
 
         if (logToStdout) {
             getLogHooks().emplace_back([](LogRecord *, std::string *str) {
@@ -64,31 +96,29 @@ namespace stms {
         });
 
         if (logToLatestLog) {
-            getLatestLogFile() = std::fopen("./latest.log", "w");
+            getLatestLogSink() = std::make_unique<LogFileSink>("./latest");
 
             getLogHooks().emplace_back([](LogRecord *, std::string *str) {
-                std::fputs(str->c_str(), getLatestLogFile());
-                std::fputc('\n', getLatestLogFile());
-                // Don't call fflush!
+                getLatestLogSink()->write(*str); // only copies into a buffer, the sink's thread does the I/O
             });
         }
 
         auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-        std::string ctimeStr = fmt::format("{:%a %b %d %T %Y}", *std::localtime(&now));
+        std::tm localNow{}; // not `std::localtime`, its static buffer is shared with every other thread
+        localtime_r(&now, &localNow);
+        std::string ctimeStr = fmt::format("{:%a %b %d %T %Y}", localNow);
         std::string header = fmt::format("{0:=<32} [ NEW LOGGING SESSION AT {1} ] {0:=<32}",
                                          "", ctimeStr);
 
         if (logToUniqueFile) {
             mkdir(logsDir, 0777);
 
-            ctimeStr = "/" + ctimeStr + ".log";
-            ctimeStr = logsDir + ctimeStr;
-            getUniqueLogFile() = fopen(ctimeStr.c_str(), "w");
+            // No spaces or colons, so the name is easy to use from a shell (and valid on Windows).
+            getUniqueLogSink() = std::make_unique<LogFileSink>(
+                    fmt::format("{}/{:%Y%m%d-%H%M%S}", logsDir, localNow));
 
             getLogHooks().emplace_back([](LogRecord *, std::string *str) {
-                std::fputs(str->c_str(), getUniqueLogFile());
-                std::fputc('\n', getUniqueLogFile());
-                // Don't call fflush!
+                getUniqueLogSink()->write(*str);
             });
         }
 
@@ -104,8 +134,8 @@ namespace stms {
     static volatile bool logConsuming = false;
     static std::mutex logQMtx = std::mutex();
 
-    static inline std::queue<std::unique_ptr<LogRecord>> &getLogQueue() {
-        static std::queue<std::unique_ptr<LogRecord>> queue;
+    static inline RingQueue<FramePtr<LogRecord>> &getLogQueue() {
+        static RingQueue<FramePtr<LogRecord>> queue;
         return queue;
     }
 
@@ -134,8 +164,9 @@ namespace stms {
 
         bool empty = getLogQueue().empty();
         if (!empty) {
-            std::unique_ptr<LogRecord> top = std::move(getLogQueue().front());
+            FramePtr<LogRecord> top = std::move(getLogQueue().front());
             getLogQueue().pop();
+            getLogQueueGauge().set(static_cast<double>(getLogQueue().size()));
 
             lg.unlock();
 
@@ -143,14 +174,19 @@ namespace stms {
             fmt::format_to(fileUrl, "file://{}:{}", top->file, top->line);
 
             time_t localtimeReady = std::chrono::system_clock::to_time_t(top->time);
+            std::tm localTime{};
+            localtime_r(&localtimeReady, &localTime);
             auto seconds = std::chrono::time_point_cast<std::chrono::seconds>(top->time);
             auto ms = std::chrono::duration_cast<std::chrono::nanoseconds>(top->time - seconds);
 
             fmt::memory_buffer logMsg;
-            fmt::format_to(logMsg, "[{0:%T}.{1:<12}] [{2:^72}] [{3:<8}]: {4}", *std::localtime(&localtimeReady),
-                           ms.count(), fmt::to_string(fileUrl), logLevelToString(top->level), fmt::to_string(top->msg));
+            fmt::format_to(logMsg, "[{0:%T}.{1:<12}] [{2:^72}] [{3:<8}]: {4}", localTime,
+                           ms.count(), fmt::string_view(fileUrl.data(), fileUrl.size()),
+                           logLevelToString(top->level), fmt::string_view(top->msg.data(), top->msg.size()));
 
-            std::string finalMsg = fmt::to_string(logMsg); // don't flush!
+            // Reused across records so that its capacity sticks around and we don't allocate every time.
+            thread_local std::string finalMsg;
+            finalMsg.assign(logMsg.data(), logMsg.size()); // don't flush!
 
             for (const auto &func : getLogHooks()) {
                 func(top.get(), &finalMsg);
@@ -160,7 +196,7 @@ namespace stms {
             // This is better than just looping bc it breaks the consume task up into multiple submits
             // to the thread pool!
             if (getLogPool() != nullptr) {
-                getLogPool()->submitTask(consumeLogs);
+                getLogPool()->submitDetached(consumeLogs, TaskLane::eBackground);
 
                 if (!getLogPool()->isRunning()) {
                     getLogPool()->start();
@@ -176,17 +212,24 @@ namespace stms {
         }
     }
 
-    void insertImpl(std::unique_ptr<LogRecord> rec) {
+    void insertImpl(FramePtr<LogRecord> rec) {
         std::unique_lock<std::mutex> lg(logQMtx);
 
-        getLogQueue().emplace(std::move(rec));
+        if (getLogQueue().size() >= maxLogQueueSize) {
+            getLogDropCounter().add();
+            return; // `rec` is freed on the way out. The consume task is already running, so we are done.
+        }
+
+        getLogRecordCounter().add();
+        getLogQueue().push(std::move(rec));
+        getLogQueueGauge().set(static_cast<double>(getLogQueue().size()));
 
         if (getLogPool() != nullptr && !logConsuming) {
             logConsuming = true;
 
             lg.unlock();
 
-            getLogPool()->submitTask(consumeLogs);
+            getLogPool()->submitDetached(consumeLogs, TaskLane::eBackground);
 
             if (!getLogPool()->isRunning()) {
                 getLogPool()->start();
@@ -203,7 +246,13 @@ namespace stms {
         }
     }
 
+    size_t getLogQueueLength() {
+        std::lock_guard<std::mutex> lg(logQMtx);
+        return getLogQueue().size();
+    }
+
 #   else // ENABLE_LOGGING
+    size_t getLogQueueLength() { return 0; };
     void consumeLogs() {};
     void initLogging() {};
     void quitLogging() {};
@@ -0,0 +1,438 @@
+//
+// Created by grant on 12/2/20.
+//
+
+#include "log_sink.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#ifdef STMS_HAVE_ZLIB
+#   include <zlib.h>
+#endif
+
+namespace stms {
+
+    static constexpr size_t logSinkAlignment = 4096; //!< Buffers are page aligned for the kernel's copy
+
+    static constexpr char lzMagic[8] = {'N', 'F', '2', 'L', 'Z', '0', '0', '1'};
+    static constexpr size_t lzBlockBytes = 1u << 16u; //!< Uncompressed bytes per block of a `.log.lz` file
+    static constexpr size_t lzHashBits = 12;
+
+    static inline uint32_t lzRead32(const uint8_t *p) {
+        uint32_t ret;
+        std::memcpy(&ret, p, sizeof(ret));
+        return ret;
+    }
+
+    static inline uint8_t *lzWriteLength(uint8_t *op, size_t len) { //!< Extra length bytes, LZ4 style
+        while (len >= 255) {
+            *op++ = 255;
+            len -= 255;
+        }
+        *op++ = static_cast<uint8_t>(len);
+        return op;
+    }
+
+    /**
+     * @brief Compress a block in the LZ4 block format: runs of `[token][literals][offset][match]` with a 64KiB
+     *        window. Greedy, single probe hash table. Fast, and log text compresses well even like this.
+     * @param src Data to compress, at most 64KiB
+     * @param n Size of `src`
+     * @param dst Output, must have room for `n + n / 255 + 16` bytes
+     * @return Compressed size
+     */
+    [[maybe_unused]] static size_t lzCompressBlock(const uint8_t *src, size_t n, uint8_t *dst) {
+        uint32_t table[1u << lzHashBits] = {}; // position + 1 of the last occurrence, 0 if none
+        uint8_t *op = dst;
+        size_t anchor = 0;
+
+        auto emit = [&](size_t litEnd, size_t offset, size_t matchLen) {
+            size_t litLen = litEnd - anchor;
+            uint8_t *token = op++;
+            *token = static_cast<uint8_t>(std::min<size_t>(litLen, 15) << 4u);
+            if (litLen >= 15) {
+                op = lzWriteLength(op, litLen - 15);
+            }
+            std::memcpy(op, src + anchor, litLen);
+            op += litLen;
+
+            if (matchLen != 0) {
+                *op++ = static_cast<uint8_t>(offset);
+                *op++ = static_cast<uint8_t>(offset >> 8u);
+                *token |= static_cast<uint8_t>(std::min<size_t>(matchLen - 4, 15));
+                if (matchLen - 4 >= 15) {
+                    op = lzWriteLength(op, matchLen - 4 - 15);
+                }
+            }
+        };
+
+        // Like LZ4, the last 5 bytes are always literals, and no match starts in the last 12.
+        size_t ip = 0;
+        while (n > 12 && ip < n - 12) {
+            uint32_t seq = lzRead32(src + ip);
+            uint32_t hash = (seq * 2654435761u) >> (32 - lzHashBits);
+            size_t ref = table[hash];
+            table[hash] = static_cast<uint32_t>(ip + 1);
+
+            if (ref == 0 || ip - (ref - 1) > 0xFFFF || lzRead32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            size_t len = 4;
+            while (ip + len < n - 5 && src[ref + len] == src[ip + len]) {
+                len++;
+            }
+
+            emit(ip, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+
+        emit(n, 0, 0);
+        return static_cast<size_t>(op - dst);
+    }
+
+    /**
+     * @brief Decompress a block written by `lzCompressBlock`
+     * @return Decompressed size, or `SIZE_MAX` if the block is corrupt
+     */
+    static size_t lzDecompressBlock(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+        const uint8_t *ip = src, *end = src + n;
+        size_t out = 0;
+
+        auto readLength = [&](size_t len) {
+            if (len == 15) {
+                uint8_t b;
+                do {
+                    if (ip >= end) {
+                        return SIZE_MAX;
+                    }
+                    b = *ip++;
+                    len += b;
+                } while (b == 255);
+            }
+            return len;
+        };
+
+        while (ip < end) {
+            uint8_t token = *ip++;
+            size_t litLen = readLength(token >> 4u);
+            if (litLen == SIZE_MAX || litLen > static_cast<size_t>(end - ip) || out + litLen > cap) {
+                return SIZE_MAX;
+            }
+            std::memcpy(dst + out, ip, litLen);
+            ip += litLen;
+            out += litLen;
+
+            if (ip == end) {
+                break; // the last sequence is literals only
+            }
+
+            if (end - ip < 2) {
+                return SIZE_MAX;
+            }
+            size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8u);
+            ip += 2;
+            size_t matchLen = readLength(token & 15u);
+            if (matchLen == SIZE_MAX || offset == 0 || offset > out || out + matchLen + 4 > cap) {
+                return SIZE_MAX;
+            }
+            matchLen += 4;
+
+            for (size_t i = 0; i < matchLen; i++, out++) { // byte by byte, matches may overlap themselves
+                dst[out] = dst[out - offset];
+            }
+        }
+
+        return out;
+    }
+
+    /**
+     * @brief Compress a rotated segment next to it, then delete the original
+     * @param path Segment to compress
+     * @return True on success
+     */
+    static bool compressLogSegment(const std::string &path) {
+        std::FILE *in = std::fopen(path.c_str(), "rb");
+        if (in == nullptr) {
+            std::cerr << "Failed to open log segment `" << path << "` for compression: " << std::strerror(errno)
+                      << std::endl;
+            return false;
+        }
+
+        std::unique_ptr<uint8_t[]> raw(new uint8_t[lzBlockBytes]);
+        bool ok = true;
+
+#   ifdef STMS_HAVE_ZLIB
+        std::string outPath = path + ".gz";
+        gzFile out = gzopen(outPath.c_str(), "wb6");
+        ok = out != nullptr;
+        while (ok) {
+            size_t n = std::fread(raw.get(), 1, lzBlockBytes, in);
+            if (n == 0) {
+                break;
+            }
+            ok = gzwrite(out, raw.get(), static_cast<unsigned>(n)) == static_cast<int>(n);
+        }
+        if (out != nullptr) {
+            ok = gzclose(out) == Z_OK && ok;
+        }
+#   else
+        std::string outPath = path + ".lz";
+        std::FILE *out = std::fopen(outPath.c_str(), "wb");
+        std::unique_ptr<uint8_t[]> packed(new uint8_t[lzBlockBytes + lzBlockBytes / 255 + 16]);
+        ok = out != nullptr && std::fwrite(lzMagic, sizeof(lzMagic), 1, out) == 1;
+        while (ok) {
+            size_t n = std::fread(raw.get(), 1, lzBlockBytes, in);
+            uint32_t header[2] = {static_cast<uint32_t>(n), 0};
+            if (n != 0) {
+                header[1] = static_cast<uint32_t>(lzCompressBlock(raw.get(), n, packed.get()));
+            }
+
+            ok = std::fwrite(header, sizeof(header), 1, out) == 1 &&
+                 std::fwrite(packed.get(), 1, header[1], out) == header[1];
+            if (n == 0) {
+                break; // a zero sized block terminates the file
+            }
+        }
+        if (out != nullptr) {
+            ok = std::fclose(out) == 0 && ok;
+        }
+#   endif
+
+        std::fclose(in);
+        if (ok) {
+            std::remove(path.c_str());
+        } else {
+            std::cerr << "Failed to compress log segment `" << path << "`! Keeping it uncompressed." << std::endl;
+            std::remove(outPath.c_str());
+        }
+        return ok;
+    }
+
+    bool decompressLogSegment(const std::string &in, const std::string &out) {
+        std::FILE *ifp = std::fopen(in.c_str(), "rb");
+        if (ifp == nullptr) {
+            return false;
+        }
+        std::FILE *ofp = std::fopen(out.c_str(), "wb");
+        if (ofp == nullptr) {
+            std::fclose(ifp);
+            return false;
+        }
+
+        std::unique_ptr<uint8_t[]> raw(new uint8_t[lzBlockBytes]);
+        std::unique_ptr<uint8_t[]> packed(new uint8_t[lzBlockBytes + lzBlockBytes / 255 + 16]);
+
+        char magic[sizeof(lzMagic)];
+        bool ok = std::fread(magic, sizeof(magic), 1, ifp) == 1 && std::memcmp(magic, lzMagic, sizeof(magic)) == 0;
+        while (ok) {
+            uint32_t header[2];
+            ok = std::fread(header, sizeof(header), 1, ifp) == 1 && header[0] <= lzBlockBytes &&
+                 header[1] <= lzBlockBytes + lzBlockBytes / 255 + 16;
+            if (!ok || header[0] == 0) {
+                break;
+            }
+
+            ok = std::fread(packed.get(), 1, header[1], ifp) == header[1] &&
+                 lzDecompressBlock(packed.get(), header[1], raw.get(), lzBlockBytes) == header[0] &&
+                 std::fwrite(raw.get(), 1, header[0], ofp) == header[0];
+        }
+
+        std::fclose(ifp);
+        ok = std::fclose(ofp) == 0 && ok;
+        return ok;
+    }
+
+    LogFileSink::LogFileSink(std::string base) : base(std::move(base)) {
+        freeBuffers.reserve(logSinkBuffers);
+        fullBuffers.reserve(logSinkBuffers);
+        for (size_t i = 0; i < logSinkBuffers; i++) {
+            Buffer buf{static_cast<char *>(std::aligned_alloc(logSinkAlignment, logSinkBufferBytes)), 0};
+            if (buf.data == nullptr) {
+                std::cerr << "Failed to allocate log sink buffer!" << std::endl;
+                continue;
+            }
+            freeBuffers.push_back(buf);
+        }
+        if (!freeBuffers.empty()) {
+            active = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+
+        openActive();
+        compressThread = std::thread(&LogFileSink::compressFunc, this);
+        ioThread = std::thread(&LogFileSink::ioFunc, this);
+    }
+
+    LogFileSink::~LogFileSink() {
+        {
+            std::lock_guard<std::mutex> lg(bufferMtx);
+            running = false;
+        }
+        bufferCv.notify_all();
+        ioThread.join();
+
+        {
+            std::lock_guard<std::mutex> lg(compressMtx);
+            compressing = false;
+        }
+        compressCv.notify_all();
+        compressThread.join();
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        std::free(active.data);
+        for (auto &buf : freeBuffers) {
+            std::free(buf.data);
+        }
+    }
+
+    void LogFileSink::write(std::string_view line) {
+        size_t len = std::min(line.size(), logSinkBufferBytes - 1);
+
+        std::unique_lock<std::mutex> lg(bufferMtx);
+        if (active.data == nullptr || active.size + len + 1 > logSinkBufferBytes) {
+            if (freeBuffers.empty()) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (active.data != nullptr) {
+                fullBuffers.push_back(active);
+            }
+            active = freeBuffers.back();
+            freeBuffers.pop_back();
+            bufferCv.notify_one();
+        }
+
+        std::memcpy(active.data + active.size, line.data(), len);
+        active.data[active.size + len] = '\n';
+        active.size += len + 1;
+    }
+
+    void LogFileSink::ioFunc() {
+        std::unique_lock<std::mutex> lg(bufferMtx);
+        while (true) {
+            bufferCv.wait_for(lg, std::chrono::milliseconds(logSinkFlushMs),
+                              [&]() { return !fullBuffers.empty() || !running; });
+
+            // Nothing filled up in a while (or we are stopping)? Write out what we have anyways.
+            if (fullBuffers.empty() && active.size != 0 && !freeBuffers.empty()) {
+                fullBuffers.push_back(active);
+                active = freeBuffers.back();
+                freeBuffers.pop_back();
+            }
+
+            while (!fullBuffers.empty()) {
+                Buffer buf = fullBuffers.front();
+                fullBuffers.erase(fullBuffers.begin()); // there are only ever a handful of buffers
+
+                lg.unlock();
+                writeOut(buf);
+                lg.lock();
+
+                buf.size = 0;
+                freeBuffers.push_back(buf);
+            }
+
+            if (!running && active.size == 0) {
+                break;
+            }
+        }
+    }
+
+    void LogFileSink::writeOut(const Buffer &buf) {
+        if (fd < 0 && !openActive()) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        size_t written = 0;
+        while (written < buf.size) {
+            ssize_t n = ::write(fd, buf.data + written, buf.size - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                std::cerr << "Failed to write log file `" << base << ".log`: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            written += static_cast<size_t>(n);
+        }
+        segmentBytes += written;
+
+        bool tooBig = logRotateBytes != 0 && segmentBytes >= logRotateBytes;
+        bool tooOld = logRotateSeconds != 0 &&
+                      std::chrono::steady_clock::now() - segmentStart >= std::chrono::seconds(logRotateSeconds);
+        if (tooBig || tooOld) {
+            rotate();
+        }
+    }
+
+    void LogFileSink::rotate() {
+        close(fd);
+        fd = -1;
+
+        // Skip over segments left behind by a previous run with the same base (e.g. `latest`).
+        std::string segment;
+        do {
+            segment = base + "." + std::to_string(nextSegment++) + ".log";
+        } while (access(segment.c_str(), F_OK) == 0 || access((segment + ".gz").c_str(), F_OK) == 0 ||
+                 access((segment + ".lz").c_str(), F_OK) == 0);
+
+        std::string activePath = base + ".log";
+        if (std::rename(activePath.c_str(), segment.c_str()) != 0) {
+            std::cerr << "Failed to rotate log file `" << activePath << "`: " << std::strerror(errno) << std::endl;
+        } else if (logCompressRotated) {
+            {
+                std::lock_guard<std::mutex> lg(compressMtx);
+                toCompress.emplace_back(std::move(segment));
+            }
+            compressCv.notify_one();
+        }
+
+        openActive();
+    }
+
+    bool LogFileSink::openActive() {
+        std::string path = base + ".log";
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        segmentBytes = 0;
+        segmentStart = std::chrono::steady_clock::now();
+
+        if (fd < 0) {
+            std::cerr << "Failed to open log file `" << path << "`: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void LogFileSink::compressFunc() {
+        std::unique_lock<std::mutex> lg(compressMtx);
+        while (compressing || !toCompress.empty()) {
+            compressCv.wait(lg, [&]() { return !toCompress.empty() || !compressing; });
+
+            while (!toCompress.empty()) {
+                std::string path = std::move(toCompress.front());
+                toCompress.erase(toCompress.begin());
+
+                lg.unlock();
+                compressLogSegment(path);
+                lg.lock();
+            }
+        }
+    }
+}
@@ -1,12 +1,21 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
+#include <csignal>
 #include <cstdlib>
+#include <ctime>
 #include <iostream>
+#include <memory>
+#include <string>
 
 #include "game.cpp"
+#include "sim.cpp"
+#include "hud.cpp"
+#include "audio.cpp"
+#include "net.cpp"
 
 #include "log.cpp"
 #include "c_smart_ptr.cpp"
+#include "alloc_counter.cpp"
 
 #include "phys.cpp"
 
@@ -24,37 +33,182 @@ FATAL("`{}` failed: {}", #x, SDL_GetError()); \
 return EXIT_FAILURE; \
 }
 
-int main() {
+static std::atomic_bool quitRequested = false; //!< Set by SIGINT/SIGTERM in server mode
+
+static void reportStartup(stms::Stopwatch &startup, const char *mode) {
+    float ms = startup.getTime();
+    stms::getMetrics().gauge("nf2_startup_ms", "Time from main() to the first frame or server tick").set(ms);
+    INFO("{} started up in {:.2f}ms", mode, ms);
+}
+
+/// Telemetry writer for a new match, in a directory under `telemetryDir` named after the current time
+static std::unique_ptr<TelemetryWriter> openTelemetry() {
+    mkdir(telemetryDir, 0777);
+    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::tm localTime{}; // not `std::localtime`, its static buffer is shared with the log consumer
+    localtime_r(&now, &localTime);
+    auto ret = std::make_unique<TelemetryWriter>(fmt::format("{}/{:%Y%m%d-%H%M%S}", telemetryDir, localTime));
+    INFO("Recording telemetry to `{}`", ret->getDir());
+    return ret;
+}
+
+/// Dedicated server: no window, no audio, no input devices, so no SDL subsystem is initialized at all.
+static int runServer(uint16_t port, float arenaScale, bool telemetry, stms::Stopwatch &startup,
+                     const stms::ThreadPlacement &placement) {
+    // This thread runs the ticks, so it's placed like the simulation thread of a client, before the server (and
+    // all of its per-match state) is allocated.
+    stms::applyPlacement(placement);
+    std::unique_ptr<TelemetryWriter> telemetryWriter = telemetry ? openTelemetry() : nullptr;
+    GameServer server(fieldWidth * arenaScale, fieldHeight * arenaScale);
+    if (!server.start(port)) {
+        return EXIT_FAILURE;
+    }
+    server.setTelemetry(telemetryWriter.get());
+
+    std::signal(SIGINT, [](int) { quitRequested = true; });
+    std::signal(SIGTERM, [](int) { quitRequested = true; });
+
+    stms::TPSTimer timer{};
+    while (!quitRequested) {
+        timer.tick();
+        server.tickOnce();
+        if (server.getTick() == 1) {
+            reportStartup(startup, "Server");
+        }
+        timer.wait(tickRate);
+    }
+
+    INFO("Server stopping after {} ticks", server.getTick());
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    stms::Stopwatch startup;
+    startup.start();
+
+    bool serverMode = false;
+    uint16_t port = serverPort;
+    float arenaScale = 1;
+    bool telemetry = false;
+    stms::ThreadPlacement poolPlacement{poolThreadName, stms::parseCpuList(poolCpus), poolNumaNode, poolPriority};
+    stms::ThreadPlacement simPlacement{simThreadName, stms::parseCpuList(simCpus), simNumaNode, simPriority};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--server") {
+            serverMode = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                port = static_cast<uint16_t>(std::atoi(argv[++i]));
+            }
+        } else if (arg == "--large-arena") {
+            arenaScale = largeArenaScale;
+        } else if (arg == "--telemetry") {
+            telemetry = true;
+        } else if (arg == "--pool-cpus" && i + 1 < argc) {
+            poolPlacement.cpus = stms::parseCpuList(argv[++i]);
+        } else if (arg == "--sim-cpus" && i + 1 < argc) {
+            simPlacement.cpus = stms::parseCpuList(argv[++i]);
+        } else if (arg == "--numa-node" && i + 1 < argc) {
+            poolPlacement.numaNode = simPlacement.numaNode = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Unknown argument `" << arg << "`\nUsage: " << argv[0]
+                      << " [--server [port]] [--large-arena] [--telemetry] [--pool-cpus <list>]"
+                         " [--sim-cpus <list>] [--numa-node <node>]\n";
+            return EXIT_FAILURE;
+        }
+    }
+
     auto pool = stms::ThreadPool();
-    pool.start();
+    pool.setPlacement(poolPlacement);
+    pool.start(poolPlacement.cpus.empty() ? 0 : static_cast<unsigned>(poolPlacement.cpus.size()));
+    if (pool.getNumThreads() > poolCriticalWorkers) { // logging and other background work never delay a frame
+        pool.setReservedWorkers(stms::TaskLane::eFrameCritical, poolCriticalWorkers);
+    }
     stms::getLogPool() = &pool;
     stms::initLogging();
 
-    PhysicsEngine phys{};
+    pool.registerMetrics("main");
+    stms::MetricsServer metricsServer{};
+    if (metricsPort != 0) {
+        metricsServer.start(metricsPort);
+    }
+    stms::Histogram &frameMs = stms::getMetrics().histogram("nf2_frame_ms", "Time between rendered frames",
+                                                             {1, 2, 5, 8, 16, 17, 20, 33, 50, 100});
+
+    if (serverMode) {
+        return runServer(port, arenaScale, telemetry, startup, simPlacement);
+    }
+
+    // Only what the client uses: no haptics or sensors. Events come with video, joysticks with game controllers.
+    SDL_ASSERT_EQ(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER), 0);
+    float sdlMs = startup.getTime();
 
-    SDL_ASSERT_EQ(SDL_Init(SDL_INIT_EVERYTHING), 0);
-    SDL_ASSERT_NE(IMG_Init(IMG_INIT_PNG), 0);
+    AssetBundle bundle;
+    if (!bundle.open()) {
+        INFO("No asset bundle at `{}`, decoding sprites from ./res/ instead", assetBundlePath);
+        SDL_ASSERT_NE(IMG_Init(IMG_INIT_PNG), 0);
+    }
 
     CSmartPtr<SDL_Window> win(SDL_CreateWindow("Hello World!", 100, 100, winWidth(), winHeight(), SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE), SDL_DestroyWindow);
     SDL_ASSERT_NE(win.val, nullptr);
 
+    // Declared before `quitter`: log records still queued at shutdown pin its blocks until `consumeLogs()` runs.
+    stms::FrameArena frameArena{};
     Quitter quitter{};
 
     CSmartPtr<SDL_Renderer> ren(SDL_CreateRenderer(win.val, -1, SDL_RENDERER_ACCELERATED), SDL_DestroyRenderer);
     SDL_ASSERT_NE(ren.val, nullptr);
 
 
-    Ball ball = Ball(phys.makeDynamicCircle(0, 0, fieldWidth / 8.), ren.val);
-    Ship ship = Ship(phys.makeDynamicBox(5, -(fieldHeight / 2.), fieldWidth / 8., fieldHeight / 8.), ren.val, Team{255, 0, 0});
+    float windowMs = startup.getTime();
+
+    SpriteSheet sprites(ren.val, &bundle);
+    float assetsMs = startup.getTime();
+
+    std::unique_ptr<TelemetryWriter> telemetryWriter = telemetry ? openTelemetry() : nullptr; // outlives `sim`
+
+    // First touch: the world is allocated with the simulation thread's NUMA node preferred, not the render thread's.
+    stms::NumaScope simMemory(simPlacement.numaNode);
+    Simulation sim{};
+    simMemory.restore();
+    sim.placement = simPlacement;
+    sim.telemetry = telemetryWriter.get();
+    InputSystem input(sim.input);
+    ParticleSystem particles{};
+    DebugOverlay debugOverlay{};
+    AudioSystem audio{};
+
+    HudText hud(ren.val);
+    size_t fpsText = hud.add(8, 8);
+    size_t tickText = hud.add(8, 28);
+    char hudBuf[64]; // HUD strings are formatted here, `HudText::set` only lays them out again if they changed
+    sim.start();
+
+    stms::FrameArena::Scope frameScope(&frameArena);
 
     stms::TPSTimer timer{};
     while (true) {
+        frameArena.reset();
+#       ifdef COUNT_FRAME_ALLOCS
+        size_t newsBefore = stms::getThreadNewCount();
+#       endif
+
         timer.tick();
+        frameMs.observe(timer.getLatestMspt());
 
         INFO("FPS = {}, MSPT = {}", timer.getLatestTps(), timer.getLatestMspt());
 
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_F3 && !event.key.repeat) {
+                sim.debugDraw = !sim.debugDraw;
+                INFO("Physics debug overlay {}", sim.debugDraw ? "on" : "off");
+                continue;
+            }
+
+            if (input.handleEvent(event)) {
+                continue;
+            }
+
             switch (event.type) {
                 case SDL_WINDOWEVENT:
                     switch (event.window.event) {
@@ -74,12 +228,40 @@ int main() {
             }
         }
 
+        input.retry();
+        sim.snapshots.update(); // grab the latest tick, if there is one. Never blocks.
+
+        EffectEvent effect{};
+        while (sim.effects.tryPop(effect)) {
+            particles.emit(effect);
+        }
+        particles.update(std::min(timer.getLatestMspt() / 1000.0f, 0.1f), &pool);
+        audio.update(sim.sounds);
+
         SDL_SetRenderDrawColor(ren.val, 0xFF, 0xFF, 0xFF, 0xFF);
         SDL_RenderClear(ren.val);
-        ship.draw();
-        ball.draw();
+        sprites.draw(sim.snapshots.getReadBuffer());
+        particles.draw(ren.val);
+        if (sim.debugDraw.load(std::memory_order_relaxed)) {
+            sim.debugDrawLists.update();
+            debugOverlay.draw(ren.val, sim.debugDrawLists.getReadBuffer());
+        }
+
+        auto hudLen = fmt::format_to_n(hudBuf, sizeof(hudBuf), "FPS {:.0f} ({:.1f} ms)", timer.getLatestTps(),
+                                       timer.getLatestMspt()).size;
+        hud.set(fpsText, std::string_view(hudBuf, std::min(hudLen, sizeof(hudBuf))));
+        hudLen = fmt::format_to_n(hudBuf, sizeof(hudBuf), "Tick {}", sim.snapshots.getReadBuffer().tick).size;
+        hud.set(tickText, std::string_view(hudBuf, std::min(hudLen, sizeof(hudBuf))));
+        hud.draw();
 
         SDL_RenderPresent(ren.val);
+        input.onPresent(sim.snapshots.getReadBuffer().inputSeq);
+        if (startup.isRunning()) {
+            startup.stop();
+            reportStartup(startup, "Client");
+            INFO("Startup breakdown: SDL {:.2f}ms, window {:.2f}ms, assets {:.2f}ms, rest {:.2f}ms", sdlMs,
+                 windowMs - sdlMs, assetsMs - windowMs, startup.getTime() - assetsMs);
+        }
 
 
         if (targetFps > 0) {
@@ -89,9 +271,17 @@ int main() {
             SDL_ASSERT_EQ(SDL_GetWindowDisplayMode(win.val, &mode), 0);
             timer.wait(mode.refresh_rate);
         }
+
+#       ifdef COUNT_FRAME_ALLOCS
+        size_t frameNews = stms::getThreadNewCount() - newsBefore;
+        if (frameNews > 0) {
+            WARN("{} global `new` calls on the render thread during the last frame!", frameNews);
+        }
+#       endif
     }
 
     done:
-    
+    sim.stop();
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
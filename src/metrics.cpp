@@ -0,0 +1,240 @@
+//
+// Created by grant on 11/30/20.
+//
+
+#include "metrics.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "log.hpp"
+
+namespace stms {
+
+    uint64_t Counter::get() const {
+        uint64_t ret = 0;
+        for (const auto &shard : shards) {
+            ret += shard.val.load(std::memory_order_relaxed);
+        }
+        return ret;
+    }
+
+    Histogram::Histogram(std::initializer_list<double> bucketBounds) {
+        for (double bound : bucketBounds) {
+            if (numBounds >= maxBuckets) {
+                WARN("Histogram has more than {} buckets! Ignoring the rest!", maxBuckets);
+                break;
+            }
+            bounds[numBounds++] = bound;
+        }
+    }
+
+    void Histogram::render(const std::string &name, std::string &out) const {
+        uint64_t cumulative = 0;
+        double sum = 0;
+        for (const auto &shard : shards) {
+            sum += shard.sum.load(std::memory_order_relaxed);
+        }
+
+        for (size_t i = 0; i <= numBounds; i++) {
+            for (const auto &shard : shards) {
+                cumulative += shard.buckets[i].load(std::memory_order_relaxed);
+            }
+
+            if (i < numBounds) {
+                out += fmt::format("{}_bucket{{le=\"{}\"}} {}\n", name, bounds[i], cumulative);
+            } else {
+                out += fmt::format("{}_bucket{{le=\"+Inf\"}} {}\n", name, cumulative);
+            }
+        }
+
+        out += fmt::format("{}_sum {}\n{}_count {}\n", name, sum, name, cumulative);
+    }
+
+    MetricsRegistry::Entry *MetricsRegistry::find(const std::string &name) {
+        for (auto &entry : entries) {
+            if (entry->name == name) {
+                return entry.get();
+            }
+        }
+        return nullptr;
+    }
+
+    Counter &MetricsRegistry::counter(const std::string &name, const std::string &help) {
+        std::lock_guard<std::mutex> lg(mtx);
+        Entry *entry = find(name);
+        if (entry == nullptr) {
+            entries.emplace_back(new Entry{name, help, Type::eCounter, std::make_unique<Counter>(), {}, {}, {}});
+            entry = entries.back().get();
+        } else if (entry->type != Type::eCounter) {
+            ERROR("Metric `{}` re-registered as a counter with a different type! This one won't be exported.", name);
+            detached.emplace_back(new Entry{name, help, Type::eCounter, std::make_unique<Counter>(), {}, {}, {}});
+            entry = detached.back().get();
+        }
+        return *entry->counter;
+    }
+
+    Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help) {
+        std::lock_guard<std::mutex> lg(mtx);
+        Entry *entry = find(name);
+        if (entry == nullptr) {
+            entries.emplace_back(new Entry{name, help, Type::eGauge, {}, std::make_unique<Gauge>(), {}, {}});
+            entry = entries.back().get();
+        } else if (entry->type != Type::eGauge) {
+            ERROR("Metric `{}` re-registered as a gauge with a different type! This one won't be exported.", name);
+            detached.emplace_back(new Entry{name, help, Type::eGauge, {}, std::make_unique<Gauge>(), {}, {}});
+            entry = detached.back().get();
+        }
+        return *entry->gauge;
+    }
+
+    Histogram &MetricsRegistry::histogram(const std::string &name, const std::string &help,
+                                          std::initializer_list<double> bounds) {
+        std::lock_guard<std::mutex> lg(mtx);
+        Entry *entry = find(name);
+        if (entry == nullptr) {
+            entries.emplace_back(new Entry{name, help, Type::eHistogram, {}, {},
+                                           std::make_unique<Histogram>(bounds), {}});
+            entry = entries.back().get();
+        } else if (entry->type != Type::eHistogram) {
+            ERROR("Metric `{}` re-registered as a histogram with a different type! This one won't be exported.",
+                  name);
+            detached.emplace_back(new Entry{name, help, Type::eHistogram, {}, {},
+                                            std::make_unique<Histogram>(bounds), {}});
+            entry = detached.back().get();
+        }
+        return *entry->histogram;
+    }
+
+    void MetricsRegistry::callbackGauge(const std::string &name, const std::string &help,
+                                        std::function<double()> func) {
+        std::lock_guard<std::mutex> lg(mtx);
+        Entry *entry = find(name);
+        if (entry != nullptr && entry->type == Type::eCallback) {
+            entry->callback = std::move(func); // replace, e.g. if the object it reads from was recreated
+            return;
+        }
+        if (entry != nullptr) {
+            ERROR("Metric `{}` re-registered as a callback gauge with a different type! Ignoring it.", name);
+            return;
+        }
+        entries.emplace_back(new Entry{name, help, Type::eCallback, {}, {}, {}, std::move(func)});
+    }
+
+    std::string MetricsRegistry::render() {
+        std::lock_guard<std::mutex> lg(mtx);
+        std::string out;
+        for (const auto &entry : entries) {
+            out += fmt::format("# HELP {} {}\n", entry->name, entry->help);
+            switch (entry->type) {
+                case Type::eCounter:
+                    out += fmt::format("# TYPE {0} counter\n{0} {1}\n", entry->name, entry->counter->get());
+                    break;
+                case Type::eGauge:
+                    out += fmt::format("# TYPE {0} gauge\n{0} {1}\n", entry->name, entry->gauge->get());
+                    break;
+                case Type::eCallback:
+                    out += fmt::format("# TYPE {0} gauge\n{0} {1}\n", entry->name, entry->callback());
+                    break;
+                case Type::eHistogram:
+                    out += fmt::format("# TYPE {} histogram\n", entry->name);
+                    entry->histogram->render(entry->name, out);
+                    break;
+            }
+        }
+        return out;
+    }
+
+    MetricsServer::~MetricsServer() {
+        stop();
+    }
+
+    bool MetricsServer::start(uint16_t port) {
+        if (running) {
+            WARN("MetricsServer::start() called when already started! Ignoring...");
+            return true;
+        }
+
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) {
+            ERROR("Failed to create metrics socket: {}", std::strerror(errno));
+            return false;
+        }
+
+        int yes = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // never expose this outside the box
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listenFd, 8) != 0) {
+            ERROR("Failed to listen for metrics on 127.0.0.1:{}: {}", port, std::strerror(errno));
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+
+        running = true;
+        thread = std::thread(&MetricsServer::run, this);
+        INFO("Serving Prometheus metrics on http://127.0.0.1:{}/metrics", port);
+        return true;
+    }
+
+    void MetricsServer::stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+
+        if (listenFd >= 0) {
+            close(listenFd);
+            listenFd = -1;
+        }
+    }
+
+    void MetricsServer::run() {
+        while (running) {
+            // Poll with a timeout so `stop()` is noticed without having to poke the socket.
+            pollfd pfd{listenFd, POLLIN, 0};
+            if (poll(&pfd, 1, metricsPollTimeoutMs) <= 0) {
+                continue;
+            }
+
+            int client = accept(listenFd, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+
+            // We don't care what was asked for, but drain what the client sent so closing doesn't RST it.
+            char request[2048];
+            pollfd cfd{client, POLLIN, 0};
+            if (poll(&cfd, 1, metricsPollTimeoutMs) > 0) {
+                recv(client, request, sizeof(request), 0);
+            }
+
+            std::string body = getMetrics().render();
+            std::string response = fmt::format("HTTP/1.0 200 OK\r\n"
+                                               "Content-Type: text/plain; version=0.0.4\r\n"
+                                               "Content-Length: {}\r\n"
+                                               "Connection: close\r\n\r\n", body.size());
+            response += body;
+
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    break;
+                }
+                sent += static_cast<size_t>(n);
+            }
+            close(client);
+        }
+    }
+}
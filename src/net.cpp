@@ -0,0 +1,416 @@
+//
+// Created by grant on 12/9/20.
+//
+
+#pragma once
+
+#ifndef NET_CPP_INCLUDED
+#define NET_CPP_INCLUDED
+
+#include "game.cpp"
+#include "interest.cpp"
+#include "protocol.cpp"
+#include "spectator.cpp"
+#include "telemetry.cpp"
+#include "metrics.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Authoritative UDP game server: one ship per client plus the ball. Every `tickOnce()` reads all pending input
+ *        packets, steps the physics and sends each client a snapshot. Snapshots only carry what matters to their
+ *        client: the ball and its own ship every tick, then nearby entities by priority until
+ *        `interestBudgetBytes` is full. Entities that didn't fit gain priority every tick they wait, so far away
+ *        ones are just updated less often. Spectators are fed through a `SpectatorRelay`. Single threaded, the
+ *        socket is non-blocking.
+ */
+class GameServer {
+public:
+    /// Totals since the server was started. Read from any thread.
+    struct Stats {
+        std::atomic_uint64_t packetsReceived = 0;
+        std::atomic_uint64_t bytesReceived = 0;
+        std::atomic_uint64_t packetsSent = 0;
+        std::atomic_uint64_t bytesSent = 0;
+        std::atomic_uint64_t inputsLost = 0; //!< Gaps in clients' `InputPacket::seq`
+        std::atomic_uint64_t sendErrors = 0;
+    };
+
+private:
+    struct Client {
+        sockaddr_in addr;
+        Ship ship;
+        uint32_t lastSeq = 0;
+        uint64_t lastHeard = 0; //!< Tick of the newest packet from this client
+        float thrust = 0;
+        int turn = 0;
+        std::unordered_map<uint32_t, uint64_t> lastSent; //!< Tick each entity was last sent to this client, by id
+    };
+
+    struct Candidate {
+        float priority;
+        uint32_t index; //!< In `entities`
+    };
+
+    int fd = -1;
+    uint64_t tick = 0;
+    Stats stats;
+
+    float fieldW, fieldH; //!< Half-size of the field
+    PhysicsEngine phys{physArenaBytes, fieldW, fieldH};
+    Ball ball{phys.makeDynamicCircle(0, 0, fieldWidth / 8.)};
+    std::vector<Client> clients;
+    std::unordered_map<uint64_t, size_t> clientIndex; //!< `addrKey()` to index in `clients`
+    uint32_t spawnCount = 0;
+
+    std::vector<NetEntity> entities; //!< Every entity, the ball first and then each client's ship in order
+    InterestGrid grid; //!< Of `entities`
+    std::vector<Candidate> candidates; //!< Scratch: entities near the client being sent to
+    std::vector<char> packet; //!< Header followed by the entities for one client, reused for every client
+    SpectatorRelay relay;
+    TelemetryWriter *telemetry = nullptr;
+
+    stms::Histogram &tickMs = stms::getMetrics().histogram("nf2_server_tick_ms", "Duration of GameServer::tickOnce()",
+                                                            {0.1, 0.25, 0.5, 1, 2, 4, 8, 16, 33});
+    stms::Gauge &clientsGauge = stms::getMetrics().gauge("nf2_server_clients", "Connected clients");
+    stms::Counter &bytesOut = stms::getMetrics().counter("nf2_server_sent_bytes_total", "Bytes of UDP payload sent");
+    stms::Counter &bytesIn = stms::getMetrics().counter("nf2_server_received_bytes_total",
+                                                        "Bytes of UDP payload received");
+    stms::Histogram &sentEntities = stms::getMetrics().histogram("nf2_interest_sent_entities",
+                                                                 "Entities in each snapshot sent to a client",
+                                                                 {1, 2, 4, 8, 16, 24, 32, 48});
+
+    static inline uint64_t addrKey(const sockaddr_in &addr) {
+        return static_cast<uint64_t>(addr.sin_addr.s_addr) << 16u | addr.sin_port;
+    }
+
+    Client *join(const sockaddr_in &addr) {
+        if (clients.size() >= serverMaxClients) {
+            return nullptr;
+        }
+
+        // Spread ships over a grid covering the field with a cell for every possible client, and skip cells that
+        // something already occupies (ships drift away from their cell), so joining never spawns inside a ship.
+        constexpr int cols = [] {
+            int ret = 1;
+            while (static_cast<size_t>(ret) * ret < serverMaxClients) {
+                ret++;
+            }
+            return ret;
+        }();
+        float cellW = 2.0f * fieldW / cols, cellH = 2.0f * fieldH / cols;
+        float x = 0, y = 0;
+        for (int tries = 0; tries < cols * cols; tries++) {
+            x = -fieldW + cellW * (static_cast<float>(spawnCount % cols) + 0.5f);
+            y = -fieldH + cellH * (static_cast<float>(spawnCount / cols % cols) + 0.5f);
+            spawnCount++;
+
+            // Slightly smaller than a ship, so neighbours sitting exactly in their own cells don't count.
+            float hw = 0.9f * serverShipHalfWidth, hh = 0.9f * serverShipHalfHeight;
+            bool occupied = false;
+            phys.queryAABB(b2AABB{b2Vec2(x - hw, y - hh), b2Vec2(x + hw, y + hh)}, [&](b2Body *body) {
+                occupied |= body->GetType() == b2_dynamicBody;
+            });
+            if (!occupied) {
+                break;
+            }
+        }
+
+        Ship ship(phys.makeDynamicBox(x, y, serverShipHalfWidth, serverShipHalfHeight), Team{255, 0, 0});
+        ship.turnImpulse = ship.body.body->GetInertia() * shipTurnAccel / tickRate;
+
+        clientIndex[addrKey(addr)] = clients.size();
+        clients.push_back(Client{addr, std::move(ship), 0, tick});
+        return &clients.back();
+    }
+
+    void leave(size_t index) { //!< Swap-remove a client
+        grid.remove(PhysicsEngine::getBodyId(clients[index].ship.body.body));
+        phys.destroyBody(clients[index].ship.body.body);
+        clientIndex.erase(addrKey(clients[index].addr));
+        if (index + 1 != clients.size()) {
+            clients[index] = std::move(clients.back());
+            clientIndex[addrKey(clients[index].addr)] = index;
+        }
+        clients.pop_back();
+    }
+
+    void receive() {
+        char buf[512];
+        sockaddr_in from{};
+        while (true) {
+            socklen_t fromLen = sizeof(from);
+            ssize_t len = recvfrom(fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &fromLen);
+            if (len < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    WARN("GameServer: recvfrom() failed: {}", std::strerror(errno));
+                }
+                return;
+            }
+
+            stats.packetsReceived.fetch_add(1, std::memory_order_relaxed);
+            stats.bytesReceived.fetch_add(static_cast<uint64_t>(len), std::memory_order_relaxed);
+            bytesIn.add(static_cast<uint64_t>(len));
+
+            if (len == sizeof(SpectatePacket) && static_cast<PacketType>(buf[0]) == PacketType::eSpectate) {
+                SpectatePacket spectate{};
+                std::memcpy(&spectate, buf, sizeof(spectate));
+                relay.onSpectate(fd, from, spectate.cookie, tick);
+                continue;
+            }
+
+            auto it = clientIndex.find(addrKey(from));
+            if (len == 1 && static_cast<PacketType>(buf[0]) == PacketType::eBye) {
+                if (it != clientIndex.end()) {
+                    leave(it->second);
+                }
+                continue;
+            }
+
+            InputPacket input{};
+            if (len != sizeof(InputPacket) || static_cast<PacketType>(buf[0]) != PacketType::eInput) {
+                continue;
+            }
+            std::memcpy(&input, buf, sizeof(input));
+
+            Client *client = it != clientIndex.end() ? &clients[it->second] : join(from);
+            if (client == nullptr || input.seq <= client->lastSeq) {
+                continue; // full, or late (a newer input was already applied)
+            }
+
+            if (client->lastSeq != 0) {
+                stats.inputsLost.fetch_add(input.seq - client->lastSeq - 1, std::memory_order_relaxed);
+            }
+            client->lastSeq = input.seq;
+            client->lastHeard = tick;
+            client->thrust = static_cast<float>(input.thrust) / 255.0f;
+            client->turn = std::clamp<int>(input.turn, -1, 1);
+        }
+    }
+
+    static inline NetEntity toNet(const b2Body *body) {
+        b2Vec2 pos = body->GetPosition(), vel = body->GetLinearVelocity();
+        return NetEntity{PhysicsEngine::getBodyId(body), pos.x, pos.y, body->GetAngle(), vel.x, vel.y};
+    }
+
+    /// Pick the entities for `client` (whose ship is `entities[own]`) and write them into `packet`, after the header
+    size_t select(Client &client, size_t own) {
+        constexpr size_t budget = std::min((interestBudgetBytes - sizeof(SnapshotHeader)) / sizeof(NetEntity),
+                                           maxSnapshotEntities);
+        static_assert(budget >= 2, "`interestBudgetBytes` doesn't even fit the ball and the client's own ship!");
+
+        const NetEntity &ship = entities[own];
+        candidates.clear();
+        grid.query(ship.x, ship.y, interestRadius, [&](uint32_t index) {
+            if (index == 0 || index == own) {
+                return; // always sent anyway
+            }
+
+            const NetEntity &ent = entities[index];
+            float dx = ent.x - ship.x, dy = ent.y - ship.y;
+            float dist2 = dx * dx + dy * dy;
+            if (dist2 > interestRadius * interestRadius) {
+                return;
+            }
+
+            auto it = client.lastSent.find(ent.id);
+            uint64_t age = it == client.lastSent.end() ? interestMaxAge : std::min(tick - it->second, interestMaxAge);
+            float priority = static_cast<float>(age) / (1 + dist2 / (interestNearRadius * interestNearRadius));
+            candidates.push_back(Candidate{priority, index});
+        });
+
+        size_t room = budget - 2;
+        if (candidates.size() > room) {
+            std::nth_element(candidates.begin(), candidates.begin() + static_cast<ptrdiff_t>(room), candidates.end(),
+                             [](const Candidate &a, const Candidate &b) { return a.priority > b.priority; });
+            candidates.resize(room);
+        }
+
+        size_t count = 2 + candidates.size();
+        packet.resize(sizeof(SnapshotHeader) + count * sizeof(NetEntity));
+        auto *out = reinterpret_cast<NetEntity *>(packet.data() + sizeof(SnapshotHeader));
+        std::memcpy(out++, &entities[0], sizeof(NetEntity));
+        std::memcpy(out++, &ship, sizeof(NetEntity));
+        for (const auto &candidate : candidates) {
+            std::memcpy(out++, &entities[candidate.index], sizeof(NetEntity));
+            client.lastSent[entities[candidate.index].id] = tick;
+        }
+
+        if (tick % interestMaxAge == 0) { // forget entities that have been out of range for a while
+            std::erase_if(client.lastSent, [&](const auto &kv) { return tick - kv.second > interestMaxAge; });
+        }
+        return count;
+    }
+
+    void broadcast() {
+        entities.clear();
+        entities.push_back(toNet(ball.body.body));
+        for (const auto &client : clients) {
+            entities.push_back(toNet(client.ship.body.body));
+        }
+        for (size_t i = 0; i < entities.size(); i++) {
+            grid.update(entities[i].id, static_cast<uint32_t>(i), entities[i].x, entities[i].y);
+        }
+        if (telemetry != nullptr) {
+            for (const auto &ent : entities) {
+                telemetry->append(tick, ent);
+            }
+        }
+
+        SnapshotHeader header{};
+        header.tick = tick;
+        for (size_t i = 0; i < clients.size(); i++) {
+            Client &client = clients[i];
+            size_t count = select(client, i + 1);
+            sentEntities.observe(static_cast<double>(count));
+
+            header.ackSeq = client.lastSeq;
+            header.shipId = entities[i + 1].id;
+            header.numEntities = static_cast<uint16_t>(count);
+            header.checksum = netChecksum(packet.data() + sizeof(SnapshotHeader), count * sizeof(NetEntity));
+            std::memcpy(packet.data(), &header, sizeof(header));
+
+            if (sendto(fd, packet.data(), packet.size(), 0, reinterpret_cast<const sockaddr *>(&client.addr),
+                       sizeof(client.addr)) < 0) {
+                stats.sendErrors.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            stats.packetsSent.fetch_add(1, std::memory_order_relaxed);
+            stats.bytesSent.fetch_add(packet.size(), std::memory_order_relaxed);
+            bytesOut.add(packet.size());
+        }
+
+        // Spectators see the whole field, as much of it as fits a datagram. See `maxSpectatorEntities`.
+        relay.publish(tick, std::span<const NetEntity>(entities).first(std::min(entities.size(),
+                                                                                 maxSpectatorEntities)));
+        relay.send(fd, tick);
+    }
+
+public:
+    /**
+     * @brief Create the world. Nothing is sent or received until `start()`.
+     * @param fieldW Half-width of the field, e.g. `fieldWidth * largeArenaScale` for a large arena
+     * @param fieldH Half-height of the field
+     */
+    explicit GameServer(float fieldW = fieldWidth, float fieldH = fieldHeight) : fieldW(fieldW), fieldH(fieldH) {
+        entities.reserve(serverMaxClients + 1);
+        packet.reserve(serverMaxPacketBytes);
+    }
+
+    GameServer(const GameServer &rhs) = delete; //!< Deleted copy constructor
+    GameServer &operator=(const GameServer &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~GameServer() {
+        stop();
+    }
+
+    /**
+     * @brief Open the socket
+     * @param port UDP port to listen on, 0 for any free one (see `getPort()`)
+     * @param loopbackOnly If true, only bind to 127.0.0.1
+     * @return False if the socket couldn't be opened. The error is logged.
+     */
+    bool start(uint16_t port = serverPort, bool loopbackOnly = false) {
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            ERROR("Failed to create server socket: {}", std::strerror(errno));
+            return false;
+        }
+
+        int bufBytes = serverSocketBufferBytes; // every client's input lands in the same tick, don't drop them
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufBytes, sizeof(bufBytes));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufBytes, sizeof(bufBytes));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+            ERROR("Failed to bind server socket to port {}: {}", port, std::strerror(errno));
+            stop();
+            return false;
+        }
+
+        INFO("Game server listening on UDP port {}", getPort());
+        return true;
+    }
+
+    void stop() { //!< Close the socket. Clients stay in the game until they time out.
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    /// Run a single tick: read inputs, drop timed out clients, step and send snapshots.
+    void tickOnce() {
+        auto before = std::chrono::steady_clock::now();
+
+        receive();
+        for (size_t i = clients.size(); i-- > 0;) {
+            if (tick - clients[i].lastHeard > serverClientTimeoutTicks) {
+                leave(i);
+            }
+        }
+
+        for (const auto &client : clients) {
+            client.ship.turn(client.turn);
+            if (client.thrust > 0) {
+                client.ship.apply(client.thrust * shipThrustAccel * client.ship.body.body->GetMass());
+            }
+        }
+        phys.step(1.0f / tickRate);
+        tick++;
+
+        broadcast();
+
+        clientsGauge.set(static_cast<double>(clients.size()));
+        tickMs.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - before)
+                               .count());
+    }
+
+    [[nodiscard]] uint16_t getPort() const { //!< Port the socket is bound to, 0 if it isn't open
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        if (fd < 0 || getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+            return 0;
+        }
+        return ntohs(addr.sin_port);
+    }
+
+    [[nodiscard]] inline size_t getNumClients() const {
+        return clients.size();
+    }
+
+    [[nodiscard]] inline uint64_t getTick() const {
+        return tick;
+    }
+
+    /// Record every entity of every tick from now on. `writer` must outlive the server, `nullptr` to stop.
+    inline void setTelemetry(TelemetryWriter *writer) {
+        telemetry = writer;
+    }
+
+    /// Spectators, e.g. to change their delay. Only touch this from the thread calling `tickOnce()`.
+    [[nodiscard]] inline SpectatorRelay &getSpectators() {
+        return relay;
+    }
+
+    [[nodiscard]] inline const Stats &getStats() const {
+        return stats;
+    }
+};
+
+#endif
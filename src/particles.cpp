@@ -0,0 +1,250 @@
+//
+// Created by grant on 12/4/20.
+//
+
+#pragma once
+
+#ifndef PARTICLES_CPP_INCLUDED
+#define PARTICLES_CPP_INCLUDED
+
+#include "game.cpp"
+#include "metrics.hpp"
+#include "thread.hpp"
+
+#include <SDL2/SDL.h>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+/// Something the simulation wants a visual effect for. Sent to the render thread through `Simulation::effects`.
+struct EffectEvent {
+    enum class Type : uint8_t {
+        eThrust, //!< A ship thrusted this tick. `dir` points out of its exhaust, `strength` is the thrust in [0, 1].
+        eImpact //!< Two bodies collided hard. `strength` is the normal impulse.
+    };
+
+    Type type;
+    b2Vec2 pos;
+    b2Vec2 dir;
+    float strength;
+};
+
+/**
+ * @brief Fixed-capacity particle system. Particles are stored as structure-of-arrays so the update is a straight
+ *        SIMD loop over floats, dead particles are removed by swapping in the last live one (no allocations, ever),
+ *        and all particles are drawn with a single `SDL_RenderGeometry` call.
+ */
+class ParticleSystem {
+private:
+    std::vector<float> posX, posY, velX, velY, life, invMaxLife;
+    std::vector<uint32_t> color; //!< `0xRRGGBB`, alpha comes from the remaining life
+    size_t count = 0;
+    uint32_t rngState = 0x9E3779B9u;
+
+    std::vector<SDL_Vertex> verts; //!< 4 per particle, rebuilt every `draw()`
+    std::vector<int> indices; //!< 6 per particle, built once
+
+    stms::Histogram &updateMs = stms::getMetrics().histogram("nf2_particles_update_ms",
+                                                             "Duration of ParticleSystem::update()",
+                                                             {0.05, 0.1, 0.25, 0.5, 1, 2, 4});
+    stms::Gauge &liveGauge = stms::getMetrics().gauge("nf2_particles_live", "Live particles");
+
+    inline float random() { //!< xorshift32, uniform in [0, 1)
+        rngState ^= rngState << 13u;
+        rngState ^= rngState >> 17u;
+        rngState ^= rngState << 5u;
+        return static_cast<float>(rngState >> 8u) * (1.0f / 16777216.0f);
+    }
+
+    /// Integrate particles `[begin, end)`. Touches disjoint ranges, so chunks can run on different threads.
+    void integrate(size_t begin, size_t end, float dt, float drag) {
+        size_t i = begin;
+#       if defined(__SSE2__)
+        const __m128 vdt = _mm_set1_ps(dt);
+        const __m128 vdrag = _mm_set1_ps(drag);
+        for (; i + 4 <= end; i += 4) {
+            __m128 vx = _mm_mul_ps(_mm_loadu_ps(&velX[i]), vdrag);
+            __m128 vy = _mm_mul_ps(_mm_loadu_ps(&velY[i]), vdrag);
+            _mm_storeu_ps(&velX[i], vx);
+            _mm_storeu_ps(&velY[i], vy);
+            _mm_storeu_ps(&posX[i], _mm_add_ps(_mm_loadu_ps(&posX[i]), _mm_mul_ps(vx, vdt)));
+            _mm_storeu_ps(&posY[i], _mm_add_ps(_mm_loadu_ps(&posY[i]), _mm_mul_ps(vy, vdt)));
+            _mm_storeu_ps(&life[i], _mm_sub_ps(_mm_loadu_ps(&life[i]), vdt));
+        }
+#       endif
+        for (; i < end; i++) {
+            velX[i] *= drag;
+            velY[i] *= drag;
+            posX[i] += velX[i] * dt;
+            posY[i] += velY[i] * dt;
+            life[i] -= dt;
+        }
+    }
+
+    void compact() { //!< Swap-remove every dead particle
+        for (size_t i = 0; i < count;) {
+            if (life[i] > 0) {
+                i++;
+                continue;
+            }
+
+            count--;
+            posX[i] = posX[count];
+            posY[i] = posY[count];
+            velX[i] = velX[count];
+            velY[i] = velY[count];
+            life[i] = life[count];
+            invMaxLife[i] = invMaxLife[count];
+            color[i] = color[count];
+        }
+    }
+
+public:
+    ParticleSystem() : posX(maxParticles), posY(maxParticles), velX(maxParticles), velY(maxParticles),
+                       life(maxParticles), invMaxLife(maxParticles), color(maxParticles),
+                       verts(maxParticles * 4), indices(maxParticles * 6) {
+        for (size_t i = 0; i < maxParticles; i++) {
+            int v = static_cast<int>(i * 4);
+            int quad[6] = {v, v + 1, v + 2, v, v + 2, v + 3};
+            std::copy(quad, quad + 6, indices.begin() + static_cast<long>(i * 6));
+        }
+    }
+
+    ParticleSystem(const ParticleSystem &rhs) = delete; //!< Deleted copy constructor
+    ParticleSystem &operator=(const ParticleSystem &rhs) = delete; //!< Deleted copy assignment operator
+
+    [[nodiscard]] inline size_t getCount() const { //!< Number of live particles
+        return count;
+    }
+
+    /**
+     * @brief Spawn particles. Particles that don't fit are silently dropped.
+     * @param pos Where to spawn them, in real-space
+     * @param dir Direction they fly in. If zero, they fly in random directions.
+     * @param spread Maximum deviation from `dir`, in radians
+     * @param speed Maximum speed, in m/s. Each particle gets between half of this and this.
+     * @param lifetime How long the particles live, in seconds
+     * @param rgb Color, as `0xRRGGBB`
+     * @param n Number of particles
+     */
+    void emit(const b2Vec2 &pos, const b2Vec2 &dir, float spread, float speed, float lifetime, uint32_t rgb,
+              size_t n) {
+        float base = dir.LengthSquared() > 0 ? std::atan2(dir.y, dir.x) : 0;
+        if (dir.LengthSquared() == 0) {
+            spread = b2_pi;
+        }
+
+        n = std::min(n, maxParticles - count);
+        for (size_t i = 0; i < n; i++, count++) {
+            float angle = base + (random() * 2 - 1) * spread;
+            float v = speed * (0.5f + random() * 0.5f);
+            float l = lifetime * (0.5f + random() * 0.5f);
+
+            posX[count] = pos.x;
+            posY[count] = pos.y;
+            velX[count] = std::cos(angle) * v;
+            velY[count] = std::sin(angle) * v;
+            life[count] = l;
+            invMaxLife[count] = 1.0f / l;
+            color[count] = rgb;
+        }
+    }
+
+    /// Spawn the particles for an `EffectEvent`
+    void emit(const EffectEvent &ev) {
+        if (ev.type == EffectEvent::Type::eThrust) {
+            emit(ev.pos, ev.dir, 0.3f, 120.0f, 0.5f, 0xFF8C1A,
+                 static_cast<size_t>(std::ceil(ev.strength * particlesPerThrust)));
+        } else {
+            emit(ev.pos, b2Vec2(0, 0), 0, 160.0f, 0.35f, 0xFFE066,
+                 std::min<size_t>(maxSparksPerImpact, static_cast<size_t>(ev.strength * sparksPerImpulse)));
+        }
+    }
+
+    /**
+     * @brief Advance all particles and remove the dead ones
+     * @param dt Time step in seconds
+     * @param pool If not `nullptr` and there are enough particles, the update is split across this pool
+     */
+    void update(float dt, stms::ThreadPool *pool = nullptr) {
+        auto before = std::chrono::steady_clock::now();
+        float drag = std::exp(-particleDrag * dt);
+
+        size_t numChunks = pool != nullptr ? std::min(pool->getNumThreads(), count / particleParallelMin) : 0;
+        if (numChunks > 1) {
+            size_t chunk = (count + numChunks - 1) / numChunks;
+            std::atomic_size_t remaining = (count + chunk - 1) / chunk;
+            for (size_t begin = chunk; begin < count; begin += chunk) { // the first chunk is done on this thread
+                size_t end = std::min(count, begin + chunk);
+                pool->submitDetached([this, begin, end, dt, drag, &remaining]() {
+                    integrate(begin, end, dt, drag);
+                    remaining.fetch_sub(1, std::memory_order_release);
+                }, stms::TaskLane::eFrameCritical); // the frame is spinning on `remaining`
+            }
+
+            integrate(0, std::min(count, chunk), dt, drag);
+            remaining.fetch_sub(1, std::memory_order_release);
+            while (remaining.load(std::memory_order_acquire) != 0) { // chunks are tiny, not worth sleeping over
+                std::this_thread::yield();
+            }
+        } else {
+            integrate(0, count, dt, drag);
+        }
+
+        compact();
+
+        updateMs.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - before)
+                                 .count());
+        liveGauge.set(static_cast<double>(count));
+    }
+
+    /**
+     * @brief Draw every particle as a small quad, in one `SDL_RenderGeometry` call
+     * @param ren Renderer to draw with
+     * @param w Width of the render target in pixels
+     * @param h Height of the render target in pixels
+     */
+    void draw(SDL_Renderer *ren, int w = winWidth(), int h = winHeight()) {
+        if (count == 0) {
+            return;
+        }
+
+        // `transformCam`, hoisted out of the loop
+        b2Vec2 topLeft = getCamera().center - getCamera().size;
+        float sx = w / (getCamera().size.x * 2), sy = h / (getCamera().size.y * 2);
+        float hx = particleSize * sx / 2, hy = particleSize * sy / 2;
+
+        for (size_t i = 0; i < count; i++) {
+            float x = (posX[i] - topLeft.x) * sx, y = (posY[i] - topLeft.y) * sy;
+            auto alpha = static_cast<uint8_t>(255 * std::min(1.0f, life[i] * invMaxLife[i])); // fade out
+            SDL_Color c{static_cast<uint8_t>(color[i] >> 16u), static_cast<uint8_t>(color[i] >> 8u),
+                        static_cast<uint8_t>(color[i]), alpha};
+
+            SDL_Vertex *v = &verts[i * 4];
+            v[0] = SDL_Vertex{SDL_FPoint{x - hx, y - hy}, c, SDL_FPoint{0, 0}};
+            v[1] = SDL_Vertex{SDL_FPoint{x + hx, y - hy}, c, SDL_FPoint{0, 0}};
+            v[2] = SDL_Vertex{SDL_FPoint{x + hx, y + hy}, c, SDL_FPoint{0, 0}};
+            v[3] = SDL_Vertex{SDL_FPoint{x - hx, y + hy}, c, SDL_FPoint{0, 0}};
+        }
+
+        // Untextured geometry is blended with the draw blend mode.
+        SDL_BlendMode prevMode;
+        SDL_GetRenderDrawBlendMode(ren, &prevMode);
+        SDL_SetRenderDrawBlendMode(ren, SDL_BLENDMODE_BLEND);
+        if (SDL_RenderGeometry(ren, nullptr, verts.data(), static_cast<int>(count * 4), indices.data(),
+                               static_cast<int>(count * 6)) != 0) {
+            FATAL("Failed to render particles: {}", SDL_GetError());
+            throw std::runtime_error("Rendering failed");
+        }
+        SDL_SetRenderDrawBlendMode(ren, prevMode);
+    }
+};
+
+#endif
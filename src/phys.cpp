@@ -8,8 +8,15 @@
 #define PHYS_CPP_INCLUDED
 
 #include <box2d/box2d.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <vector>
 #include "config.hpp"
+#include "metrics.hpp"
+#include "phys_arena.cpp"
+#include "grid_broadphase.cpp"
+#include "contacts.cpp"
 
 struct RigidBody {
     float w{}, h{};
@@ -28,39 +35,279 @@ struct CircleRigidBody {
 };
 
 class PhysicsEngine {
+public:
+    /// What the last `step()` did, see `step()`
+    struct StepStats {
+        float maxSpeed = 0; //!< Of the fastest awake dynamic body, before the step
+        int32 subSteps = 1; //!< Number of `b2World::Step`s the step was split into
+        bool ccd = false; //!< If continuous collision was on
+        uint32_t bullets = 0; //!< Dynamic bodies treated as bullets (continuous against other dynamic bodies)
+    };
+
+private:
+    PhysicsArena arena; //!< Backs every Box2D allocation made by `world`. Must be declared before `world`!
+    alignas(b2World) unsigned char worldStorage[sizeof(b2World)]{}; //!< `world` is constructed in here
+
+    ContactBatch contacts; //!< Collects the contact events of each step
+    uint32_t nextBodyId = 0; //!< Id given to the next body created. Stored in its `b2BodyUserData::pointer`.
+
+    GridBroadPhase grid; //!< Game-side broadphase over the dynamic bodies. Only kept up to date if `useGrid`.
+    bool useGrid = false;
+
+    float thinnestWall = std::numeric_limits<float>::max(); //!< Thickness of the thinnest wall added so far
+    StepStats lastStep;
+    std::vector<b2Body *> bullets; //!< Scratch: bodies made bullets for the current step only
+
+    /// Counters of the expensive paths of `step()`, summed over every engine
+    struct StepMetrics {
+        stms::Counter &steps = stms::getMetrics().counter("nf2_physics_steps_total", "Calls to PhysicsEngine::step()");
+        stms::Counter &subSteps = stms::getMetrics().counter("nf2_physics_extra_substeps_total",
+                                                             "Sub-steps run on top of the first one of each step");
+        stms::Counter &ccdSteps = stms::getMetrics().counter("nf2_physics_ccd_steps_total",
+                                                             "Steps run with continuous collision on");
+        stms::Counter &bullets = stms::getMetrics().counter("nf2_physics_bullets_total",
+                                                            "Bodies treated as bullets, summed over all steps");
+    };
+
+    static StepMetrics &getStepMetrics() {
+        static StepMetrics val;
+        return val;
+    }
+
+    /// Adapts a lambda to Box2D's `b2QueryCallback` for `queryAABB` when the grid is off.
+    template<typename F>
+    struct QueryAdapter : public b2QueryCallback {
+        F &func;
+
+        explicit QueryAdapter(F &f) : func(f) {}
+
+        bool ReportFixture(b2Fixture *fixture) override {
+            func(fixture->GetBody());
+            return true;
+        }
+    };
+
+    void syncGrid() {
+        grid.clear();
+        for (b2Body *body = world.GetBodyList(); body != nullptr; body = body->GetNext()) {
+            if (body->GetType() != b2_dynamicBody || body->GetFixtureList() == nullptr) {
+                continue;
+            }
+
+            b2AABB aabb = body->GetFixtureList()->GetAABB(0);
+            for (b2Fixture *fix = body->GetFixtureList()->GetNext(); fix != nullptr; fix = fix->GetNext()) {
+                aabb.Combine(fix->GetAABB(0));
+            }
+            grid.insert(aabb, reinterpret_cast<uintptr_t>(body));
+        }
+        grid.rebuild();
+    }
+
+    b2World *initWorld() {
+        PhysicsArena::Scope scope(&arena);
+        auto *ret = new (worldStorage) b2World(gravity);
+        ret->SetContactListener(&contacts);
+        ret->SetContinuousPhysics(false); // turned on by `step()` only when something is fast enough to need it
+        return ret;
+    }
+
 public:
     b2Vec2 gravity{0, 0};
-    b2World world{gravity};
+    b2World &world = *initWorld();
 
     std::vector<RigidBody> bodies;
 
 
     inline void addWall(float x, float y, float w, float h) {
+        PhysicsArena::Scope scope(&arena);
         RigidBody body;
         body.def.position.Set(x, y);
+        body.def.userData.pointer = nextBodyId++;
         body.body = world.CreateBody(&body.def);
         body.shape.SetAsBox(w, h);
         body.body->CreateFixture(&body.shape, 0.0f);
+        thinnestWall = std::min(thinnestWall, 2 * std::min(w, h));
 
         bodies.emplace_back(body);
     }
 
-    PhysicsEngine() {
+    /**
+     * @brief Create the world and the walls around the field
+     * @param arenaBytes Size of the memory arena backing this world. If it is 0, Box2D allocates from the heap.
+     * @param fieldW Half-width of the field. Only override this for experiments, the rest of the game assumes
+     *               `fieldWidth`!
+     * @param fieldH Half-height of the field. Same caveat as `fieldW`.
+     */
+    explicit PhysicsEngine(size_t arenaBytes = physArenaBytes, float fieldW = fieldWidth,
+                           float fieldH = fieldHeight) : arena(arenaBytes) {
         // field is 120 x 75 (or x4 480 x 300)
-        addWall(-fieldWidth, 0, wallWidth + fbuf, fieldHeight + fbuf);
-        addWall(fieldWidth, 0, wallWidth+ fbuf, fieldHeight + fbuf);
-        addWall(0, fieldHeight, fieldWidth + fbuf, wallWidth + fbuf);
-        addWall(0, -fieldHeight, fieldWidth + fbuf, wallWidth + fbuf);
+        addWall(-fieldW, 0, wallWidth + fbuf, fieldH + fbuf);
+        addWall(fieldW, 0, wallWidth+ fbuf, fieldH + fbuf);
+        addWall(0, fieldH, fieldW + fbuf, wallWidth + fbuf);
+        addWall(0, -fieldH, fieldW + fbuf, wallWidth + fbuf);
+    }
+
+    PhysicsEngine(const PhysicsEngine &rhs) = delete; //!< Deleted copy constructor
+    PhysicsEngine &operator=(const PhysicsEngine &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~PhysicsEngine() {
+        // If the whole world lives inside `arena`, skip the teardown and let `arena` drop it all at once.
+        // Otherwise some of it spilled onto the heap and the world has to free it properly.
+        if (!arena.isSelfContained()) {
+            PhysicsArena::Scope scope(&arena);
+            world.~b2World();
+        }
+    }
+
+    /**
+     * @brief Get the allocation counters of the memory arena backing this world
+     * @return Snapshot of the counters
+     */
+    [[nodiscard]] inline PhysicsArena::Stats getArenaStats() const {
+        return arena.getStats();
     }
 
+    /**
+     * @brief Advance the world. Box2D only checks for contacts at the end of each `b2World::Step`, and clamps
+     *        movement to `b2_maxTranslation` per step, so a fast enough body passes through walls (or just slows
+     *        down). Rather than paying for that every tick, the cost is picked from the fastest body:
+     *        - If nothing moves more than `physSafeTravel` of the thinnest wall per step, one plain step.
+     *        - Otherwise, the step is split into up to `physMaxSubSteps` sub-steps, until nothing does.
+     *        - If even that isn't enough, continuous collision is turned on, and the bodies that are still too
+     *          fast are made bullets for this step, so they don't pass through other dynamic bodies either.
+     *        See `getLastStep()` and the `nf2_physics_*` counters for what happened.
+     * @param time Length of the step, in seconds
+     * @param velIter Velocity iterations of each sub-step
+     * @param posIter Position iterations of each sub-step
+     */
     inline void step(float time = 1.0f / 60.f, int32 velIter = 6, int32 posIter = 2) {
-        world.Step(time, velIter, posIter);
+        PhysicsArena::Scope scope(&arena);
+        contacts.clear(); // events of every sub-step end up in the same batch
+
+        float maxSpeed = 0;
+        for (b2Body *body = world.GetBodyList(); body != nullptr; body = body->GetNext()) {
+            if (body->GetType() == b2_dynamicBody && body->IsAwake()) {
+                maxSpeed = std::max(maxSpeed, body->GetLinearVelocity().Length());
+            }
+        }
+
+        float safeTravel = std::min(thinnestWall * physSafeTravel, b2_maxTranslation);
+        float needed = std::ceil(maxSpeed * time / safeTravel);
+        int32 subSteps = std::clamp(static_cast<int32>(std::min(needed, 1e6f)), 1, physMaxSubSteps);
+        float subTime = time / static_cast<float>(subSteps);
+
+        float bulletSpeed = safeTravel / subTime; // bodies faster than this can still tunnel, even sub-stepped
+        bool ccd = maxSpeed > bulletSpeed;
+        if (ccd) {
+            for (b2Body *body = world.GetBodyList(); body != nullptr; body = body->GetNext()) {
+                if (body->GetType() == b2_dynamicBody && !body->IsBullet()
+                    && body->GetLinearVelocity().Length() > bulletSpeed) {
+                    body->SetBullet(true);
+                    bullets.push_back(body);
+                }
+            }
+        }
+        world.SetContinuousPhysics(ccd);
+
+        // Forces applied before the step (e.g. thrust) must act during every sub-step, not just the first.
+        world.SetAutoClearForces(false);
+        for (int32 i = 0; i < subSteps; i++) {
+            world.Step(subTime, velIter, posIter);
+        }
+        world.ClearForces();
+        world.SetAutoClearForces(true);
+
+        for (b2Body *body : bullets) {
+            body->SetBullet(false);
+        }
+        lastStep = StepStats{maxSpeed, subSteps, ccd, static_cast<uint32_t>(bullets.size())};
+        bullets.clear();
+
+        StepMetrics &metrics = getStepMetrics();
+        metrics.steps.add();
+        metrics.subSteps.add(static_cast<uint64_t>(subSteps - 1));
+        metrics.ccdSteps.add(ccd ? 1 : 0);
+        metrics.bullets.add(lastStep.bullets);
+
+        if (useGrid) {
+            syncGrid();
+        }
+    }
+
+    [[nodiscard]] inline const StepStats &getLastStep() const { //!< What the last `step()` did
+        return lastStep;
+    }
+
+    /**
+     * @brief Get the collisions of the last `step()` as one contiguous batch. Read this after stepping instead
+     *        of hooking into Box2D callbacks.
+     * @return View of the events, valid until the next `step()`
+     */
+    [[nodiscard]] inline std::span<const ContactEvent> getContactEvents() const {
+        return contacts.getEvents();
+    }
+
+    [[nodiscard]] inline uint64_t getDroppedContactEvents() const { //!< Events lost to a full batch, in total
+        return contacts.getDropped();
+    }
+
+    /**
+     * @brief Get the id of a body, as used in `ContactEvent`. Walls are 0-3, in the order of `addWall` calls.
+     * @param body Body created by this engine
+     * @return Id of the body
+     */
+    static inline uint32_t getBodyId(const b2Body *body) {
+        return static_cast<uint32_t>(body->GetUserData().pointer);
+    }
+
+    /**
+     * @brief Toggle the uniform grid broadphase used by `queryAABB` and `queryOverlappingPairs`. Meant for
+     *        arena modes with lots of bodies. Box2D keeps using its own dynamic tree for contacts.
+     * @param enable If true, the grid is rebuilt after every `step()`.
+     */
+    inline void setGridBroadPhase(bool enable) {
+        useGrid = enable;
+        if (useGrid) {
+            syncGrid();
+        }
+    }
+
+    /**
+     * @brief Find all bodies whose bounding boxes overlap an AABB. If the grid broadphase is enabled, only
+     *        dynamic bodies are reported, and the result is as of the last `step()`.
+     * @param aabb Area to query
+     * @param callback Called as `callback(b2Body *)` for every body found
+     */
+    template<typename F>
+    void queryAABB(const b2AABB &aabb, F &&callback) {
+        if (useGrid) {
+            grid.query(aabb, [&](uintptr_t body) { callback(reinterpret_cast<b2Body *>(body)); });
+        } else {
+            QueryAdapter<F> adapter(callback);
+            world.QueryAABB(&adapter, aabb);
+        }
+    }
+
+    /**
+     * @brief Find all pairs of dynamic bodies with overlapping bounding boxes, as of the last `step()`.
+     *        Only available with the grid broadphase enabled; reports nothing otherwise.
+     * @param callback Called as `callback(b2Body *, b2Body *)` for every pair
+     */
+    template<typename F>
+    void queryOverlappingPairs(F &&callback) {
+        if (useGrid) {
+            grid.queryPairs([&](uintptr_t a, uintptr_t b) {
+                callback(reinterpret_cast<b2Body *>(a), reinterpret_cast<b2Body *>(b));
+            });
+        }
     }
 
     RigidBody makeDynamicBox(float x, float y, float w, float h, float density = 1.0f, float friction = 0.3f) {
+        PhysicsArena::Scope scope(&arena);
         RigidBody ret;
         ret.def.type = b2_dynamicBody;
         ret.def.position.Set(x, y);
+        ret.def.userData.pointer = nextBodyId++;
         ret.body = world.CreateBody(&ret.def);
         ret.shape.SetAsBox(w, h);
         ret.fixture.shape = &ret.shape;
@@ -74,10 +321,17 @@ public:
         return ret;
     }
 
+    inline void destroyBody(b2Body *body) { //!< Destroy a body made by this engine. Its id is never reused.
+        PhysicsArena::Scope scope(&arena);
+        world.DestroyBody(body);
+    }
+
     CircleRigidBody makeDynamicCircle(float x, float y, float r, float density = 1.0f, float friction = 0.3f) {
+        PhysicsArena::Scope scope(&arena);
         CircleRigidBody ret;
         ret.def.type = b2_dynamicBody;
         ret.def.position.Set(x, y);
+        ret.def.userData.pointer = nextBodyId++;
         ret.body = world.CreateBody(&ret.def);
         ret.shape.m_radius = r;
         ret.fixture.shape = &ret.shape;
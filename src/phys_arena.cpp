@@ -0,0 +1,265 @@
+//
+// Created by grant on 11/24/20.
+//
+
+#pragma once
+
+#ifndef PHYS_ARENA_CPP_INCLUDED
+#define PHYS_ARENA_CPP_INCLUDED
+
+#include <box2d/b2_settings.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "config.hpp"
+
+/**
+ * @brief Bounded memory arena backing every Box2D allocation of one `PhysicsEngine`.
+ *
+ * Box2D only has the global `b2Alloc`/`b2Free` hooks, so the arena that serves an allocation is picked through
+ * a thread-local "current arena" (see `PhysicsArena::Scope`). Every block carries a small header pointing back
+ * at its owner, so `b2Free` never needs to know which arena is active.
+ *
+ * Memory is carved out of one big block with a bump pointer and recycled through power-of-two free lists.
+ * If the arena runs out, allocations spill onto the heap (and are counted in `Stats::heapFallbacks`).
+ */
+class PhysicsArena {
+public:
+    /// Allocation counters. All of these are safe to read from a monitoring thread.
+    struct Stats {
+        size_t capacity; //!< Size of the backing block, in bytes
+        size_t bytesInUse; //!< Bytes currently handed out (including headers and size class rounding)
+        size_t peakBytes; //!< High water mark of `bytesInUse`
+        size_t allocs; //!< Total number of allocations served
+        size_t frees; //!< Total number of allocations returned
+        size_t heapFallbacks; //!< Number of allocations that didn't fit and went to the heap
+        size_t liveHeapBlocks; //!< Number of heap fallback allocations that haven't been freed yet
+    };
+
+    /// RAII guard that makes an arena the current one for `b2Alloc` on this thread.
+    class Scope {
+    private:
+        PhysicsArena *prev; //!< Arena that was active before this scope, restored on destruction
+    public:
+        explicit Scope(PhysicsArena *arena) : prev(current()) {
+            current() = arena;
+        }
+
+        virtual ~Scope() {
+            current() = prev;
+        }
+
+        Scope(const Scope &rhs) = delete; //!< Deleted copy constructor
+        Scope &operator=(const Scope &rhs) = delete; //!< Deleted copy assignment operator
+    };
+
+private:
+    /// Placed in front of every block. 16 bytes so payloads stay 16-byte aligned.
+    struct alignas(16) Header {
+        PhysicsArena *owner; //!< Arena the block belongs to, `nullptr` if it was allocated with no arena active
+        uint32_t sizeClass; //!< Index into `freeLists`, or `heapClass` if the block came from the heap
+    };
+
+    static constexpr uint32_t numClasses = 40; //!< Number of power-of-two size classes
+    static constexpr uint32_t minClass = 4; //!< Smallest size class is 16 bytes
+    static constexpr uint32_t heapClass = UINT32_MAX; //!< `Header::sizeClass` of heap fallback blocks
+
+    unsigned char *base = nullptr; //!< Backing block
+    unsigned char *top = nullptr; //!< Bump pointer into `base`
+    unsigned char *end = nullptr; //!< One past the end of `base`
+
+    void *freeLists[numClasses]{}; //!< Singly linked free lists, the `next` pointer is stored in the payload
+
+    std::atomic_size_t bytesInUse = 0;
+    std::atomic_size_t peakBytes = 0;
+    std::atomic_size_t allocs = 0;
+    std::atomic_size_t frees = 0;
+    std::atomic_size_t heapFallbacks = 0;
+    std::atomic_size_t liveHeapBlocks = 0;
+
+    /// Live blocks from `allocUnowned`. They can't be attributed to an arena, so every arena has to assume that
+    /// some of them belong to its world.
+    static std::atomic_size_t &getLiveUnownedBlocks() {
+        static std::atomic_size_t val = 0;
+        return val;
+    }
+
+    static inline uint32_t classFor(size_t size) {
+        uint32_t ret = minClass;
+        while ((size_t(1) << ret) < size) {
+            ret++;
+        }
+        return ret;
+    }
+
+    void *allocHeap(size_t size) {
+        auto *head = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+        if (head == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        head->owner = this;
+        head->sizeClass = heapClass;
+        heapFallbacks.fetch_add(1, std::memory_order_relaxed);
+        liveHeapBlocks.fetch_add(1, std::memory_order_relaxed);
+        return head + 1;
+    }
+
+public:
+    /**
+     * @brief Create an arena
+     * @param capacity Size of the backing block in bytes. If it is 0, every allocation goes to the heap
+     *                 (but is still tracked by the counters).
+     */
+    explicit PhysicsArena(size_t capacity) {
+        if (capacity > 0) {
+            base = static_cast<unsigned char *>(std::malloc(capacity));
+            if (base == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+
+        top = base;
+        end = base + capacity;
+    }
+
+    /// Release the whole arena at once. Any memory still handed out from the backing block becomes invalid!
+    virtual ~PhysicsArena() {
+        std::free(base);
+    }
+
+    PhysicsArena(const PhysicsArena &rhs) = delete; //!< Deleted copy constructor
+    PhysicsArena &operator=(const PhysicsArena &rhs) = delete; //!< Deleted copy assignment operator
+
+    /**
+     * @brief Get the arena that `b2Alloc` currently allocates from on this thread.
+     * @return Reference to the thread-local pointer. `nullptr` means Box2D uses the heap.
+     */
+    static PhysicsArena *&current() {
+        thread_local PhysicsArena *val = nullptr;
+        return val;
+    }
+
+    /**
+     * @brief Allocate `size` bytes from this arena, spilling onto the heap if it is exhausted.
+     * @param size Number of bytes to allocate
+     * @return 16-byte aligned pointer. Free it with `PhysicsArena::release`.
+     */
+    void *alloc(size_t size) {
+        allocs.fetch_add(1, std::memory_order_relaxed);
+
+        uint32_t cls = classFor(size);
+        if (cls >= numClasses) {
+            return allocHeap(size);
+        }
+
+        size_t blockSize = sizeof(Header) + (size_t(1) << cls);
+        Header *head;
+        if (freeLists[cls] != nullptr) {
+            void *payload = freeLists[cls];
+            freeLists[cls] = *static_cast<void **>(payload);
+            head = static_cast<Header *>(payload) - 1;
+        } else if (static_cast<size_t>(end - top) >= blockSize) {
+            head = reinterpret_cast<Header *>(top);
+            top += blockSize;
+        } else {
+            return allocHeap(size);
+        }
+
+        head->owner = this;
+        head->sizeClass = cls;
+
+        size_t inUse = bytesInUse.fetch_add(blockSize, std::memory_order_relaxed) + blockSize;
+        if (inUse > peakBytes.load(std::memory_order_relaxed)) {
+            peakBytes.store(inUse, std::memory_order_relaxed);
+        }
+
+        return head + 1;
+    }
+
+    /**
+     * @brief Allocate from the heap with no owning arena. Used by `b2Alloc` when no arena is active.
+     * @param size Number of bytes to allocate
+     * @return Pointer that can be freed with `PhysicsArena::release`, just like arena memory.
+     */
+    static void *allocUnowned(size_t size) {
+        auto *head = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+        if (head == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        head->owner = nullptr;
+        head->sizeClass = heapClass;
+        getLiveUnownedBlocks().fetch_add(1, std::memory_order_relaxed);
+        return head + 1;
+    }
+
+    /**
+     * @brief Free memory obtained from `alloc`. Works no matter which arena (or none) is currently active.
+     * @param mem Pointer to free. May be `nullptr`.
+     */
+    static void release(void *mem) {
+        if (mem == nullptr) {
+            return;
+        }
+
+        Header *head = static_cast<Header *>(mem) - 1;
+        PhysicsArena *owner = head->owner;
+        if (owner == nullptr) {
+            getLiveUnownedBlocks().fetch_sub(1, std::memory_order_relaxed);
+            std::free(head);
+            return;
+        }
+
+        owner->frees.fetch_add(1, std::memory_order_relaxed);
+        if (head->sizeClass == heapClass) {
+            owner->liveHeapBlocks.fetch_sub(1, std::memory_order_relaxed);
+            std::free(head);
+            return;
+        }
+
+        *static_cast<void **>(mem) = owner->freeLists[head->sizeClass];
+        owner->freeLists[head->sizeClass] = mem;
+        owner->bytesInUse.fetch_sub(sizeof(Header) + (size_t(1) << head->sizeClass), std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Snapshot the allocation counters
+     * @return Current `Stats`
+     */
+    [[nodiscard]] Stats getStats() const {
+        return Stats{static_cast<size_t>(end - base), bytesInUse.load(std::memory_order_relaxed),
+                     peakBytes.load(std::memory_order_relaxed), allocs.load(std::memory_order_relaxed),
+                     frees.load(std::memory_order_relaxed), heapFallbacks.load(std::memory_order_relaxed),
+                     liveHeapBlocks.load(std::memory_order_relaxed)};
+    }
+
+    /**
+     * @brief Query if everything this arena handed out lives in the backing block, i.e. if destroying the
+     *        arena is enough to release it all.
+     * @return True if there are no live heap fallback allocations. Also false while any allocation made with no
+     *         arena active is alive (e.g. a Box2D call on a world outside of its `Scope`), it could be this one's.
+     */
+    [[nodiscard]] inline bool isSelfContained() const {
+        return liveHeapBlocks.load(std::memory_order_relaxed) == 0
+               && getLiveUnownedBlocks().load(std::memory_order_relaxed) == 0;
+    }
+};
+
+void *b2ArenaAlloc(int32 size) {
+    PhysicsArena *arena = PhysicsArena::current();
+    if (arena != nullptr) {
+        return arena->alloc(static_cast<size_t>(size));
+    }
+
+    return PhysicsArena::allocUnowned(static_cast<size_t>(size));
+}
+
+void b2ArenaFree(void *mem) {
+    PhysicsArena::release(mem);
+}
+
+#endif
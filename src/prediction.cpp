@@ -0,0 +1,243 @@
+//
+// Created by grant on 12/5/20.
+//
+
+#pragma once
+
+#ifndef PREDICTION_CPP_INCLUDED
+#define PREDICTION_CPP_INCLUDED
+
+#include "phys.cpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+
+/// A predicted hit of the ball on a wall
+struct PredictedBounce {
+    float ticks; //!< Ticks after `BallPath::tick` at which the ball reaches the wall. Usually fractional.
+    b2Vec2 pos; //!< Center of the ball at that moment
+    b2Vec2 vel; //!< Velocity of the ball right after the bounce
+};
+
+/**
+ * @brief Closed form prediction of the ball's motion: free flight with Box2D's linear damping, reflected off the
+ *        four axis-aligned walls. Exact (up to float rounding) until the ball touches anything but a wall.
+ *        Friction against the walls and spin are ignored.
+ *
+ * Box2D integrates `v' = v / (1 + dt * damping)`, then `x' = x + dt * v'`, so after `n` ticks
+ * `v(n) = v * d^n` and `x(n) = x + dt * v * d * (1 - d^n) / (1 - d)`, with `d = 1 / (1 + dt * damping)`.
+ */
+struct BallPath {
+    uint64_t tick = 0; //!< Tick the prediction starts at
+    float dt = 1.0f / tickRate;
+    float decay = 1; //!< Velocity multiplier per tick, `d` above
+    float horizon = 0; //!< Number of ticks covered by the prediction
+    b2Vec2 pos{0, 0}; //!< Center of the ball at `tick`
+    b2Vec2 vel{0, 0}; //!< Velocity of the ball at `tick`
+
+    std::array<PredictedBounce, maxPredictedBounces> bounces{}; //!< In order of time
+    uint32_t numBounces = 0;
+
+    /**
+     * @brief Displacement after flying freely for `n` ticks
+     * @param v Velocity at the start
+     * @param n Number of ticks, may be fractional
+     */
+    [[nodiscard]] inline b2Vec2 travel(const b2Vec2 &v, float n) const {
+        if (decay == 1) {
+            return dt * n * v;
+        }
+        return (dt * decay * (1 - std::pow(decay, n)) / (1 - decay)) * v;
+    }
+
+    /**
+     * @brief Predicted position of the ball
+     * @param at Absolute tick. Ticks before `tick` give `pos`, ticks past the horizon are extrapolated.
+     * @return Predicted center of the ball
+     */
+    [[nodiscard]] b2Vec2 positionAt(uint64_t at) const {
+        float n = at > tick ? static_cast<float>(at - tick) : 0;
+        b2Vec2 p = pos, v = vel;
+        float start = 0;
+        for (uint32_t i = 0; i < numBounces && bounces[i].ticks <= n; i++) {
+            p = bounces[i].pos;
+            v = bounces[i].vel;
+            start = bounces[i].ticks;
+        }
+        return p + travel(v, n - start);
+    }
+
+    /**
+     * @brief Predicted velocity of the ball
+     * @param at Absolute tick
+     * @return Predicted velocity of the ball
+     */
+    [[nodiscard]] b2Vec2 velocityAt(uint64_t at) const {
+        float n = at > tick ? static_cast<float>(at - tick) : 0;
+        b2Vec2 v = vel;
+        float start = 0;
+        for (uint32_t i = 0; i < numBounces && bounces[i].ticks <= n; i++) {
+            v = bounces[i].vel;
+            start = bounces[i].ticks;
+        }
+        return std::pow(decay, n - start) * v;
+    }
+
+    /**
+     * @brief Compute a path
+     * @param startTick Tick the state is from
+     * @param p Center of the ball
+     * @param v Velocity of the ball
+     * @param lo Lowest x and y the center of the ball can reach (inner faces of the walls, plus the radius)
+     * @param hi Highest x and y the center of the ball can reach
+     * @param damping Linear damping of the ball
+     * @param restitution Restitution of ball vs wall contacts, as mixed by Box2D
+     * @param threshold Normal speed below which Box2D doesn't bounce, as mixed by Box2D
+     * @param ticks Horizon of the prediction, in ticks
+     * @return The predicted path
+     */
+    static BallPath compute(uint64_t startTick, const b2Vec2 &p, const b2Vec2 &v, const b2Vec2 &lo, const b2Vec2 &hi,
+                            float damping, float restitution, float threshold, float ticks) {
+        BallPath ret;
+        ret.tick = startTick;
+        ret.decay = 1.0f / (1.0f + ret.dt * damping);
+        ret.horizon = ticks;
+        ret.pos = p;
+        ret.vel = v;
+
+        b2Vec2 curPos = p, curVel = v;
+        float now = 0;
+        while (ret.numBounces < maxPredictedBounces && curVel.LengthSquared() > 1e-6f) {
+            // Ticks until the ball reaches the wall it flies towards on each axis. Infinity if it never does.
+            float hit[2];
+            for (int axis = 0; axis < 2; axis++) {
+                float vel = axis == 0 ? curVel.x : curVel.y;
+                float dist = vel > 0 ? (axis == 0 ? hi.x - curPos.x : hi.y - curPos.y)
+                                     : (axis == 0 ? lo.x - curPos.x : lo.y - curPos.y);
+
+                if (vel == 0) {
+                    hit[axis] = INFINITY;
+                } else if (dist * vel <= 0) {
+                    hit[axis] = 0; // already touching (or past) the wall
+                } else if (ret.decay == 1) {
+                    hit[axis] = dist / (ret.dt * vel);
+                } else {
+                    // Solve `dist = dt * vel * d * (1 - d^n) / (1 - d)` for n.
+                    float rest = 1 - dist * (1 - ret.decay) / (ret.dt * vel * ret.decay);
+                    hit[axis] = rest > 0 ? std::log(rest) / std::log(ret.decay) : INFINITY;
+                }
+            }
+
+            int axis = hit[0] <= hit[1] ? 0 : 1;
+            float n = hit[axis];
+            if (now + n > ticks) {
+                break;
+            }
+
+            curPos += ret.travel(curVel, n);
+            curVel *= std::pow(ret.decay, n);
+            now += n;
+
+            // Box2D only applies restitution above the threshold, anything slower just stops.
+            float &normal = axis == 0 ? curVel.x : curVel.y;
+            normal = std::abs(normal) > threshold ? -restitution * normal : 0;
+            (axis == 0 ? curPos.x : curPos.y) = std::clamp(axis == 0 ? curPos.x : curPos.y,
+                                                           axis == 0 ? lo.x : lo.y, axis == 0 ? hi.x : hi.y);
+
+            ret.bounces[ret.numBounces++] = PredictedBounce{now, curPos, curVel};
+        }
+
+        return ret;
+    }
+};
+
+/**
+ * @brief Caches the `BallPath` of a ball. The path is only recomputed when the ball was in a contact (which the
+ *        closed form can't know about) or half of the horizon has passed, so any number of bots can query it every
+ *        tick for the cost of a few multiplications. Use from the simulation thread only.
+ */
+class BallPredictor {
+private:
+    const PhysicsEngine &phys;
+    const b2Body *ball;
+    uint32_t ballId;
+
+    BallPath path;
+    bool valid = false;
+
+    stms::Counter &recomputes = stms::getMetrics().counter("nf2_ball_prediction_recomputes_total",
+                                                           "Times the ball trajectory prediction was recomputed");
+
+    void recompute(uint64_t tick) {
+        float radius = ball->GetFixtureList()->GetShape()->m_radius;
+
+        // Inner faces of the walls (ids 0-3: left, right, top, bottom), including the polygon skin. Not the
+        // fixtures' AABBs, those are fattened for the broadphase.
+        b2AABB walls[4];
+        for (int i = 0; i < 4; i++) {
+            phys.bodies[i].shape.ComputeAABB(&walls[i], phys.bodies[i].body->GetTransform(), 0);
+        }
+        const b2AABB &left = walls[0], &right = walls[1], &top = walls[2], &bottom = walls[3];
+        b2Vec2 lo(left.upperBound.x + radius, bottom.upperBound.y + radius);
+        b2Vec2 hi(right.lowerBound.x - radius, top.lowerBound.y - radius);
+
+        // Mixed like `b2MixRestitution` and `b2MixRestitutionThreshold`
+        const b2Fixture *ballFixture = ball->GetFixtureList();
+        const b2Fixture *wallFixture = phys.bodies[0].body->GetFixtureList();
+        float restitution = std::max(ballFixture->GetRestitution(), wallFixture->GetRestitution());
+        float threshold = std::min(ballFixture->GetRestitutionThreshold(), wallFixture->GetRestitutionThreshold());
+
+        path = BallPath::compute(tick, ball->GetPosition(), ball->GetLinearVelocity(), lo, hi,
+                                 ball->GetLinearDamping(), restitution, threshold, predictionHorizonTicks);
+        valid = true;
+        recomputes.add();
+    }
+
+public:
+    /**
+     * @brief Create a predictor
+     * @param phys Engine the ball lives in. Must have zero gravity, and its walls must be its first 4 bodies.
+     * @param ball Body to predict
+     */
+    BallPredictor(const PhysicsEngine &phys, const b2Body *ball) : phys(phys), ball(ball),
+                                                                   ballId(PhysicsEngine::getBodyId(ball)) {}
+
+    BallPredictor(const BallPredictor &rhs) = delete; //!< Deleted copy constructor
+    BallPredictor &operator=(const BallPredictor &rhs) = delete; //!< Deleted copy assignment operator
+
+    /// Call after every `PhysicsEngine::step()`. Drops the cached path if the ball touched anything.
+    void onStep() {
+        for (const auto &ev : phys.getContactEvents()) {
+            if (ev.bodyA == ballId || ev.bodyB == ballId) {
+                valid = false;
+                return;
+            }
+        }
+    }
+
+    inline void invalidate() { //!< Drop the cached path, e.g. after teleporting the ball
+        valid = false;
+    }
+
+    /**
+     * @brief Get the predicted path of the ball
+     * @param tick Current tick. Used as the start of the path if it has to be recomputed.
+     * @return The (possibly cached) path. Valid until the next call.
+     */
+    const BallPath &getPath(uint64_t tick) {
+        if (!valid || tick < path.tick || static_cast<float>(tick - path.tick) > path.horizon / 2) {
+            static std::atomic_bool warned = false; // once per process, predictors may run on several threads
+            if (phys.gravity.LengthSquared() != 0 && !warned.exchange(true, std::memory_order_relaxed)) {
+                WARN("Ball prediction assumes zero gravity, but gravity is ({}, {})!", phys.gravity.x,
+                     phys.gravity.y);
+            }
+            recompute(tick);
+        }
+        return path;
+    }
+};
+
+#endif
@@ -0,0 +1,92 @@
+//
+// Created by grant on 12/10/20.
+//
+
+#pragma once
+
+#ifndef PROTOCOL_CPP_INCLUDED
+#define PROTOCOL_CPP_INCLUDED
+
+#include "config.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+// Wire format. Packets are packed structs in host byte order; every target we ship on is little-endian.
+enum class PacketType : uint8_t {
+    eInput = 1, //!< Client to server: an `InputPacket`. The first one from an address joins the game.
+    eSnapshot = 2, //!< Server to client: a `SnapshotHeader`, followed by `numEntities` `NetEntity`s. Only the
+                   //!< ball and the client's ship are in every snapshot, others come and go with their relevance.
+    eBye = 3, //!< Client to server: a lone `PacketType`. Leaves the game.
+    eSpectate = 4, //!< Client to server: a `SpectatePacket`. Joins as a spectator, resend every few seconds.
+    eSpectatorFrame = 5, //!< Server to spectator: a `SpectatorHeader`, entities, then removed ids
+    eSpectateCookie = 6 //!< Server to client: a `SpectatePacket` with the cookie to send in `eSpectate`
+};
+
+#pragma pack(push, 1)
+
+/// Controls of a client's ship, sent every tick. Only the newest input (by `seq`) is applied.
+struct InputPacket {
+    PacketType type = PacketType::eInput;
+    uint32_t seq; //!< Increments by one per packet, gaps are counted as lost inputs
+    uint8_t thrust; //!< 0-255, mapped to [0, 1]
+    int8_t turn; //!< -1, 0 or 1
+};
+
+/**
+ * Spectating is a handshake, so frames only go to addresses that can receive: the first `eSpectate` has `cookie` 0,
+ * the server answers with an `eSpectateCookie`, and every `eSpectate` after that echoes its cookie. The answer is
+ * exactly as big as the request, so a spoofed source address can't be used to amplify anything.
+ */
+struct SpectatePacket {
+    PacketType type = PacketType::eSpectate;
+    uint64_t cookie = 0; //!< 0, or the cookie the server sent to this address
+};
+
+/// State of one body in a snapshot
+struct NetEntity {
+    uint32_t id; //!< `PhysicsEngine::getBodyId()`
+    float x, y, angle;
+    float vx, vy;
+};
+
+struct SnapshotHeader {
+    PacketType type = PacketType::eSnapshot;
+    uint64_t tick;
+    uint32_t ackSeq; //!< Newest `InputPacket::seq` applied for the receiving client
+    uint32_t shipId; //!< Id of the receiving client's ship
+    uint16_t numEntities;
+    uint32_t checksum; //!< `netChecksum()` of the entities
+};
+
+/**
+ * Spectator frames are either keyframes (`keyframeTick == tick`) with every entity, or deltas against the keyframe
+ * `keyframeTick`, with only the entities that changed since then and the ids of those that are gone. Deltas are
+ * always against a keyframe, not the previous frame, so a lost frame never breaks the ones after it.
+ */
+struct SpectatorHeader {
+    PacketType type = PacketType::eSpectatorFrame;
+    uint64_t tick;
+    uint64_t keyframeTick;
+    uint16_t numEntities; //!< `NetEntity`s following the header
+    uint16_t numRemoved; //!< `uint32_t` ids following the entities
+    uint32_t checksum; //!< `netChecksum()` of everything after the header
+};
+
+#pragma pack(pop)
+
+constexpr size_t maxSnapshotEntities = (serverMaxPacketBytes - sizeof(SnapshotHeader)) / sizeof(NetEntity);
+/// The spectator header is bigger, so a spectator keyframe fits fewer entities
+constexpr size_t maxSpectatorEntities = (serverMaxPacketBytes - sizeof(SpectatorHeader)) / sizeof(NetEntity);
+
+/// FNV-1a over raw bytes. Catches truncated and mangled snapshots, not a security measure.
+inline uint32_t netChecksum(const void *data, size_t len) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+#endif
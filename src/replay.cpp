@@ -0,0 +1,282 @@
+//
+// Created by grant on 11/28/20.
+//
+
+#pragma once
+
+#ifndef REPLAY_CPP_INCLUDED
+#define REPLAY_CPP_INCLUDED
+
+#include "game.cpp"
+#include "thread.hpp"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A recorded match: every tick's `RenderSnapshot`, packed back to back. Frame `i` is made of
+ *        `entities[offsets[i]]` up to (but not including) `entities[offsets[i + 1]]`.
+ */
+class ReplayRecording {
+public:
+    std::vector<uint64_t> ticks; //!< Simulation tick of each frame
+    std::vector<uint32_t> offsets{0}; //!< Index into `entities` of the first entity of each frame (+1 sentinel)
+    std::vector<RenderEntity> entities;
+
+    /**
+     * @brief Append a snapshot as the next frame
+     * @param snap Snapshot to copy
+     */
+    void record(const RenderSnapshot &snap) {
+        ticks.push_back(snap.tick);
+        entities.insert(entities.end(), snap.entities.begin(), snap.entities.begin() + snap.numEntities);
+        offsets.push_back(static_cast<uint32_t>(entities.size()));
+    }
+
+    [[nodiscard]] inline size_t getNumFrames() const { //!< Number of frames recorded
+        return ticks.size();
+    }
+
+    /**
+     * @brief Unpack a frame
+     * @param index Index of the frame, must be less than `getNumFrames()`
+     * @param out Snapshot to overwrite with the frame
+     */
+    void getFrame(size_t index, RenderSnapshot &out) const {
+        out.clear(ticks[index]);
+        for (uint32_t i = offsets[index]; i < offsets[index + 1]; i++) {
+            out.push(entities[i]);
+        }
+    }
+
+    /**
+     * @brief Write the recording to a file. The format is a raw dump, so it is only portable between
+     *        builds with the same `RenderEntity` layout.
+     * @param path File to write
+     * @return True on success
+     */
+    bool save(const std::string &path) const {
+        std::FILE *fp = std::fopen(path.c_str(), "wb");
+        if (fp == nullptr) {
+            ERROR("Failed to open replay `{}` for writing: {}", path, std::strerror(errno));
+            return false;
+        }
+
+        uint64_t header[3] = {replayMagic, ticks.size(), entities.size()};
+        bool ok = std::fwrite(header, sizeof(header), 1, fp) == 1;
+        ok = ok && std::fwrite(ticks.data(), sizeof(uint64_t), ticks.size(), fp) == ticks.size();
+        ok = ok && std::fwrite(offsets.data(), sizeof(uint32_t), offsets.size(), fp) == offsets.size();
+        ok = ok && std::fwrite(entities.data(), sizeof(RenderEntity), entities.size(), fp) == entities.size();
+        std::fclose(fp);
+
+        if (!ok) {
+            ERROR("Failed to write replay `{}`!", path);
+        }
+        return ok;
+    }
+
+    /**
+     * @brief Replace this recording with one read from a file written by `save()`
+     * @param path File to read
+     * @return True on success. On failure, the recording is left empty.
+     */
+    bool load(const std::string &path) {
+        ticks.clear();
+        offsets.assign(1, 0);
+        entities.clear();
+
+        std::FILE *fp = std::fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            ERROR("Failed to open replay `{}`: {}", path, std::strerror(errno));
+            return false;
+        }
+
+        uint64_t header[3];
+        bool ok = std::fread(header, sizeof(header), 1, fp) == 1 && header[0] == replayMagic;
+        if (ok) {
+            // Sanity check the counts against the file size before allocating for them
+            std::fseek(fp, 0, SEEK_END);
+            auto fileBytes = static_cast<uint64_t>(std::ftell(fp));
+            std::fseek(fp, sizeof(header), SEEK_SET);
+            ok = header[1] < fileBytes && header[2] < fileBytes
+                 && sizeof(header) + header[1] * sizeof(uint64_t) + (header[1] + 1) * sizeof(uint32_t)
+                    + header[2] * sizeof(RenderEntity) <= fileBytes;
+        }
+        if (ok) {
+            ticks.resize(header[1]);
+            offsets.resize(header[1] + 1);
+            entities.resize(header[2]);
+            ok = std::fread(ticks.data(), sizeof(uint64_t), ticks.size(), fp) == ticks.size();
+            ok = ok && std::fread(offsets.data(), sizeof(uint32_t), offsets.size(), fp) == offsets.size();
+            ok = ok && std::fread(entities.data(), sizeof(RenderEntity), entities.size(), fp) == entities.size();
+        }
+        std::fclose(fp);
+
+        // `getFrame()` trusts the offsets, so they have to stay inside `entities`
+        ok = ok && offsets[0] == 0 && offsets.back() <= entities.size();
+        for (size_t i = 1; ok && i < offsets.size(); i++) {
+            ok = offsets[i - 1] <= offsets[i];
+        }
+
+        if (!ok) {
+            ERROR("Replay `{}` is truncated, corrupt or not a replay!", path);
+            ticks.clear();
+            offsets.assign(1, 0);
+            entities.clear();
+        }
+        return ok;
+    }
+
+private:
+    static constexpr uint64_t replayMagic = 0x4e46'3252'5030'3031; //!< "NF2RP001"
+    static_assert(std::is_trivially_copyable_v<RenderEntity>, "Replays are raw dumps of `RenderEntity`!");
+};
+
+/// Renders snapshots into a software surface, no window or GPU needed. One per thread!
+class OffscreenRenderer {
+public:
+    int w, h;
+    SDL_Surface *surface = nullptr;
+    SDL_Renderer *ren = nullptr;
+    std::unique_ptr<SpriteSheet> sprites;
+
+    OffscreenRenderer(int w, int h) : w(w), h(h) {
+        surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+        if (surface == nullptr) {
+            FATAL("Failed to create offscreen surface: {}", SDL_GetError());
+            throw std::runtime_error("Offscreen surface creation failed");
+        }
+
+        ren = SDL_CreateSoftwareRenderer(surface);
+        if (ren == nullptr) {
+            SDL_FreeSurface(surface);
+            FATAL("Failed to create software renderer: {}", SDL_GetError());
+            throw std::runtime_error("Software renderer creation failed");
+        }
+
+        sprites = std::make_unique<SpriteSheet>(ren);
+        sprites->viewW = w;
+        sprites->viewH = h;
+    }
+
+    OffscreenRenderer(const OffscreenRenderer &rhs) = delete; //!< Deleted copy constructor
+    OffscreenRenderer &operator=(const OffscreenRenderer &rhs) = delete; //!< Deleted copy assignment operator
+
+    void render(const RenderSnapshot &snap) { //!< Draw a snapshot into `surface`
+        SDL_SetRenderDrawColor(ren, 0xFF, 0xFF, 0xFF, 0xFF);
+        SDL_RenderClear(ren);
+        sprites->draw(snap);
+        SDL_RenderPresent(ren); // flushes SDL's command batching into the surface
+    }
+
+    virtual ~OffscreenRenderer() {
+        sprites.reset(); // textures have to go before their renderer
+        SDL_DestroyRenderer(ren);
+        SDL_FreeSurface(surface);
+    }
+};
+
+/// Output of `renderReplay`
+enum class ReplayFormat {
+    ePng, //!< One `frame_<index>.png` per frame
+    eRaw //!< One `frames.rgba` file with all frames as raw RGBA8888, back to back (e.g. for `ffmpeg -f rawvideo`)
+};
+
+/**
+ * @brief Render frames `[first, last)` of a replay without a display, split across the workers of a pool.
+ *        Each task gets its own `OffscreenRenderer` and a contiguous chunk of frames.
+ * @param rec Replay to render
+ * @param first First frame to render
+ * @param last One past the last frame to render. Clamped to the number of frames.
+ * @param outDir Existing directory to write into
+ * @param format Whether to write PNGs or raw video
+ * @param w Width of the frames in pixels
+ * @param h Height of the frames in pixels
+ * @param pool Started pool to render on
+ * @return Number of frames that failed to render or write
+ */
+size_t renderReplay(const ReplayRecording &rec, size_t first, size_t last, const std::string &outDir,
+                    ReplayFormat format, int w, int h, stms::ThreadPool &pool) {
+    last = std::min(last, rec.getNumFrames());
+    if (first >= last) {
+        return 0;
+    }
+
+    int rawFd = -1;
+    if (format == ReplayFormat::eRaw) {
+        std::string path = outDir + "/frames.rgba";
+        rawFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (rawFd < 0) {
+            ERROR("Failed to open `{}`: {}", path, std::strerror(errno));
+            return last - first;
+        }
+    }
+
+    // A few chunks per worker so that faster workers can pick up the slack.
+    size_t numChunks = std::max<size_t>(1, pool.getNumThreads() * replayChunksPerWorker);
+    size_t chunk = std::max<size_t>(replayMinChunkFrames, (last - first + numChunks - 1) / numChunks);
+    std::atomic_size_t failed = 0;
+
+    std::vector<std::future<void>> futures;
+    std::vector<size_t> chunkFrames; // frames of each task, the last chunk may be shorter
+    for (size_t begin = first; begin < last; begin += chunk) {
+        size_t end = std::min(last, begin + chunk);
+        chunkFrames.push_back(end - begin);
+        futures.emplace_back(pool.submitTask([&, begin, end]() {
+            OffscreenRenderer offscreen(w, h);
+            RenderSnapshot snap;
+            const size_t frameBytes = static_cast<size_t>(w) * h * 4;
+
+            for (size_t i = begin; i < end; i++) {
+                rec.getFrame(i, snap);
+                offscreen.render(snap);
+
+                if (format == ReplayFormat::ePng) {
+                    std::string path = fmt::format("{}/frame_{:06}.png", outDir, i);
+                    if (IMG_SavePNG(offscreen.surface, path.c_str()) != 0) {
+                        ERROR("Failed to write `{}`: {}", path, SDL_GetError());
+                        failed++;
+                    }
+                } else {
+                    // Every frame has a fixed spot in the file, so workers can write concurrently.
+                    auto offset = static_cast<off_t>((i - first) * frameBytes);
+                    for (int row = 0; row < h; row++) {
+                        const auto *px = static_cast<const char *>(offscreen.surface->pixels) +
+                                         static_cast<size_t>(row) * offscreen.surface->pitch;
+                        if (pwrite(rawFd, px, static_cast<size_t>(w) * 4, offset + row * w * 4) != w * 4) {
+                            failed++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < futures.size(); i++) {
+        try {
+            futures[i].get();
+        } catch (std::exception &e) {
+            ERROR("Replay render task failed: {}", e.what());
+            failed += chunkFrames[i];
+        }
+    }
+
+    if (rawFd >= 0) {
+        close(rawFd);
+    }
+
+    return failed;
+}
+
+#endif
@@ -0,0 +1,184 @@
+//
+// Created by grant on 12/12/20.
+//
+
+#include "script.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include "log.hpp"
+#include "metrics.hpp"
+
+namespace stms {
+
+    /// Free lists of coroutine frames, one per size class. Frames are never given back to the OS.
+    struct ScriptFramePool {
+        struct FreeFrame {
+            FreeFrame *next;
+        };
+
+        static constexpr size_t numClasses = scriptMaxFrameBytes / scriptFrameGranularity;
+
+        std::mutex mtx; //!< Only taken when a script is spawned or finishes, never while one is waiting
+        FreeFrame *free[numClasses]{};
+        std::vector<std::unique_ptr<unsigned char[]>> chunks;
+
+        Counter &heapAllocs = getMetrics().counter("stms_script_frame_heap_allocs_total",
+                                                   "Script coroutine frames too big for the frame pool");
+        Gauge &inUse = getMetrics().gauge("stms_script_frames_in_use", "Pooled script coroutine frames in use");
+    };
+
+    static ScriptFramePool &getScriptFramePool() {
+        static ScriptFramePool val;
+        return val;
+    }
+
+    void *allocScriptFrame(size_t size) {
+        ScriptFramePool &pool = getScriptFramePool();
+        if (size > scriptMaxFrameBytes) {
+            pool.heapAllocs.add();
+            return ::operator new(size);
+        }
+
+        size_t cls = (size + scriptFrameGranularity - 1) / scriptFrameGranularity - 1;
+        std::lock_guard<std::mutex> lg(pool.mtx);
+        if (pool.free[cls] == nullptr) {
+            // Frames are multiples of the granularity into a block from `new`, so they keep its alignment.
+            size_t frameBytes = (cls + 1) * scriptFrameGranularity;
+            pool.chunks.emplace_back(new unsigned char[frameBytes * scriptFramesPerChunk]);
+            unsigned char *chunk = pool.chunks.back().get();
+            for (size_t i = scriptFramesPerChunk; i > 0; i--) {
+                auto *frame = reinterpret_cast<ScriptFramePool::FreeFrame *>(chunk + (i - 1) * frameBytes);
+                frame->next = pool.free[cls];
+                pool.free[cls] = frame;
+            }
+        }
+
+        ScriptFramePool::FreeFrame *frame = pool.free[cls];
+        pool.free[cls] = frame->next;
+        pool.inUse.add(1);
+        return frame;
+    }
+
+    void freeScriptFrame(void *ptr, size_t size) noexcept {
+        if (size > scriptMaxFrameBytes) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        ScriptFramePool &pool = getScriptFramePool();
+        size_t cls = (size + scriptFrameGranularity - 1) / scriptFrameGranularity - 1;
+        auto *frame = static_cast<ScriptFramePool::FreeFrame *>(ptr);
+        std::lock_guard<std::mutex> lg(pool.mtx);
+        frame->next = pool.free[cls];
+        pool.free[cls] = frame;
+        pool.inUse.add(-1);
+    }
+
+    void Script::promise_type::unhandled_exception() noexcept {
+        try {
+            throw;
+        } catch (const std::exception &e) {
+            ERROR("Uncaught exception in a script, ending it: {}", e.what());
+        } catch (...) {
+            ERROR("Uncaught exception (not a std::exception) in a script, ending it!");
+        }
+    }
+
+    ScriptScheduler::ScriptScheduler(float tickRate) : tickRate(tickRate) {
+        ready.reserve(scriptReserve);
+        resuming.reserve(scriptReserve);
+        sleeping.reserve(scriptReserve);
+        offloaded.reserve(scriptReserve);
+        offloadResuming.reserve(scriptReserve);
+    }
+
+    ScriptScheduler::~ScriptScheduler() {
+        while (offloadsInFlight.load(std::memory_order_acquire) > 0) {
+            std::this_thread::yield(); // the workers touch the scheduler when they finish
+        }
+
+        for (auto *list : {&ready, &offloaded}) {
+            for (Script::Handle handle : *list) {
+                handle.destroy();
+            }
+        }
+        for (const Sleeper &sleeper : sleeping) {
+            sleeper.handle.destroy();
+        }
+    }
+
+    void ScriptScheduler::resume(Script::Handle handle) {
+        handle.resume();
+        if (handle.done()) {
+            handle.destroy();
+            numScripts--;
+        }
+    }
+
+    void ScriptScheduler::spawn(Script &&script) {
+        if (!script.handle) {
+            WARN("ScriptScheduler::spawn() called with an empty Script! Ignoring...");
+            return;
+        }
+
+        Script::Handle handle = std::exchange(script.handle, nullptr);
+        handle.promise().scheduler = this;
+        numScripts++;
+        ready.push_back(handle);
+    }
+
+    void ScriptScheduler::tick() {
+        tick_++;
+        // Whatever gets scheduled while resuming lands in `ready` again and waits for the next tick, so a script
+        // never runs twice in one tick.
+        std::swap(ready, resuming);
+
+        while (!sleeping.empty() && sleeping.front().wakeTick <= tick_) {
+            std::pop_heap(sleeping.begin(), sleeping.end(), std::greater<>());
+            Script::Handle handle = sleeping.back().handle;
+            sleeping.pop_back();
+            resume(handle);
+        }
+
+        for (Script::Handle handle : resuming) {
+            resume(handle);
+        }
+        resuming.clear();
+
+        {
+            std::lock_guard<std::mutex> lg(offloadMtx);
+            std::swap(offloaded, offloadResuming);
+        }
+        for (Script::Handle handle : offloadResuming) {
+            resume(handle);
+        }
+        offloadResuming.clear();
+    }
+
+    void ScriptScheduler::scheduleNextTick(Script::Handle handle) {
+        ready.push_back(handle);
+    }
+
+    void ScriptScheduler::scheduleIn(Script::Handle handle, uint64_t ticks) {
+        sleeping.push_back(Sleeper{tick_ + ticks, sleepCount++, handle});
+        std::push_heap(sleeping.begin(), sleeping.end(), std::greater<>());
+    }
+
+    void ScriptScheduler::beginOffload() {
+        offloadsInFlight.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void ScriptScheduler::endOffload(Script::Handle handle) {
+        {
+            std::lock_guard<std::mutex> lg(offloadMtx);
+            offloaded.push_back(handle);
+        }
+        // Last touch of the scheduler by this worker: the destructor may run as soon as this hits 0.
+        offloadsInFlight.fetch_sub(1, std::memory_order_release);
+    }
+}
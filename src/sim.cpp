@@ -0,0 +1,288 @@
+//
+// Created by grant on 11/25/20.
+//
+
+#pragma once
+
+#ifndef SIM_CPP_INCLUDED
+#define SIM_CPP_INCLUDED
+
+#include "game.cpp"
+#include "debug_draw.cpp"
+#include "input.cpp"
+#include "particles.cpp"
+#include "prediction.cpp"
+#include "replay.cpp"
+#include "sound.cpp"
+#include "telemetry.cpp"
+#include "affinity.hpp"
+#include "frame_arena.hpp"
+#include "metrics.hpp"
+#include "script.hpp"
+#include "timers.hpp"
+#include "triple_buffer.hpp"
+#include "watchdog.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
+/**
+ * @brief Owns the world and runs the fixed-timestep simulation on its own thread. After every tick, a
+ *        `RenderSnapshot` is published to `snapshots`, so the render thread never waits on (or stalls) physics.
+ */
+class Simulation {
+public:
+    PhysicsEngine phys{};
+    Ball ball{phys.makeDynamicCircle(0, 0, fieldWidth / 8.)};
+    Ship ship{phys.makeDynamicBox(5, -(fieldHeight / 2.), fieldWidth / 8., fieldHeight / 8.), Team{255, 0, 0}};
+
+    stms::TripleBuffer<RenderSnapshot> snapshots; //!< Written by the simulation thread, read by the renderer
+    InputQueue input; //!< Pushed to by the render thread's `InputSystem`, sampled at the start of every tick
+
+    /// Visual effects for the render thread to spawn particles for. Events that don't fit are dropped.
+    stms::SpscQueue<EffectEvent, effectQueueSize> effects;
+
+    /// Sounds for the render thread's `AudioSystem`, one per source and tick. Events that don't fit are dropped.
+    SoundQueue sounds;
+
+    /// If set, Box2D's debug drawing of every tick is published to `debugDrawLists`. Can be toggled at any time.
+    std::atomic_bool debugDraw = false;
+    stms::TripleBuffer<DebugDrawList> debugDrawLists; //!< Only written while `debugDraw` is set
+
+    /// If set, every published snapshot is also appended here. Set it before `start()`!
+    ReplayRecording *recording = nullptr;
+
+    /// If set, the ship and the ball are appended here every tick. Set it before `start()`!
+    TelemetryWriter *telemetry = nullptr;
+
+    /// Gameplay scripts (match flow, bots), resumed every tick after physics. Spawn them before `start()` or from
+    /// another script.
+    stms::ScriptScheduler scripts{tickRate};
+
+    /// Applied by the simulation thread when it starts. Set it before `start()`!
+    stms::ThreadPlacement placement{simThreadName, stms::parseCpuList(simCpus), simNumaNode, simPriority};
+
+private:
+    std::thread thread;
+    std::atomic_bool running = false;
+    uint64_t tick = 0;
+    InputState controls;
+    BallPredictor predictor{phys, ball.body.body};
+    PhysicsDebugDraw debugDrawer;
+    SoundBatch soundBatch; //!< This tick's impacts, merged per body pair
+
+    stms::FrameProfiler profiler; //!< Zones of the simulation thread, dumped by `watchdog`
+    stms::TickWatchdog watchdog{tickBudgetMs, &profiler, stms::getLogPool()};
+
+    /// Metrics updated every tick. Registered once, updating them is lock-free.
+    struct Metrics {
+        stms::Histogram &tickMs = stms::getMetrics().histogram(
+                "nf2_sim_tick_ms", "Time between simulation ticks (TPSTimer MSPT)",
+                {1, 2, 5, 10, 16, 17, 20, 33, 50, 100});
+        stms::Histogram &stepMs = stms::getMetrics().histogram(
+                "nf2_physics_step_ms", "Duration of PhysicsEngine::step()",
+                {0.05, 0.1, 0.25, 0.5, 1, 2, 4, 8, 16});
+        stms::Gauge &bodies = stms::getMetrics().gauge("nf2_physics_bodies", "Bodies in the world");
+        stms::Gauge &contacts = stms::getMetrics().gauge("nf2_physics_contacts", "Contacts in the world");
+        stms::Counter &contactEvents = stms::getMetrics().counter("nf2_physics_contact_events_total",
+                                                                  "Contact events reported by the physics");
+    };
+
+    static Metrics &getSimMetrics() {
+        static Metrics val;
+        return val;
+    }
+
+    void publishSnapshot() {
+        stms::FrameProfiler::Scope zone(profiler, "publishSnapshot");
+        RenderSnapshot &snap = snapshots.getWriteBuffer();
+        snap.clear(tick);
+        snap.inputSeq = controls.applied;
+        ship.snapshot(snap);
+        ball.snapshot(snap);
+        if (recording != nullptr) {
+            recording->record(snap);
+        }
+        snapshots.publish();
+    }
+
+    void sampleInput() { //!< Apply everything that arrived in `input` since the last tick
+        InputEvent ev{};
+        while (input.tryPop(ev)) {
+            controls.apply(ev);
+        }
+
+        ship.turn(controls.turn);
+        if (controls.thrust > 0) {
+            ship.apply(controls.thrust * shipThrustAccel * ship.body.body->GetMass());
+
+            float angle = ship.body.body->GetAngle();
+            b2Vec2 back(-std::sin(angle), -std::cos(angle)); // opposite of the thrust, see `Ship::apply`
+            b2Vec2 exhaust = ship.body.body->GetPosition() + ship.body.h * back;
+            effects.tryPush(EffectEvent{EffectEvent::Type::eThrust, exhaust, back, controls.thrust});
+
+            uint32_t shipId = PhysicsEngine::getBodyId(ship.body.body);
+            sounds.tryPush(SoundEvent{SoundId::eThrust, shipId, shipId, controls.thrust, exhaust});
+        }
+    }
+
+    void pushImpactEffects() { //!< Turn this tick's hard hits (contacts that just began) into `EffectEvent`s
+        for (const auto &ev : phys.getContactEvents()) {
+            if (ev.type == ContactEvent::Type::eImpact && ev.first && ev.impulse >= sparkMinImpulse) {
+                effects.tryPush(EffectEvent{EffectEvent::Type::eImpact, ev.point, b2Vec2(0, 0), ev.impulse});
+            }
+        }
+    }
+
+    void pushImpactSounds() { //!< Merge the contacts that began with a hit this tick per body pair, queue a sound each
+        soundBatch.clear();
+        for (const auto &ev : phys.getContactEvents()) {
+            if (ev.type == ContactEvent::Type::eImpact && ev.first && ev.impulse >= soundMinImpulse) {
+                soundBatch.add(SoundEvent{SoundId::eImpact, ev.bodyA, ev.bodyB, ev.impulse, ev.point});
+            }
+        }
+
+        for (const auto &ev : soundBatch.getEvents()) {
+            sounds.tryPush(ev);
+        }
+    }
+
+    void run() {
+        stms::applyPlacement(placement);
+        stms::FrameArena frameArena{};
+        stms::FrameArena::Scope frameScope(&frameArena);
+
+        stms::TPSTimer timer{};
+        stms::Stopwatch tickWatch{};
+        while (running) {
+            frameArena.reset();
+            timer.tick();
+            getSimMetrics().tickMs.observe(timer.getLatestMspt());
+
+            tickWatch.start();
+            stepOnce();
+            tickWatch.stop();
+            watchdog.check(tickWatch.getTime());
+
+            timer.wait(tickRate);
+        }
+    }
+
+public:
+    Simulation() {
+        ship.turnImpulse = ship.body.body->GetInertia() * shipTurnAccel / tickRate; // impulse is applied every tick
+        publishSnapshot(); // so the renderer has something to draw before the first tick
+
+        watchdog.addDumpHook([this](std::string &out) {
+            size_t awake = 0;
+            float maxSpeed = 0;
+            for (b2Body *body = phys.world.GetBodyList(); body != nullptr; body = body->GetNext()) {
+                awake += body->IsAwake();
+                maxSpeed = std::max(maxSpeed, body->GetLinearVelocity().Length());
+            }
+
+            size_t touching = 0;
+            for (b2Contact *contact = phys.world.GetContactList(); contact != nullptr; contact = contact->GetNext()) {
+                touching += contact->IsTouching();
+            }
+
+            PhysicsArena::Stats arena = phys.getArenaStats();
+            const PhysicsEngine::StepStats &step = phys.getLastStep();
+            out += fmt::format("== Physics ==\n"
+                               "Bodies: {} ({} awake), fastest at {:.2f}m/s\n"
+                               "Contacts: {} ({} touching), {} event(s) last tick, {} dropped in total\n"
+                               "Arena: {}/{} bytes in use (peak {}), {} heap fallback(s)\n"
+                               "Last step: {} sub-step(s), CCD {}, {} bullet(s)\n"
+                               "Scripts: {}\n",
+                               phys.world.GetBodyCount(), awake, maxSpeed, phys.world.GetContactCount(), touching,
+                               phys.getContactEvents().size(), phys.getDroppedContactEvents(), arena.bytesInUse,
+                               arena.capacity, arena.peakBytes, arena.heapFallbacks, step.subSteps,
+                               step.ccd ? "on" : "off", step.bullets, scripts.getNumScripts());
+        });
+    }
+
+    /// Run a single tick on the calling thread. For headless use without `start()`, e.g. to record replays.
+    void stepOnce() {
+        profiler.beginFrame();
+        stms::FrameProfiler::Scope zone(profiler, "stepOnce");
+
+        if (recording != nullptr && recording->getNumFrames() == 0) {
+            publishSnapshot(); // the constructor's snapshot predates `recording`, so frame 0 is recorded here
+        }
+
+        sampleInput();
+
+        Metrics &metrics = getSimMetrics();
+        auto before = std::chrono::steady_clock::now();
+        {
+            stms::FrameProfiler::Scope physZone(profiler, "PhysicsEngine::step");
+            phys.step(1.0f / tickRate);
+        }
+        predictor.onStep();
+        metrics.stepMs.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - before)
+                                       .count());
+        metrics.bodies.set(phys.world.GetBodyCount());
+        metrics.contacts.set(phys.world.GetContactCount());
+        metrics.contactEvents.add(phys.getContactEvents().size());
+        pushImpactEffects();
+        pushImpactSounds();
+
+        {
+            stms::FrameProfiler::Scope scriptZone(profiler, "ScriptScheduler::tick");
+            scripts.tick();
+        }
+
+        tick++;
+        publishSnapshot();
+        if (telemetry != nullptr) {
+            for (const b2Body *body : {ship.body.body, ball.body.body}) {
+                b2Vec2 pos = body->GetPosition(), vel = body->GetLinearVelocity();
+                telemetry->append(tick, NetEntity{PhysicsEngine::getBodyId(body), pos.x, pos.y, body->GetAngle(),
+                                                  vel.x, vel.y});
+            }
+        }
+
+        if (debugDraw.load(std::memory_order_relaxed)) {
+            stms::FrameProfiler::Scope debugZone(profiler, "PhysicsDebugDraw::record");
+            debugDrawer.record(phys.world, debugDrawLists.getWriteBuffer());
+            debugDrawLists.publish();
+        }
+    }
+
+    /**
+     * @brief Get the predicted path of the ball, e.g. for bots or an aim assist. Cheap, the path is cached until
+     *        the ball touches something. Simulation thread only!
+     * @return Path of the ball, starting at the current tick at the latest
+     */
+    const BallPath &predictBall() {
+        return predictor.getPath(tick);
+    }
+
+    Simulation(const Simulation &rhs) = delete; //!< Deleted copy constructor
+    Simulation &operator=(const Simulation &rhs) = delete; //!< Deleted copy assignment operator
+
+    void start() { //!< Start ticking on the simulation thread
+        if (running) {
+            WARN("Simulation::start() called when already started! Ignoring...");
+            return;
+        }
+
+        running = true;
+        thread = std::thread(&Simulation::run, this);
+    }
+
+    void stop() { //!< Stop the simulation thread, blocking until the current tick is done.
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    virtual ~Simulation() {
+        stop();
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+//
+// Created by grant on 12/8/20.
+//
+
+#pragma once
+
+#ifndef SOUND_CPP_INCLUDED
+#define SOUND_CPP_INCLUDED
+
+#include <box2d/box2d.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include "config.hpp"
+#include "spsc_queue.hpp"
+
+/// Which sound a `SoundEvent` plays. Indexes `AudioSystem`'s chunks.
+enum class SoundId : uint8_t {
+    eImpact = 0, //!< `soundImpactPath`, one-shot
+    eThrust = 1, //!< `soundThrustPath`, looped for as long as the events keep coming
+    eCount //!< Number of sounds. Not a valid sound!
+};
+
+/// Something the simulation wants a sound for. Sent to the render thread through `Simulation::sounds`.
+struct SoundEvent {
+    SoundId sound;
+    uint32_t bodyA; //!< Body making the sound, see `PhysicsEngine::getBodyId()`
+    uint32_t bodyB; //!< Other body of a collision. Same as `bodyA` if there is none.
+    float strength; //!< Summed normal impulse for impacts, thrust in [0, 1] for thrust
+    b2Vec2 pos; //!< Where the sound comes from, in real-space
+
+    /// Identifies the source of the sound: the same sound between the same (unordered) bodies is one source.
+    [[nodiscard]] inline uint64_t key() const {
+        return static_cast<uint64_t>(std::min(bodyA, bodyB)) << 32u | std::max(bodyA, bodyB);
+    }
+};
+
+/// Handoff of `SoundEvent`s from the simulation thread to the render thread's `AudioSystem`.
+using SoundQueue = stms::SpscQueue<SoundEvent, soundQueueSize>;
+
+/**
+ * @brief Fixed-capacity set of `SoundEvent`s that merges events of the same source: their strengths are summed and
+ *        the position of the strongest one is kept. When full, the weakest event makes room for a stronger one.
+ */
+class SoundBatch {
+private:
+    std::array<SoundEvent, maxSoundsPerBatch> events{};
+    uint32_t numEvents = 0;
+
+public:
+    inline void clear() {
+        numEvents = 0;
+    }
+
+    void add(const SoundEvent &ev) {
+        uint64_t key = ev.key();
+        for (uint32_t i = 0; i < numEvents; i++) {
+            SoundEvent &cur = events[i];
+            if (cur.sound == ev.sound && cur.key() == key) {
+                if (ev.strength > cur.strength) {
+                    cur.pos = ev.pos;
+                }
+                cur.strength += ev.strength;
+                return;
+            }
+        }
+
+        if (numEvents < events.size()) {
+            events[numEvents++] = ev;
+            return;
+        }
+
+        auto weakest = std::min_element(events.begin(), events.end(), [](const SoundEvent &a, const SoundEvent &b) {
+            return a.strength < b.strength;
+        });
+        if (weakest->strength < ev.strength) {
+            *weakest = ev;
+        }
+    }
+
+    [[nodiscard]] inline std::span<const SoundEvent> getEvents() const {
+        return {events.data(), numEvents};
+    }
+};
+
+#endif
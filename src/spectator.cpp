@@ -0,0 +1,299 @@
+//
+// Created by grant on 12/10/20.
+//
+
+#pragma once
+
+#ifndef SPECTATOR_CPP_INCLUDED
+#define SPECTATOR_CPP_INCLUDED
+
+#include "protocol.cpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+/// One encoded spectator packet. Immutable once published, shared by the history and every send of it.
+struct SpectatorFrame {
+    uint64_t tick = 0;
+    bool keyframe = false;
+    std::vector<char> bytes; //!< `SpectatorHeader` and payload, ready to send
+};
+
+/**
+ * @brief Fans the game out to spectators. Every tick is encoded exactly once into a shared `SpectatorFrame`, and
+ *        every spectator is sent that same buffer, `delay` ticks later, so per-spectator cost is one entry in a
+ *        `sendmmsg()` batch. New spectators get the keyframe their first delta refers to before it.
+ */
+class SpectatorRelay {
+private:
+    struct Spectator {
+        sockaddr_in addr;
+        uint64_t lastHeard; //!< Tick of the newest valid `eSpectate` from this spectator
+        bool needsKeyframe = true;
+    };
+
+    std::vector<Spectator> spectators;
+    std::unordered_map<uint64_t, size_t> spectatorIndex; //!< Same keys as `GameServer`'s clients
+
+    uint64_t delay = spectatorDelayTicks;
+    std::deque<std::shared_ptr<const SpectatorFrame>> history; //!< Encoded, but not yet old enough to send
+    std::shared_ptr<const SpectatorFrame> keyframe; //!< Latest keyframe encoded, deltas are against this
+    std::shared_ptr<const SpectatorFrame> sentKeyframe; //!< Latest keyframe sent, for spectators that join
+    std::vector<NetEntity> keyEntities; //!< Entities of `keyframe`, sorted by id
+    std::vector<bool> keySeen; //!< Scratch: which of `keyEntities` are still around
+    std::vector<NetEntity> changed; //!< Scratch: entities of a delta
+    std::vector<uint32_t> removed; //!< Scratch: removed ids of a delta
+
+    std::vector<mmsghdr> msgs; //!< Scratch for `sendmmsg()`, all pointing at the same frame
+    std::vector<iovec> iovs;
+
+    uint64_t secret[2]; //!< Key of `cookieFor()`, random per relay
+
+    stms::Gauge &spectatorsGauge = stms::getMetrics().gauge("nf2_spectators", "Connected spectators");
+    stms::Histogram &encodeMs = stms::getMetrics().histogram("nf2_spectator_encode_ms",
+                                                             "Time to encode one spectator frame, once per tick",
+                                                             {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1});
+    stms::Counter &keyframes = stms::getMetrics().counter("nf2_spectator_keyframes_total",
+                                                          "Spectator frames encoded as keyframes");
+    stms::Counter &sentBytes = stms::getMetrics().counter("nf2_spectator_sent_bytes_total",
+                                                          "Bytes of UDP payload sent to spectators");
+    stms::Counter &sendErrors = stms::getMetrics().counter("nf2_spectator_send_errors_total",
+                                                           "Spectator datagrams the kernel refused");
+    stms::Counter &cookiesSent = stms::getMetrics().counter("nf2_spectator_cookies_sent_total",
+                                                            "`eSpectateCookie` answers to unverified `eSpectate`s");
+
+    static inline uint64_t addrKey(const sockaddr_in &addr) {
+        return static_cast<uint64_t>(addr.sin_addr.s_addr) << 16u | addr.sin_port;
+    }
+
+    static inline uint64_t mix(uint64_t x) { //!< splitmix64 finalizer
+        x = (x ^ (x >> 30u)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27u)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31u);
+    }
+
+    /// Cookie an address has to echo to spectate. Not cryptographic, just not guessable without receiving it.
+    [[nodiscard]] inline uint64_t cookieFor(const sockaddr_in &addr) const {
+        return mix(mix(addrKey(addr) ^ secret[0]) ^ secret[1]) | 1u; // never 0, that's "no cookie yet"
+    }
+
+    static std::shared_ptr<SpectatorFrame> encode(uint64_t tick, uint64_t keyframeTick,
+                                                  std::span<const NetEntity> entities,
+                                                  std::span<const uint32_t> removedIds) {
+        auto frame = std::make_shared<SpectatorFrame>();
+        frame->tick = tick;
+        frame->keyframe = tick == keyframeTick;
+
+        size_t entityBytes = entities.size() * sizeof(NetEntity);
+        size_t removedBytes = removedIds.size() * sizeof(uint32_t);
+        frame->bytes.resize(sizeof(SpectatorHeader) + entityBytes + removedBytes);
+        char *payload = frame->bytes.data() + sizeof(SpectatorHeader);
+        std::memcpy(payload, entities.data(), entityBytes);
+        std::memcpy(payload + entityBytes, removedIds.data(), removedBytes);
+
+        SpectatorHeader header{};
+        header.tick = tick;
+        header.keyframeTick = keyframeTick;
+        header.numEntities = static_cast<uint16_t>(entities.size());
+        header.numRemoved = static_cast<uint16_t>(removedIds.size());
+        header.checksum = netChecksum(payload, entityBytes + removedBytes);
+        std::memcpy(frame->bytes.data(), &header, sizeof(header));
+        return frame;
+    }
+
+    /// Queue `frame` for every spectator matching `pred`, then send them all with as few syscalls as possible
+    template<typename F>
+    void sendTo(int fd, const SpectatorFrame &frame, F &&pred) {
+        msgs.clear();
+        iovs.assign(1, iovec{const_cast<char *>(frame.bytes.data()), frame.bytes.size()});
+        for (auto &spectator : spectators) {
+            if (!pred(spectator)) {
+                continue;
+            }
+
+            mmsghdr msg{};
+            msg.msg_hdr.msg_name = &spectator.addr;
+            msg.msg_hdr.msg_namelen = sizeof(spectator.addr);
+            msg.msg_hdr.msg_iov = iovs.data();
+            msg.msg_hdr.msg_iovlen = 1;
+            msgs.push_back(msg);
+        }
+
+        for (size_t done = 0; done < msgs.size();) {
+            int sent = sendmmsg(fd, msgs.data() + done, static_cast<unsigned>(msgs.size() - done), 0);
+            if (sent <= 0) { // the rest of this frame is dropped, spectators tolerate loss
+                sendErrors.add(msgs.size() - done);
+                break;
+            }
+            done += static_cast<size_t>(sent);
+            sentBytes.add(static_cast<uint64_t>(sent) * frame.bytes.size());
+        }
+    }
+
+public:
+    SpectatorRelay() {
+        std::random_device rd;
+        for (auto &half : secret) {
+            half = static_cast<uint64_t>(rd()) << 32u | rd();
+        }
+    }
+
+    SpectatorRelay(const SpectatorRelay &rhs) = delete; //!< Deleted copy constructor
+    SpectatorRelay &operator=(const SpectatorRelay &rhs) = delete; //!< Deleted copy assignment operator
+
+    /**
+     * @brief Handle an `eSpectate`: add a spectator or keep one alive if it echoed its cookie, otherwise answer
+     *        with the cookie (in a packet as big as the request) and nothing else
+     * @param fd Socket to answer from
+     * @param addr Address the packet came from, and frames would be sent to
+     * @param cookie `SpectatePacket::cookie` of the packet
+     * @param tick Current tick
+     */
+    void onSpectate(int fd, const sockaddr_in &addr, uint64_t cookie, uint64_t tick) {
+        if (cookie != cookieFor(addr)) {
+            SpectatePacket answer{PacketType::eSpectateCookie, cookieFor(addr)};
+            if (sendto(fd, &answer, sizeof(answer), 0, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0) {
+                sendErrors.add();
+            } else {
+                cookiesSent.add();
+            }
+            return;
+        }
+
+        auto it = spectatorIndex.find(addrKey(addr));
+        if (it != spectatorIndex.end()) {
+            spectators[it->second].lastHeard = tick;
+            return;
+        }
+
+        if (spectators.size() >= spectatorMaxCount) {
+            return;
+        }
+        spectatorIndex[addrKey(addr)] = spectators.size();
+        spectators.push_back(Spectator{addr, tick});
+    }
+
+    /**
+     * @brief Change the spectator delay. Making it longer pauses the spectators until the history has caught up,
+     *        making it shorter skips ahead.
+     * @param ticks New delay, in ticks
+     */
+    inline void setDelay(uint64_t ticks) {
+        delay = ticks;
+    }
+
+    [[nodiscard]] inline uint64_t getDelay() const {
+        return delay;
+    }
+
+    [[nodiscard]] inline size_t getNumSpectators() const {
+        return spectators.size();
+    }
+
+    /**
+     * @brief Encode a tick. Call once per tick, before `send()`.
+     * @param tick Tick of the state
+     * @param entities State of every entity spectators should see. Only the first `maxSpectatorEntities` are sent,
+     *                 more wouldn't fit a keyframe in one datagram.
+     */
+    void publish(uint64_t tick, std::span<const NetEntity> entities) {
+        auto before = std::chrono::steady_clock::now();
+        entities = entities.first(std::min(entities.size(), maxSpectatorEntities));
+
+        std::shared_ptr<SpectatorFrame> frame;
+        if (keyframe != nullptr && tick - keyframe->tick < spectatorKeyframeTicks) {
+            // Delta against `keyframe`: changed or new entities, plus ids that disappeared.
+            changed.clear();
+            removed.clear();
+            keySeen.assign(keyEntities.size(), false);
+            for (const auto &ent : entities) {
+                auto it = std::lower_bound(keyEntities.begin(), keyEntities.end(), ent.id,
+                                           [](const NetEntity &e, uint32_t id) { return e.id < id; });
+                if (it != keyEntities.end() && it->id == ent.id) {
+                    keySeen[it - keyEntities.begin()] = true;
+                    if (std::memcmp(&*it, &ent, sizeof(NetEntity)) == 0) {
+                        continue;
+                    }
+                }
+                changed.push_back(ent);
+            }
+            for (size_t i = 0; i < keyEntities.size(); i++) {
+                if (!keySeen[i]) {
+                    removed.push_back(keyEntities[i].id);
+                }
+            }
+
+            if (changed.size() * sizeof(NetEntity) + removed.size() * sizeof(uint32_t)
+                <= serverMaxPacketBytes - sizeof(SpectatorHeader)) {
+                frame = encode(tick, keyframe->tick, changed, removed);
+            } // else too much changed to fit, send a keyframe instead
+        }
+
+        if (frame == nullptr) {
+            frame = encode(tick, tick, entities, {});
+            keyEntities.assign(entities.begin(), entities.end());
+            std::sort(keyEntities.begin(), keyEntities.end(),
+                      [](const NetEntity &a, const NetEntity &b) { return a.id < b.id; });
+            keyframe = frame;
+            keyframes.add();
+        }
+        history.push_back(std::move(frame));
+
+        encodeMs.observe(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - before)
+                                 .count());
+    }
+
+    /**
+     * @brief Send the frame from `delay` ticks ago to every spectator, and drop spectators that timed out
+     * @param fd Socket to send from
+     * @param tick Current tick
+     */
+    void send(int fd, uint64_t tick) {
+        for (size_t i = spectators.size(); i-- > 0;) {
+            if (tick - spectators[i].lastHeard > serverClientTimeoutTicks) {
+                spectatorIndex.erase(addrKey(spectators[i].addr));
+                if (i + 1 != spectators.size()) {
+                    spectators[i] = spectators.back();
+                    spectatorIndex[addrKey(spectators[i].addr)] = i;
+                }
+                spectators.pop_back();
+            }
+        }
+        spectatorsGauge.set(static_cast<double>(spectators.size()));
+
+        // Pop everything old enough; only the newest of those is sent (more than one if the delay shrunk).
+        std::shared_ptr<const SpectatorFrame> frame;
+        while (!history.empty() && history.front()->tick + delay <= tick) {
+            frame = std::move(history.front());
+            history.pop_front();
+            if (frame->keyframe) {
+                sentKeyframe = frame;
+            }
+        }
+        if (frame == nullptr || spectators.empty()) {
+            return;
+        }
+
+        if (!frame->keyframe && sentKeyframe != nullptr) {
+            sendTo(fd, *sentKeyframe, [](const Spectator &s) { return s.needsKeyframe; });
+        }
+        sendTo(fd, *frame, [](const Spectator &) { return true; });
+        for (auto &spectator : spectators) {
+            spectator.needsKeyframe = false;
+        }
+    }
+};
+
+#endif
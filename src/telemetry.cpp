@@ -0,0 +1,311 @@
+//
+// Created by grant on 12/12/20.
+//
+
+#pragma once
+
+#ifndef TELEMETRY_CPP_INCLUDED
+#define TELEMETRY_CPP_INCLUDED
+
+#include "config.hpp"
+#include "protocol.cpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A match's telemetry is a directory with one file per column. Each file is a raw array of one fixed-width type in
+// host byte order, so row `i` is element `i` of every file, and a column can be mapped and scanned on its own.
+// Columns are written one after the other, so after a crash some may be longer; readers use the shortest.
+
+enum class TelemetryColumn {
+    eTick, eId, eX, eY, eAngle, eVx, eVy, eCount
+};
+
+constexpr const char *telemetryColumnFiles[] = {"tick.u64", "id.u32", "x.f32", "y.f32", "angle.f32", "vx.f32",
+                                                 "vy.f32"};
+constexpr size_t telemetryColumnWidths[] = {sizeof(uint64_t), sizeof(uint32_t), sizeof(float), sizeof(float),
+                                            sizeof(float), sizeof(float), sizeof(float)};
+static_assert(std::size(telemetryColumnFiles) == static_cast<size_t>(TelemetryColumn::eCount));
+
+/// Rows of telemetry, stored by column
+struct TelemetryBatch {
+    std::vector<uint64_t> tick;
+    std::vector<uint32_t> id;
+    std::vector<float> x, y, angle, vx, vy;
+
+    void reserve(size_t rows) {
+        tick.reserve(rows);
+        id.reserve(rows);
+        for (auto *col : {&x, &y, &angle, &vx, &vy}) {
+            col->reserve(rows);
+        }
+    }
+
+    void clear() {
+        tick.clear();
+        id.clear();
+        for (auto *col : {&x, &y, &angle, &vx, &vy}) {
+            col->clear();
+        }
+    }
+
+    [[nodiscard]] inline size_t size() const {
+        return tick.size();
+    }
+
+    [[nodiscard]] inline const void *column(TelemetryColumn col) const {
+        switch (col) {
+            case TelemetryColumn::eTick:
+                return tick.data();
+            case TelemetryColumn::eId:
+                return id.data();
+            case TelemetryColumn::eX:
+                return x.data();
+            case TelemetryColumn::eY:
+                return y.data();
+            case TelemetryColumn::eAngle:
+                return angle.data();
+            case TelemetryColumn::eVx:
+                return vx.data();
+            default:
+                return vy.data();
+        }
+    }
+};
+
+/**
+ * @brief Appends the state of entities to a match's column files. `append()` only copies into a batch of
+ *        `telemetryBatchRows` rows; full batches are written by a dedicated I/O thread with one `write()` per
+ *        column. If all `telemetryBatches` batches are waiting to be written, rows are dropped (and counted) instead
+ *        of blocking the game.
+ */
+class TelemetryWriter {
+private:
+    std::string dir;
+    int fds[static_cast<size_t>(TelemetryColumn::eCount)];
+
+    TelemetryBatch active; //!< Only touched by the thread calling `append()`
+    std::mutex batchMtx; //!< Mutex to lock for accessing `freeBatches`, `fullBatches` and `running`
+    std::condition_variable batchCv; //!< Notified when a batch is full or the writer is stopping
+    std::vector<TelemetryBatch> freeBatches;
+    std::vector<TelemetryBatch> fullBatches; //!< Oldest first
+    bool running = true;
+    std::thread ioThread;
+
+    stms::Counter &rowsWritten = stms::getMetrics().counter("nf2_telemetry_rows_total",
+                                                            "Telemetry rows written to column files");
+    stms::Counter &rowsDropped = stms::getMetrics().counter("nf2_telemetry_dropped_rows_total",
+                                                            "Telemetry rows dropped because the writer fell behind");
+
+    void writeOut(const TelemetryBatch &batch) { //!< I/O thread only
+        for (size_t c = 0; c < static_cast<size_t>(TelemetryColumn::eCount); c++) {
+            const char *data = static_cast<const char *>(batch.column(static_cast<TelemetryColumn>(c)));
+            size_t left = batch.size() * telemetryColumnWidths[c];
+            while (fds[c] >= 0 && left > 0) {
+                ssize_t written = ::write(fds[c], data, left);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                } else if (written <= 0) {
+                    ERROR("Failed to write telemetry column `{}/{}`: {}. No more rows will be written to it!", dir,
+                          telemetryColumnFiles[c], std::strerror(errno));
+                    close(fds[c]);
+                    fds[c] = -1;
+                    break;
+                }
+                data += written;
+                left -= static_cast<size_t>(written);
+            }
+        }
+        rowsWritten.add(batch.size());
+    }
+
+    void ioFunc() {
+        std::unique_lock<std::mutex> lg(batchMtx);
+        while (true) {
+            batchCv.wait(lg, [this]() { return !fullBatches.empty() || !running; });
+            if (fullBatches.empty()) {
+                return; // stopped, and everything is written
+            }
+
+            TelemetryBatch batch = std::move(fullBatches.front());
+            fullBatches.erase(fullBatches.begin());
+            lg.unlock();
+            writeOut(batch);
+            batch.clear();
+            lg.lock();
+            freeBatches.push_back(std::move(batch));
+        }
+    }
+
+    void submitActive() { //!< Queue `active` for writing and grab a free batch, if there is one
+        std::lock_guard<std::mutex> lg(batchMtx);
+        if (freeBatches.empty()) {
+            rowsDropped.add(active.size());
+            active.clear();
+            return;
+        }
+
+        fullBatches.push_back(std::move(active));
+        active = std::move(freeBatches.back());
+        freeBatches.pop_back();
+        batchCv.notify_one();
+    }
+
+public:
+    /**
+     * @brief Create the match directory, open its column files and start the I/O thread
+     * @param matchDir Directory of the match, e.g. `telemetry/20201212-153000`. Its parent must exist.
+     */
+    explicit TelemetryWriter(std::string matchDir) : dir(std::move(matchDir)) {
+        if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+            ERROR("Failed to create telemetry directory `{}`: {}", dir, std::strerror(errno));
+        }
+
+        for (size_t c = 0; c < static_cast<size_t>(TelemetryColumn::eCount); c++) {
+            std::string path = fmt::format("{}/{}", dir, telemetryColumnFiles[c]);
+            fds[c] = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fds[c] < 0) {
+                ERROR("Failed to open telemetry column `{}`: {}", path, std::strerror(errno));
+            }
+        }
+
+        active.reserve(telemetryBatchRows);
+        freeBatches.resize(telemetryBatches - 1);
+        for (auto &batch : freeBatches) {
+            batch.reserve(telemetryBatchRows);
+        }
+        ioThread = std::thread(&TelemetryWriter::ioFunc, this);
+    }
+
+    TelemetryWriter(const TelemetryWriter &rhs) = delete; //!< Deleted copy constructor
+    TelemetryWriter &operator=(const TelemetryWriter &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~TelemetryWriter() { //!< Write everything appended so far, and close the files
+        if (active.size() > 0) {
+            submitActive();
+        }
+        {
+            std::lock_guard<std::mutex> lg(batchMtx);
+            running = false;
+        }
+        batchCv.notify_one();
+        ioThread.join();
+
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    /**
+     * @brief Append one row. Never blocks on I/O and never allocates. Call from one thread only.
+     * @param tick Tick of the state
+     * @param ent State of the entity
+     */
+    inline void append(uint64_t tick, const NetEntity &ent) {
+        active.tick.push_back(tick);
+        active.id.push_back(ent.id);
+        active.x.push_back(ent.x);
+        active.y.push_back(ent.y);
+        active.angle.push_back(ent.angle);
+        active.vx.push_back(ent.vx);
+        active.vy.push_back(ent.vy);
+        if (active.size() >= telemetryBatchRows) {
+            submitActive();
+        }
+    }
+
+    [[nodiscard]] inline const std::string &getDir() const {
+        return dir;
+    }
+};
+
+/**
+ * @brief Read-only, memory-mapped view of a match's telemetry, as written by `TelemetryWriter`. Columns are plain
+ *        arrays into the mappings, meant to be scanned in bulk.
+ */
+class TelemetryReader {
+private:
+    void *maps[static_cast<size_t>(TelemetryColumn::eCount)]{};
+    size_t sizes[static_cast<size_t>(TelemetryColumn::eCount)]{};
+    size_t rows = 0;
+
+public:
+    TelemetryReader() = default;
+
+    TelemetryReader(const TelemetryReader &rhs) = delete; //!< Deleted copy constructor
+    TelemetryReader &operator=(const TelemetryReader &rhs) = delete; //!< Deleted copy assignment operator
+
+    virtual ~TelemetryReader() {
+        for (size_t c = 0; c < static_cast<size_t>(TelemetryColumn::eCount); c++) {
+            if (maps[c] != nullptr) {
+                munmap(maps[c], sizes[c]);
+            }
+        }
+    }
+
+    /**
+     * @brief Map every column of a match
+     * @param matchDir Directory written by a `TelemetryWriter`
+     * @return False if a column is missing or can't be mapped. The error is logged.
+     */
+    bool open(const std::string &matchDir) {
+        rows = SIZE_MAX;
+        for (size_t c = 0; c < static_cast<size_t>(TelemetryColumn::eCount); c++) {
+            std::string path = fmt::format("{}/{}", matchDir, telemetryColumnFiles[c]);
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st{};
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                ERROR("Failed to open telemetry column `{}`: {}", path, std::strerror(errno));
+                if (fd >= 0) {
+                    close(fd);
+                }
+                rows = 0;
+                return false;
+            }
+
+            sizes[c] = static_cast<size_t>(st.st_size);
+            rows = std::min(rows, sizes[c] / telemetryColumnWidths[c]);
+            if (sizes[c] > 0) {
+                maps[c] = mmap(nullptr, sizes[c], PROT_READ, MAP_PRIVATE, fd, 0);
+                if (maps[c] == MAP_FAILED) {
+                    ERROR("Failed to map telemetry column `{}`: {}", path, std::strerror(errno));
+                    maps[c] = nullptr;
+                    close(fd);
+                    rows = 0;
+                    return false;
+                }
+                madvise(maps[c], sizes[c], MADV_SEQUENTIAL); // scans go front to back
+            }
+            close(fd); // the mapping keeps the file alive
+        }
+        return true;
+    }
+
+    [[nodiscard]] inline size_t getNumRows() const { //!< Rows present in every column
+        return rows;
+    }
+
+    template<typename T>
+    [[nodiscard]] inline const T *getColumn(TelemetryColumn col) const { //!< `getNumRows()` elements
+        return static_cast<const T *>(maps[static_cast<size_t>(col)]);
+    }
+};
+
+#endif
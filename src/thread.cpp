@@ -11,12 +11,16 @@
 #include "thread.hpp"
 
 #include "log.hpp"
+#include "metrics.hpp"
 
 namespace stms {
 
+    static constexpr const char *laneNames[numTaskLanes] = {"critical", "normal", "background"}; //!< For metrics
+
     void ThreadPool::destroy() {
-        if (!tasks.empty()) {
-            WARN("ThreadPool destroyed with unfinished tasks! {} tasks will never be executed!", tasks.size());
+        size_t queued = getQueueDepth();
+        if (queued != 0) {
+            WARN("ThreadPool destroyed with unfinished tasks! {} tasks will never be executed!", queued);
         }
 
         if (this->running) {
@@ -55,7 +59,7 @@ namespace stms {
         }
 
         this->running = false;
-        taskQueueCv.notify_all(); // Notify all workers that we are stopped!
+        notifyAllWorkers(); // Notify all workers that we are stopped!
 
         bool workersEmpty;
         {
@@ -81,21 +85,128 @@ namespace stms {
         }
     }
 
-    std::future<void> ThreadPool::submitTask(const std::function<void(void)> &func) {
+    std::future<void> ThreadPool::submitTask(const std::function<void(void)> &func, TaskLane lane) {
+        PoolTask task;
+        task.packaged = std::packaged_task<void(void)>(func);
+
+        // Save future to variable since `task` is moved.
+        auto future = task.packaged.get_future();
+        enqueue(std::move(task), lane);
+
+        return future;
+    }
+
+    void ThreadPool::enqueue(PoolTask &&task, TaskLane lane) {
+        static Counter &submitted = getMetrics().counter("stms_pool_tasks_submitted_total",
+                                                         "Tasks submitted to any ThreadPool");
+        submitted.add();
+
         {
             std::lock_guard<std::mutex> lg(unfinishedTaskMtx);
             unfinishedTasks++;
         }
-        auto task = std::packaged_task<void(void)>(func);
 
-        // Save future to variable since `task` is moved.
-        auto future = task.get_future();
+        task.enqueued = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lg(this->taskQueueMtx);
+        this->tasks[static_cast<size_t>(lane)].push(std::move(task));
+        // One reserved worker of the lane (if it has any) and one unreserved worker, which may run every lane. Never
+        // everyone: tasks that resubmit themselves, like `consumeLogs()`, would wake the whole pool every time.
+        if (reservedWorkers[static_cast<size_t>(lane)] != 0) {
+            reservedCvs[static_cast<size_t>(lane)].notify_one();
+        }
+        taskQueueCv.notify_one();
+    }
+
+    std::condition_variable &ThreadPool::getWaitCv(size_t index) {
+        TaskLane reservation = getReservation(index);
+        return reservation == TaskLane::eCount ? taskQueueCv : reservedCvs[static_cast<size_t>(reservation)];
+    }
+
+    void ThreadPool::notifyAllWorkers() {
+        taskQueueCv.notify_all();
+        for (auto &cv : reservedCvs) {
+            cv.notify_all();
+        }
+    }
+
+    TaskLane ThreadPool::getReservation(size_t index) const {
+        size_t first = 1; // worker indices count from 1
+        for (size_t lane = 0; lane < numTaskLanes; lane++) {
+            if (index < first + reservedWorkers[lane]) {
+                return static_cast<TaskLane>(lane);
+            }
+            first += reservedWorkers[lane];
+        }
+        return TaskLane::eCount;
+    }
+
+    bool ThreadPool::hasTaskFor(size_t index) const {
+        TaskLane reservation = getReservation(index);
+        if (reservation != TaskLane::eCount) {
+            return !tasks[static_cast<size_t>(reservation)].empty();
+        }
+
+        for (const auto &queue : tasks) {
+            if (!queue.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    TaskLane ThreadPool::pickLane(size_t index) {
+        TaskLane reservation = getReservation(index);
+        if (reservation != TaskLane::eCount) {
+            return reservation;
+        }
+
+        size_t best = numTaskLanes;
+        if (strictLanes) {
+            for (best = 0; best < numTaskLanes && tasks[best].empty(); best++);
+            return static_cast<TaskLane>(best);
+        }
+
+        // Smooth weighted round robin over the lanes with tasks: each gains its weight, the richest is picked and
+        // pays for everyone. Over time, lane `i` gets `weights[i] / sum(weights)` of the picks, evenly spread.
+        int64_t total = 0;
+        for (size_t lane = 0; lane < numTaskLanes; lane++) {
+            if (tasks[lane].empty()) {
+                continue;
+            }
+            laneCredits[lane] += laneWeights[lane];
+            total += laneWeights[lane];
+            if (best == numTaskLanes || laneCredits[lane] > laneCredits[best]) {
+                best = lane;
+            }
+        }
+        laneCredits[best] -= total;
+        return static_cast<TaskLane>(best);
+    }
 
+    void ThreadPool::observeWait(TaskLane lane, const PoolTask &task) {
+        static Histogram *waits[numTaskLanes] = {
+                &getMetrics().histogram("stms_pool_critical_wait_ms", "Time frame-critical tasks spent queued",
+                                        {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2, 5, 10, 50}),
+                &getMetrics().histogram("stms_pool_normal_wait_ms", "Time normal tasks spent queued",
+                                        {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2, 5, 10, 50}),
+                &getMetrics().histogram("stms_pool_background_wait_ms", "Time background tasks spent queued",
+                                        {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2, 5, 10, 50}),
+        };
+        waits[static_cast<size_t>(lane)]->observe(
+                std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - task.enqueued).count());
+    }
+
+    void ThreadPool::setLaneScheduling(bool strict, const std::array<unsigned, numTaskLanes> &weights) {
         std::lock_guard<std::mutex> lg(this->taskQueueMtx);
-        this->tasks.emplace(std::move(task));
-        taskQueueCv.notify_one(); // should this be changed to notify_all?
+        strictLanes = strict;
+        laneWeights = weights;
+        laneCredits.fill(0);
+    }
 
-        return future;
+    void ThreadPool::setReservedWorkers(TaskLane lane, unsigned count) {
+        std::lock_guard<std::mutex> lg(this->taskQueueMtx);
+        reservedWorkers[static_cast<size_t>(lane)] = count;
+        notifyAllWorkers(); // workers may be allowed to run different tasks (and wait on different cvs) now
     }
 
     void ThreadPool::pushThread() {
@@ -122,13 +233,13 @@ namespace stms {
             std::lock_guard<std::mutex> lg(this->workerMtx);
             back = std::move(this->workers.back());
             this->stopRequest = this->workers.size(); // Request the last worker to stop.
-            taskQueueCv.notify_all(); // Notify this worker that we requested it to stop
+            notifyAllWorkers(); // Notify this worker that we requested it to stop
 
             this->workers.pop_back();
             if (this->workers.empty()) {
                 WARN("The last thread was popped from ThreadPool! Stopping the pool!");
                 this->running = false;
-                taskQueueCv.notify_all(); // Notify all workers that we've stopped
+                notifyAllWorkers(); // Notify all workers that we've stopped
             }
         }
 
@@ -171,6 +282,11 @@ namespace stms {
             this->tasks = std::move(rhs.tasks);
             this->workers = std::move(rhs.workers);
             this->unfinishedTasks = rhs.unfinishedTasks;
+            this->placement = std::move(rhs.placement);
+            this->strictLanes = rhs.strictLanes;
+            this->laneWeights = rhs.laneWeights;
+            this->laneCredits = rhs.laneCredits;
+            this->reservedWorkers = rhs.reservedWorkers;
         }
 
         if (nThreads > 0) {
@@ -188,6 +304,23 @@ namespace stms {
         this->destroy();
     }
 
+    void ThreadPool::registerMetrics(const std::string &name) {
+        getMetrics().callbackGauge(fmt::format("stms_pool_{}_queue_depth", name),
+                                   "Tasks waiting in the ThreadPool queue", [this]() {
+                    return static_cast<double>(getQueueDepth());
+                });
+        for (size_t lane = 0; lane < numTaskLanes; lane++) {
+            getMetrics().callbackGauge(fmt::format("stms_pool_{}_{}_queue_depth", name, laneNames[lane]),
+                                       "Tasks waiting in one lane of the ThreadPool queue", [this, lane]() {
+                        return static_cast<double>(getQueueDepth(static_cast<TaskLane>(lane)));
+                    });
+        }
+        getMetrics().callbackGauge(fmt::format("stms_pool_{}_unfinished_tasks", name),
+                                   "Tasks submitted to the ThreadPool but not finished yet", [this]() {
+                    return static_cast<double>(getNumTasks());
+                });
+    }
+
     void ThreadPool::waitIdle(unsigned timeout) {
         std::unique_lock<std::mutex> lg(unfinishedTaskMtx);
         if (unfinishedTasks == 0) {
@@ -0,0 +1,125 @@
+//
+// Created by grant on 12/1/20.
+//
+
+#include "watchdog.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "log.hpp"
+#include "thread.hpp"
+
+namespace stms {
+
+    FrameProfiler::Scope::Scope(FrameProfiler &profiler, const char *name) : parent(profiler), slot(UINT32_MAX),
+                                                                           start(std::chrono::steady_clock::now()) {
+        Frame &frame = parent.current();
+        if (frame.index != 0 && frame.numZones < maxProfilerZones) {
+            slot = frame.numZones++;
+            frame.zones[slot] = Zone{name, std::chrono::duration<float, std::milli>(start - frame.start).count(),
+                                     0, parent.depth};
+        }
+        parent.depth++;
+    }
+
+    FrameProfiler::Scope::~Scope() {
+        parent.depth--;
+        if (slot != UINT32_MAX) {
+            parent.current().zones[slot].durationMs = std::chrono::duration<float, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    void FrameProfiler::beginFrame() {
+        frameCount++;
+        Frame &frame = current();
+        frame.index = frameCount;
+        frame.start = std::chrono::steady_clock::now();
+        frame.numZones = 0;
+        depth = 0;
+    }
+
+    void FrameProfiler::dump(std::string &out) const {
+        // Oldest first, i.e. starting right after the current frame.
+        for (size_t i = 1; i <= profilerFrames; i++) {
+            const Frame &frame = frames[(frameCount + i) % profilerFrames];
+            if (frame.index == 0) {
+                continue;
+            }
+
+            out += fmt::format("Frame {}:\n", frame.index);
+            for (uint32_t z = 0; z < frame.numZones; z++) {
+                const Zone &zone = frame.zones[z];
+                out += fmt::format("  {:>{}}{:<24} +{:8.3f}ms {:8.3f}ms\n", "", zone.depth * 2, zone.name,
+                                   zone.startMs, zone.durationMs);
+            }
+        }
+    }
+
+    TickWatchdog::TickWatchdog(float budgetMs, FrameProfiler *profiler, ThreadPool *pool) : budgetMs(budgetMs),
+                                                                                            profiler(profiler),
+                                                                                            pool(pool) {}
+
+    void TickWatchdog::addDumpHook(std::function<void(std::string &)> hook) {
+        hooks.emplace_back(std::move(hook));
+    }
+
+    void TickWatchdog::report(float tickMs) {
+        overruns++;
+
+        auto now = std::chrono::steady_clock::now();
+        if (lastDump != std::chrono::steady_clock::time_point{} &&
+            now - lastDump < std::chrono::milliseconds(watchdogCooldownMs)) {
+            return;
+        }
+        lastDump = now;
+
+        std::string out = fmt::format("Tick {} took {:.3f}ms, budget is {:.3f}ms. {} overrun(s) so far.\n\n",
+                                      tick, tickMs, budgetMs, overruns);
+
+        if (profiler != nullptr) {
+            out += fmt::format("== Last {} frames ==\n", profilerFrames);
+            profiler->dump(out);
+            out += '\n';
+        }
+
+        out += "== Backlog ==\n";
+        if (pool != nullptr) {
+            out += fmt::format("Thread pool: {} worker(s), {} queued task(s), {} unfinished task(s)\n",
+                               pool->getNumThreads(), pool->getQueueDepth(), pool->getNumTasks());
+        }
+        out += fmt::format("Log queue: {} record(s)\n\n", getLogQueueLength());
+
+        for (const auto &hook : hooks) {
+            hook(out);
+        }
+
+        auto wallTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        std::tm localTime{}; // not `std::localtime`, its static buffer is shared with the log consumer
+        localtime_r(&wallTime, &localTime);
+        std::string path = fmt::format("{}/{:%Y%m%d-%H%M%S}_tick{}.txt", watchdogDir, localTime, tick);
+        WARN("Tick {} took {}ms, over the {}ms budget! Dumping diagnostics to `{}`", tick, tickMs, budgetMs, path);
+
+        auto write = [path, out = std::move(out)]() {
+            mkdir(logsDir, 0777);
+            mkdir(watchdogDir, 0777);
+
+            std::FILE *fp = std::fopen(path.c_str(), "w");
+            if (fp == nullptr) {
+                ERROR("Failed to open watchdog dump `{}`: {}", path, std::strerror(errno));
+                return;
+            }
+            std::fputs(out.c_str(), fp);
+            std::fclose(fp);
+        };
+
+        if (pool != nullptr && pool->isRunning()) {
+            pool->submitDetached(std::move(write), TaskLane::eBackground);
+        } else {
+            write();
+        }
+    }
+}
@@ -0,0 +1,266 @@
+//
+// Created by grant on 11/29/20.
+//
+
+// Monte Carlo balance sweep. Runs headless bot-vs-bot matches for every point of a parameter grid across all
+// cores, streaming one CSV row per match as soon as it finishes.
+//
+// Usage: balance_sweep [--turn a,b,..] [--thrust a,b,..] [--density a,b,..] [--friction a,b,..]
+//                      [--field WxH,WxH,..] [--matches n] [--ticks n] [--threads n] [--out file.csv]
+//
+// Every list is a set of values for that parameter; the sweep runs `--matches` matches for each combination.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "game.cpp"
+#include "prediction.cpp"
+
+#include "log.cpp"
+#include "timers.cpp"
+
+struct SweepParams {
+    float turnImpulse;
+    float thrust;
+    float density;
+    float friction;
+    float fieldW, fieldH; //!< Half-size of the field
+};
+
+static constexpr uint64_t botLookaheadTicks = 10; //!< Bots aim at where the ball will be this many ticks from now
+
+struct MatchResult {
+    unsigned goals[2]{};
+    uint64_t possession[2]{}; //!< Ticks during which each team's ship was closest to the ball
+    float speedMean = 0, speedP50 = 0, speedP90 = 0, speedMax = 0;
+};
+
+/// Chase the ball, lining up behind it on the side away from the goal we're attacking.
+static void driveBot(Ship &ship, const b2Vec2 &ballPos, float attackDir, float thrust, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> noise(-0.15f, 0.15f);
+
+    b2Vec2 target = ballPos - b2Vec2(0, attackDir * ship.body.h);
+    b2Vec2 toTarget = target - ship.body.body->GetPosition();
+    float desired = std::atan2(toTarget.x, toTarget.y) + noise(rng); // forward is (sin, cos), see `Ship::apply`
+    float error = std::remainder(desired - ship.body.body->GetAngle(), 2 * b2_pi);
+
+    ship.turn(error > 0.1f ? 1 : (error < -0.1f ? -1 : 0)); // a positive impulse increases the angle
+    if (std::abs(error) < 0.5f) {
+        ship.apply(thrust);
+    }
+}
+
+static MatchResult runMatch(const SweepParams &params, uint32_t seed, unsigned ticks) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> jitter(-0.1f, 0.1f);
+
+    PhysicsEngine phys(physArenaBytes, params.fieldW, params.fieldH);
+    float shipW = params.fieldW / 16, shipH = params.fieldH / 16;
+
+    Ball ball(phys.makeDynamicCircle(params.fieldW * jitter(rng), params.fieldH * jitter(rng), params.fieldW / 8,
+                                     params.density, params.friction));
+    Ship ships[2] = {
+            Ship(phys.makeDynamicBox(0, -params.fieldH / 2, shipW, shipH, params.density, params.friction),
+                 Team{255, 0, 0}),
+            Ship(phys.makeDynamicBox(0, params.fieldH / 2, shipW, shipH, params.density, params.friction),
+                 Team{0, 0, 255})
+    };
+    for (auto &ship : ships) {
+        ship.turnImpulse = params.turnImpulse;
+    }
+
+    const uint32_t ballId = PhysicsEngine::getBodyId(ball.body.body);
+    BallPredictor predictor(phys, ball.body.body);
+    const float goalHalfWidth = params.fieldW / 3;
+
+    MatchResult ret;
+    std::vector<float> speeds;
+    speeds.reserve(ticks);
+
+    for (unsigned t = 0; t < ticks; t++) {
+        b2Vec2 aim = predictor.getPath(t).positionAt(t + botLookaheadTicks);
+        driveBot(ships[0], aim, 1, params.thrust, rng); // team 0 attacks +y
+        driveBot(ships[1], aim, -1, params.thrust, rng); // team 1 attacks -y
+
+        phys.step(1.0f / tickRate);
+        predictor.onStep();
+
+        bool scored = false;
+        for (const auto &ev : phys.getContactEvents()) {
+            if (ev.type != ContactEvent::Type::eBegin || (ev.bodyA != ballId && ev.bodyB != ballId)) {
+                continue;
+            }
+
+            uint32_t other = ev.bodyA == ballId ? ev.bodyB : ev.bodyA;
+            if ((other == 2 || other == 3) && std::abs(ev.point.x) < goalHalfWidth) { // top/bottom walls
+                ret.goals[other == 2 ? 0 : 1]++;
+                scored = true;
+            }
+        }
+
+        if (scored) {
+            ball.body.body->SetTransform(b2Vec2(0, 0), 0);
+            ball.body.body->SetLinearVelocity(b2Vec2(0, 0));
+            ball.body.body->SetAngularVelocity(0);
+            predictor.invalidate();
+        }
+
+        b2Vec2 ballPos = ball.body.body->GetPosition();
+        float d0 = (ships[0].body.body->GetPosition() - ballPos).LengthSquared();
+        float d1 = (ships[1].body.body->GetPosition() - ballPos).LengthSquared();
+        ret.possession[d0 <= d1 ? 0 : 1]++;
+        speeds.push_back(ball.body.body->GetLinearVelocity().Length());
+    }
+
+    if (!speeds.empty()) {
+        double sum = 0;
+        for (float s : speeds) {
+            sum += s;
+        }
+        ret.speedMean = static_cast<float>(sum / speeds.size());
+
+        auto nth = [&](float q) {
+            auto it = speeds.begin() + static_cast<long>(q * (speeds.size() - 1));
+            std::nth_element(speeds.begin(), it, speeds.end());
+            return *it;
+        };
+        ret.speedP50 = nth(0.5f);
+        ret.speedP90 = nth(0.9f);
+        ret.speedMax = *std::max_element(speeds.begin(), speeds.end());
+    }
+
+    return ret;
+}
+
+static std::vector<float> parseList(const char *str) {
+    std::vector<float> ret;
+    for (const char *p = str; *p != '\0';) {
+        char *end;
+        ret.push_back(std::strtof(p, &end));
+        p = *end == ',' ? end + 1 : end;
+        if (end == p && *p != '\0') {
+            break; // garbage, stop parsing
+        }
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    std::vector<float> turns{1}, thrusts{200}, densities{1}, frictions{0.3f};
+    std::vector<std::pair<float, float>> fields{{fieldWidth, fieldHeight}};
+    unsigned matches = 100, ticks = 60 * 60, threads = 0;
+    std::string outPath = "sweep.csv";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--turn") {
+            turns = parseList(argv[i + 1]);
+        } else if (arg == "--thrust") {
+            thrusts = parseList(argv[i + 1]);
+        } else if (arg == "--density") {
+            densities = parseList(argv[i + 1]);
+        } else if (arg == "--friction") {
+            frictions = parseList(argv[i + 1]);
+        } else if (arg == "--field") {
+            fields.clear();
+            for (const char *p = argv[i + 1]; *p != '\0';) {
+                char *end;
+                float w = std::strtof(p, &end);
+                float h = *end == 'x' ? std::strtof(end + 1, &end) : w;
+                fields.emplace_back(w, h);
+                p = *end == ',' ? end + 1 : end;
+                if (*end != ',' && *end != '\0') {
+                    break;
+                }
+            }
+        } else if (arg == "--matches") {
+            matches = static_cast<unsigned>(std::atoi(argv[i + 1]));
+        } else if (arg == "--ticks") {
+            ticks = static_cast<unsigned>(std::atoi(argv[i + 1]));
+        } else if (arg == "--threads") {
+            threads = static_cast<unsigned>(std::atoi(argv[i + 1]));
+        } else if (arg == "--out") {
+            outPath = argv[i + 1];
+        } else {
+            std::fprintf(stderr, "Unknown argument `%s`\n", arg.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto pool = stms::ThreadPool();
+    pool.start(threads);
+    stms::getLogPool() = &pool;
+    stms::initLogging();
+
+    std::FILE *out = std::fopen(outPath.c_str(), "w");
+    if (out == nullptr) {
+        FATAL("Failed to open `{}`: {}", outPath, std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+    std::fputs("point,seed,turn_impulse,thrust,density,friction,field_w,field_h,ticks,goals_a,goals_b,"
+               "possession_a,possession_b,ball_speed_mean,ball_speed_p50,ball_speed_p90,ball_speed_max\n", out);
+
+    std::vector<SweepParams> grid;
+    for (float turn : turns) {
+        for (float thrust : thrusts) {
+            for (float density : densities) {
+                for (float friction : frictions) {
+                    for (const auto &field : fields) {
+                        grid.push_back(SweepParams{turn, thrust, density, friction, field.first, field.second});
+                    }
+                }
+            }
+        }
+    }
+
+    std::mutex outMtx;
+    std::atomic_size_t done = 0;
+    const size_t total = grid.size() * matches;
+    INFO("Sweeping {} grid points x {} matches x {} ticks into `{}`", grid.size(), matches, ticks, outPath);
+
+    stms::Stopwatch watch;
+    watch.start();
+
+    // Matches are submitted in batches so the pool's queue stays small. Each row is written as soon as its
+    // match is done, so nothing accumulates in memory.
+    const size_t batch = std::max<size_t>(1, pool.getNumThreads() * 4);
+    for (size_t first = 0; first < total; first += batch) {
+        for (size_t job = first; job < std::min(total, first + batch); job++) {
+            pool.submitTask([&, job]() {
+                size_t point = job / matches;
+                auto seed = static_cast<uint32_t>(job);
+                const SweepParams &p = grid[point];
+                MatchResult r = runMatch(p, seed, ticks);
+
+                std::string row = fmt::format("{},{},{},{},{},{},{},{},{},{},{},{},{},{:.3f},{:.3f},{:.3f},{:.3f}\n",
+                                              point, seed, p.turnImpulse, p.thrust, p.density, p.friction,
+                                              p.fieldW, p.fieldH, ticks, r.goals[0], r.goals[1], r.possession[0],
+                                              r.possession[1], r.speedMean, r.speedP50, r.speedP90, r.speedMax);
+                {
+                    std::lock_guard<std::mutex> lg(outMtx);
+                    std::fputs(row.c_str(), out);
+                }
+                done++;
+            });
+        }
+        pool.waitIdle();
+
+        if ((first / batch) % 16 == 0) {
+            INFO("{}/{} matches done ({}ms elapsed)", done.load(), total, watch.getTime());
+        }
+    }
+
+    watch.stop();
+    std::fclose(out);
+    INFO("Sweep of {} matches finished in {}ms", total, watch.getTime());
+
+    stms::quitLogging();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+//
+// Created by grant on 11/24/20.
+//
+
+// Benchmarks `GridBroadPhase` against Box2D's default `b2DynamicTree` broadphase on the same workload:
+// N boxes bouncing around inside the walls, with every overlapping pair found every tick.
+
+#include <box2d/b2_dynamic_tree.h>
+
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "log.cpp"
+#include "phys.cpp"
+#include "timers.cpp"
+
+struct BenchBody {
+    b2Vec2 pos;
+    b2Vec2 vel;
+    float r;
+
+    [[nodiscard]] b2AABB aabb() const {
+        b2AABB ret;
+        ret.lowerBound = pos - b2Vec2(r, r);
+        ret.upperBound = pos + b2Vec2(r, r);
+        return ret;
+    }
+
+    void move(float dt) {
+        pos += dt * vel;
+        if (pos.x < -fieldWidth + r || pos.x > fieldWidth - r) {
+            vel.x = -vel.x;
+        }
+        if (pos.y < -fieldHeight + r || pos.y > fieldHeight - r) {
+            vel.y = -vel.y;
+        }
+    }
+};
+
+/// Mirrors what `b2BroadPhase::UpdatePairs` does for every moved proxy.
+struct TreePairCounter {
+    const b2DynamicTree *tree;
+    int32 queryId;
+    size_t pairs = 0;
+
+    bool QueryCallback(int32 proxyId) {
+        if (proxyId > queryId && b2TestOverlap(tree->GetFatAABB(proxyId), tree->GetFatAABB(queryId))) {
+            pairs++;
+        }
+        return true;
+    }
+};
+
+static std::vector<BenchBody> makeBodies(size_t n) {
+    std::mt19937 rng(1337);
+    std::uniform_real_distribution<float> x(-fieldWidth * 0.9f, fieldWidth * 0.9f);
+    std::uniform_real_distribution<float> y(-fieldHeight * 0.9f, fieldHeight * 0.9f);
+    std::uniform_real_distribution<float> v(-120, 120);
+    std::uniform_real_distribution<float> r(2, 8);
+
+    std::vector<BenchBody> ret(n);
+    for (auto &body : ret) {
+        body = BenchBody{b2Vec2(x(rng), y(rng)), b2Vec2(v(rng), v(rng)), r(rng)};
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int ticks = argc > 1 ? std::atoi(argv[1]) : 600;
+    constexpr float dt = 1.0f / 60;
+
+    fmt::print("{:>6} | {:>14} | {:>14} | {:>8} | {:>8}\n", "bodies", "tree ms/tick", "grid ms/tick", "tree prs",
+               "grid prs");
+
+    for (size_t n : {10, 100, 1000}) {
+        // Box2D's default broadphase
+        auto bodies = makeBodies(n);
+        b2DynamicTree tree;
+        std::vector<int32> ids;
+        for (auto &body : bodies) {
+            ids.push_back(tree.CreateProxy(body.aabb(), nullptr));
+        }
+
+        size_t treePairs = 0;
+        stms::Stopwatch watch;
+        watch.start();
+        for (int t = 0; t < ticks; t++) {
+            TreePairCounter counter{&tree, 0};
+            for (size_t i = 0; i < n; i++) {
+                b2Vec2 before = bodies[i].pos;
+                bodies[i].move(dt);
+                tree.MoveProxy(ids[i], bodies[i].aabb(), bodies[i].pos - before);
+            }
+            for (size_t i = 0; i < n; i++) {
+                counter.queryId = ids[i];
+                tree.Query(&counter, tree.GetFatAABB(ids[i]));
+            }
+            treePairs = counter.pairs;
+        }
+        watch.stop();
+        float treeMs = watch.getTime() / static_cast<float>(ticks);
+
+        // Uniform grid
+        bodies = makeBodies(n);
+        GridBroadPhase grid;
+
+        size_t gridPairs = 0;
+        watch.start();
+        for (int t = 0; t < ticks; t++) {
+            grid.clear();
+            for (auto &body : bodies) {
+                body.move(dt);
+                grid.insert(body.aabb(), 0);
+            }
+            grid.rebuild();
+
+            gridPairs = 0;
+            grid.queryPairs([&](uintptr_t, uintptr_t) { gridPairs++; });
+        }
+        watch.stop();
+        float gridMs = watch.getTime() / static_cast<float>(ticks);
+
+        // Pair counts differ a bit since the tree tests fattened AABBs.
+        fmt::print("{:>6} | {:>14.5f} | {:>14.5f} | {:>8} | {:>8}\n", n, treeMs, gridMs, treePairs, gridPairs);
+    }
+
+    stms::consumeLogs();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,348 @@
+//
+// Created by grant on 12/9/20.
+//
+
+// Network load test. Runs a `GameServer` on loopback and ramps up simulated clients against it, all driven from
+// one epoll loop (no thread per client). Every client sends an input per tick and validates the snapshots it gets
+// back. After every step of the ramp, one row of server tick time, bandwidth and packet loss is printed.
+//
+// Usage: load_test [--start n] [--max n] [--step n] [--seconds s] [--script random|circle] [--arena-scale x]
+//                  [--out file.csv]
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "game.cpp"
+#include "net.cpp"
+
+#include "log.cpp"
+#include "timers.cpp"
+
+/// One simulated player
+struct LoadClient {
+    int fd = -1;
+    uint32_t seq = 0; //!< Last input sent
+    uint32_t rng = 0;
+    int turn = 0;
+    uint8_t thrust = 0;
+
+    uint64_t lastTick = 0; //!< Tick of the newest valid snapshot, 0 before the first one
+    uint64_t received = 0; //!< Valid, in-order snapshots
+    uint64_t lost = 0; //!< Ticks skipped between in-order snapshots
+    uint64_t late = 0; //!< Snapshots older than one already received
+    uint64_t invalid = 0; //!< Snapshots that failed validation
+    uint64_t sendErrors = 0;
+};
+
+/// Sums over all clients, diffed between the start and end of a ramp step
+struct ClientTotals {
+    uint64_t sent = 0, received = 0, lost = 0, late = 0, invalid = 0, sendErrors = 0;
+
+    static ClientTotals of(const std::vector<LoadClient> &clients) {
+        ClientTotals ret;
+        for (const auto &c : clients) {
+            ret.sent += c.seq;
+            ret.received += c.received;
+            ret.lost += c.lost;
+            ret.late += c.late;
+            ret.invalid += c.invalid;
+            ret.sendErrors += c.sendErrors;
+        }
+        return ret;
+    }
+};
+
+enum class Script {
+    eRandom, //!< Turn and thrust change randomly every half a second or so
+    eCircle //!< Always turning right at most thrust, which keeps every ship moving
+};
+
+static void sendInput(LoadClient &client, Script script) {
+    if (script == Script::eCircle) {
+        client.turn = 1;
+        client.thrust = 200;
+    } else {
+        client.rng ^= client.rng << 13u; // xorshift32
+        client.rng ^= client.rng >> 17u;
+        client.rng ^= client.rng << 5u;
+        if (client.rng % 32 == 0) {
+            client.turn = static_cast<int>(client.rng / 32 % 3) - 1;
+            client.thrust = (client.rng / 96) % 2 ? 255 : 0;
+        }
+    }
+
+    InputPacket packet{};
+    packet.seq = ++client.seq;
+    packet.thrust = client.thrust;
+    packet.turn = static_cast<int8_t>(client.turn);
+    if (send(client.fd, &packet, sizeof(packet), 0) != sizeof(packet)) {
+        client.sendErrors++;
+    }
+}
+
+static void receiveSnapshots(LoadClient &client) {
+    char buf[serverMaxPacketBytes + 64];
+    ssize_t len;
+    while ((len = recv(client.fd, buf, sizeof(buf), 0)) >= 0) {
+        SnapshotHeader header{};
+        if (static_cast<size_t>(len) < sizeof(header)) {
+            client.invalid++;
+            continue;
+        }
+        std::memcpy(&header, buf, sizeof(header));
+
+        size_t bodyBytes = header.numEntities * sizeof(NetEntity);
+        if (header.type != PacketType::eSnapshot || static_cast<size_t>(len) != sizeof(header) + bodyBytes
+            || header.numEntities == 0 || header.ackSeq > client.seq
+            || netChecksum(buf + sizeof(header), bodyBytes) != header.checksum) {
+            client.invalid++;
+            continue;
+        }
+
+        if (client.lastTick != 0) {
+            if (header.tick <= client.lastTick) {
+                client.late++;
+                continue;
+            }
+            client.lost += header.tick - client.lastTick - 1;
+        }
+        client.lastTick = header.tick;
+        client.received++;
+    }
+}
+
+static bool addClient(std::vector<LoadClient> &clients, int epollFd, uint16_t port) {
+    LoadClient client;
+    client.rng = 0x9E3779B9u * static_cast<uint32_t>(clients.size() + 1);
+    client.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (client.fd < 0) {
+        ERROR("Failed to create client socket: {}", std::strerror(errno));
+        return false;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = clients.size();
+    if (connect(client.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+        || epoll_ctl(epollFd, EPOLL_CTL_ADD, client.fd, &ev) != 0) {
+        ERROR("Failed to set up client socket: {}", std::strerror(errno));
+        close(client.fd);
+        return false;
+    }
+
+    clients.push_back(client);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t start = 16, max = 512, step = 16;
+    float seconds = 5;
+    float arenaScale = 1; // e.g. `largeArenaScale`, to load test interest management
+    Script script = Script::eRandom;
+    std::string outPath;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--start") {
+            start = static_cast<size_t>(std::atoi(argv[i + 1]));
+        } else if (arg == "--max") {
+            max = static_cast<size_t>(std::atoi(argv[i + 1]));
+        } else if (arg == "--step") {
+            step = std::max<size_t>(1, static_cast<size_t>(std::atoi(argv[i + 1])));
+        } else if (arg == "--seconds") {
+            seconds = std::strtof(argv[i + 1], nullptr);
+        } else if (arg == "--script") {
+            script = std::string(argv[i + 1]) == "circle" ? Script::eCircle : Script::eRandom;
+        } else if (arg == "--arena-scale") {
+            arenaScale = std::max(std::strtof(argv[i + 1], nullptr), 1.0f);
+        } else if (arg == "--out") {
+            outPath = argv[i + 1];
+        } else {
+            std::fprintf(stderr, "Unknown argument `%s`\n", arg.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto pool = stms::ThreadPool();
+    pool.start(1);
+    stms::getLogPool() = &pool;
+    stms::initLogging();
+
+    // One socket per client; the default soft limit of 1024 is easy to hit.
+    rlimit files{};
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    std::FILE *out = nullptr;
+    if (!outPath.empty()) {
+        out = std::fopen(outPath.c_str(), "w");
+        if (out == nullptr) {
+            FATAL("Failed to open `{}`: {}", outPath, std::strerror(errno));
+            return EXIT_FAILURE;
+        }
+        std::fputs("clients,joined,tick_ms_mean,tick_ms_p50,tick_ms_p99,tick_ms_max,down_mbps,up_kbps,"
+                   "snapshot_loss_pct,input_loss_pct,late,invalid,send_errors\n", out);
+    }
+
+    GameServer server(fieldWidth * arenaScale, fieldHeight * arenaScale);
+    if (!server.start(0, true)) {
+        return EXIT_FAILURE;
+    }
+    const uint16_t port = server.getPort();
+
+    // The server ticks on its own thread, like it would in its own process. Tick times and the client count are
+    // handed over under `serverMtx`, the server itself is only touched by that thread.
+    std::mutex serverMtx;
+    std::vector<float> tickTimes;
+    size_t joined = 0;
+    std::atomic_bool serverRunning = true;
+    std::thread serverThread([&]() {
+        stms::TPSTimer timer{};
+        stms::Stopwatch watch{};
+        while (serverRunning) {
+            timer.tick();
+            watch.start();
+            server.tickOnce();
+            watch.stop();
+            {
+                std::lock_guard<std::mutex> lg(serverMtx);
+                tickTimes.push_back(watch.getTime());
+                joined = server.getNumClients();
+            }
+            timer.wait(tickRate);
+        }
+    });
+
+    int epollFd = epoll_create1(0);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    itimerspec interval{};
+    interval.it_interval.tv_nsec = static_cast<long>(1000000000.0f / tickRate);
+    interval.it_value = interval.it_interval;
+    timerfd_settime(timerFd, 0, &interval, nullptr);
+    epoll_event timerEv{};
+    timerEv.events = EPOLLIN;
+    timerEv.data.u64 = UINT64_MAX;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &timerEv);
+
+    std::vector<LoadClient> clients;
+    clients.reserve(max);
+    std::vector<epoll_event> events(256);
+
+    std::printf("%8s %7s %9s %9s %9s %9s %10s %9s %8s %8s %6s %8s\n", "clients", "joined", "tick_avg", "tick_p50",
+                "tick_p99", "tick_max", "down_Mbps", "up_kbps", "snap_%", "input_%", "late", "invalid");
+
+    bool failed = false;
+    for (size_t target = start; target <= max && !failed; target += step) {
+        while (clients.size() < target) {
+            if (!addClient(clients, epollFd, port)) {
+                failed = true;
+                break;
+            }
+        }
+
+        ClientTotals clientsBefore = ClientTotals::of(clients);
+        uint64_t sentBefore = server.getStats().bytesSent, recvBefore = server.getStats().bytesReceived;
+        uint64_t packetsBefore = server.getStats().packetsReceived, inputsLostBefore = server.getStats().inputsLost;
+        {
+            std::lock_guard<std::mutex> lg(serverMtx);
+            tickTimes.clear();
+        }
+
+        stms::Stopwatch stage{};
+        stage.start();
+        while (stage.getTime() < seconds * 1000) {
+            int n = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 100);
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u64 == UINT64_MAX) {
+                    uint64_t expirations;
+                    if (read(timerFd, &expirations, sizeof(expirations)) > 0) {
+                        for (auto &client : clients) {
+                            sendInput(client, script);
+                        }
+                    }
+                } else {
+                    receiveSnapshots(clients[events[i].data.u64]);
+                }
+            }
+        }
+        stage.stop();
+
+        float elapsed = stage.getTime() / 1000;
+        ClientTotals totals = ClientTotals::of(clients);
+        uint64_t bytesSent = server.getStats().bytesSent - sentBefore;
+        uint64_t bytesReceived = server.getStats().bytesReceived - recvBefore;
+        uint64_t packets = server.getStats().packetsReceived - packetsBefore;
+        uint64_t inputsLost = server.getStats().inputsLost - inputsLostBefore;
+
+        std::vector<float> ticks;
+        size_t numJoined;
+        {
+            std::lock_guard<std::mutex> lg(serverMtx);
+            ticks.swap(tickTimes);
+            numJoined = joined;
+        }
+        std::sort(ticks.begin(), ticks.end());
+        auto pct = [&](float q) { return ticks.empty() ? 0 : ticks[static_cast<size_t>(q * (ticks.size() - 1))]; };
+        double mean = 0;
+        for (float t : ticks) {
+            mean += t;
+        }
+        mean = ticks.empty() ? 0 : mean / ticks.size();
+
+        uint64_t snapsReceived = totals.received - clientsBefore.received, snapsLost = totals.lost - clientsBefore.lost;
+        double snapLoss = snapsReceived + snapsLost == 0 ? 0 : 100.0 * snapsLost / (snapsReceived + snapsLost);
+        double inputLoss = packets + inputsLost == 0 ? 0 : 100.0 * inputsLost / (packets + inputsLost);
+        double downMbps = bytesSent * 8 / 1e6 / elapsed, upKbps = bytesReceived * 8 / 1e3 / elapsed;
+
+        std::printf("%8zu %7zu %9.3f %9.3f %9.3f %9.3f %10.2f %9.1f %8.3f %8.3f %6lu %8lu\n", clients.size(),
+                    numJoined, mean, pct(0.5f), pct(0.99f), ticks.empty() ? 0 : ticks.back(), downMbps, upKbps,
+                    snapLoss, inputLoss, static_cast<unsigned long>(totals.late - clientsBefore.late),
+                    static_cast<unsigned long>(totals.invalid - clientsBefore.invalid));
+        std::fflush(stdout);
+        if (out != nullptr) {
+            std::fputs(fmt::format("{},{},{:.4f},{:.4f},{:.4f},{:.4f},{:.3f},{:.3f},{:.4f},{:.4f},{},{},{}\n",
+                                   clients.size(), numJoined, mean, pct(0.5f), pct(0.99f),
+                                   ticks.empty() ? 0 : ticks.back(), downMbps, upKbps, snapLoss, inputLoss,
+                                   totals.late - clientsBefore.late, totals.invalid - clientsBefore.invalid,
+                                   totals.sendErrors - clientsBefore.sendErrors).c_str(), out);
+        }
+
+        if (!ticks.empty() && pct(0.99f) > 1000.0f / tickRate) {
+            WARN("p99 server tick time is over budget at {} clients!", clients.size());
+        }
+    }
+
+    const auto bye = PacketType::eBye;
+    for (auto &client : clients) {
+        send(client.fd, &bye, sizeof(bye), 0);
+        close(client.fd);
+    }
+    close(timerFd);
+    close(epollFd);
+
+    serverRunning = false;
+    serverThread.join();
+    server.stop();
+    if (out != nullptr) {
+        std::fclose(out);
+    }
+
+    stms::quitLogging();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
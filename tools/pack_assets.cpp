@@ -0,0 +1,124 @@
+//
+// Created by grant on 12/11/20.
+//
+
+// Asset packer, run by the build. Decodes every PNG in a directory into RGBA32 and writes them all into one bundle
+// that `AssetBundle` maps at startup, so the game never decodes an image.
+//
+// Usage: pack_assets <res dir> <out file>
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "assets.cpp"
+
+#include "log.cpp"
+#include "timers.cpp"
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::fprintf(stderr, "Usage: %s <res dir> <out file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    auto pool = stms::ThreadPool();
+    pool.start(1);
+    stms::getLogPool() = &pool;
+    stms::initLogging();
+
+    if (IMG_Init(IMG_INIT_PNG) == 0) {
+        FATAL("`IMG_Init(IMG_INIT_PNG)` failed: {}", IMG_GetError());
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::filesystem::path> files;
+    for (const auto &entry : std::filesystem::directory_iterator(argv[1])) {
+        if (entry.is_regular_file() && entry.path().extension() == ".png") {
+            files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end()); // reproducible bundles
+
+    std::vector<BundleImage> index;
+    std::vector<SDL_Surface *> surfaces;
+    uint64_t offset = sizeof(BundleHeader) + files.size() * sizeof(BundleImage);
+    for (const auto &file : files) {
+        std::string name = file.filename().string();
+        if (name.size() >= sizeof(BundleImage::name)) {
+            FATAL("Asset name `{}` is too long for the bundle index!", name);
+            return EXIT_FAILURE;
+        }
+
+        SDL_Surface *loaded = IMG_Load(file.string().c_str());
+        SDL_Surface *rgba = loaded != nullptr ? SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0) : nullptr;
+        SDL_FreeSurface(loaded);
+        if (rgba == nullptr) {
+            FATAL("Failed to decode `{}`: {}", file.string(), IMG_GetError());
+            return EXIT_FAILURE;
+        }
+
+        BundleImage image{};
+        std::strncpy(image.name, name.c_str(), sizeof(image.name) - 1);
+        image.width = static_cast<uint32_t>(rgba->w);
+        image.height = static_cast<uint32_t>(rgba->h);
+        offset = (offset + bundleAlignment - 1) / bundleAlignment * bundleAlignment;
+        image.offset = offset;
+        image.bytes = static_cast<uint64_t>(image.width) * image.height * 4;
+        offset += image.bytes;
+
+        index.push_back(image);
+        surfaces.push_back(rgba);
+    }
+
+    // Written to a temporary file first, so a running game never maps a half-written bundle.
+    std::string tmpPath = std::string(argv[2]) + ".tmp";
+    std::FILE *out = std::fopen(tmpPath.c_str(), "wb");
+    if (out == nullptr) {
+        FATAL("Failed to open `{}`: {}", tmpPath, std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    BundleHeader header{};
+    std::memcpy(header.magic, bundleMagic, sizeof(bundleMagic));
+    header.version = bundleVersion;
+    header.numImages = static_cast<uint32_t>(index.size());
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1
+              && (index.empty() || std::fwrite(index.data(), sizeof(BundleImage), index.size(), out) == index.size());
+
+    const char zeros[bundleAlignment]{};
+    for (size_t i = 0; ok && i < index.size(); i++) {
+        auto pos = static_cast<uint64_t>(std::ftell(out));
+        ok = std::fwrite(zeros, 1, index[i].offset - pos, out) == index[i].offset - pos;
+
+        SDL_LockSurface(surfaces[i]);
+        for (int y = 0; ok && y < surfaces[i]->h; y++) { // surfaces may have padded rows, bundles don't
+            const char *row = static_cast<const char *>(surfaces[i]->pixels) + y * surfaces[i]->pitch;
+            ok = std::fwrite(row, 4, index[i].width, out) == index[i].width;
+        }
+        SDL_UnlockSurface(surfaces[i]);
+    }
+    ok = std::fclose(out) == 0 && ok;
+
+    for (SDL_Surface *surface : surfaces) {
+        SDL_FreeSurface(surface);
+    }
+    IMG_Quit();
+
+    if (!ok || std::rename(tmpPath.c_str(), argv[2]) != 0) {
+        FATAL("Failed to write `{}`: {}", argv[2], std::strerror(errno));
+        std::remove(tmpPath.c_str());
+        return EXIT_FAILURE;
+    }
+
+    INFO("Packed {} image(s) into `{}` ({} bytes)", index.size(), argv[2], offset);
+    stms::quitLogging();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+//
+// Created by grant on 11/28/20.
+//
+
+// Headless replay renderer. Renders a recorded (or freshly simulated) match into PNG frames or raw
+// RGBA video without a display, spreading the frames over a thread pool.
+//
+// Usage: render_replay <out dir> [--replay <file> | --simulate <ticks>] [--save <file>] [--raw]
+//                      [--size <w> <h>] [--frames <first> <last>] [--threads <n>]
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include <cstdlib>
+#include <string>
+
+#include "game.cpp"
+#include "sim.cpp"
+
+#include "log.cpp"
+#include "timers.cpp"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fputs("Usage: render_replay <out dir> [--replay <file> | --simulate <ticks>] [--save <file>] "
+                   "[--raw] [--size <w> <h>] [--frames <first> <last>] [--threads <n>]\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::string outDir = argv[1];
+    std::string replayPath, savePath;
+    size_t simTicks = 0, first = 0, last = SIZE_MAX;
+    unsigned threads = 0;
+    int w = 1280, h = 720;
+    ReplayFormat format = ReplayFormat::ePng;
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (arg == "--simulate" && i + 1 < argc) {
+            simTicks = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--save" && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (arg == "--raw") {
+            format = ReplayFormat::eRaw;
+        } else if (arg == "--size" && i + 2 < argc) {
+            w = std::atoi(argv[++i]);
+            h = std::atoi(argv[++i]);
+        } else if (arg == "--frames" && i + 2 < argc) {
+            first = std::strtoull(argv[++i], nullptr, 10);
+            last = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else {
+            std::fprintf(stderr, "Unknown argument `%s`\n", arg.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto pool = stms::ThreadPool();
+    pool.start(threads);
+    stms::getLogPool() = &pool;
+    stms::initLogging();
+
+    if (IMG_Init(IMG_INIT_PNG) == 0) {
+        FATAL("`IMG_Init(IMG_INIT_PNG)` failed: {}", IMG_GetError());
+        return EXIT_FAILURE;
+    }
+
+    ReplayRecording rec;
+    if (!replayPath.empty()) {
+        if (!rec.load(replayPath)) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        Simulation sim{};
+        sim.recording = &rec;
+        for (size_t i = 0; i < simTicks; i++) {
+            sim.stepOnce();
+        }
+    }
+
+    if (!savePath.empty()) {
+        rec.save(savePath);
+    }
+
+    stms::Stopwatch watch;
+    watch.start();
+    size_t failed = renderReplay(rec, first, last, outDir, format, w, h, pool);
+    watch.stop();
+
+    size_t rendered = std::min(last, rec.getNumFrames()) - std::min(first, rec.getNumFrames());
+    INFO("Rendered {} frames in {}ms ({:.1f}x real time), {} failed", rendered, watch.getTime(),
+         (rendered / tickRate * 1000.0f) / std::max(watch.getTime(), 0.001f), failed);
+
+    IMG_Quit();
+    stms::quitLogging();
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
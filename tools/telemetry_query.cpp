@@ -0,0 +1,269 @@
+//
+// Created by grant on 12/12/20.
+//
+
+// Telemetry query tool. Maps the column files of any number of matches recorded with `--telemetry` and scans them
+// in chunks spread over a thread pool. Prints row counts, tick range, field bounds and speeds, and can write a
+// heatmap of where the selected entities were as CSV (one line per row of cells, top of the field first).
+//
+// Usage: telemetry_query <match dir>... [--id n] [--cells w h] [--bounds x0 y0 x1 y1] [--heatmap out.csv]
+//                        [--threads n]
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "telemetry.cpp"
+
+#include "log.cpp"
+#include "timers.cpp"
+
+/// Rows are scanned this many at a time: computed into arrays first, which vectorizes, then scattered
+constexpr size_t scanBlockRows = 4096;
+constexpr size_t scanChunkRows = 1u << 20u; // rows per task
+
+struct Query {
+    int64_t id = -1; //!< Only rows of this entity, or -1 for every entity
+    int cellsW = 64, cellsH = 64;
+    float x0 = 0, y0 = 0, x1 = 0, y1 = 0; //!< Heatmap bounds. Found from the data if they're all 0.
+};
+
+/// Result of scanning some rows
+struct Partial {
+    uint64_t rows = 0; //!< Selected rows
+    uint64_t minTick = UINT64_MAX, maxTick = 0;
+    float minX = std::numeric_limits<float>::max(), minY = std::numeric_limits<float>::max();
+    float maxX = std::numeric_limits<float>::lowest(), maxY = std::numeric_limits<float>::lowest();
+    double sumSpeed = 0;
+    float maxSpeed = 0;
+    std::vector<uint64_t> heat; //!< `cellsW * cellsH` counts, row-major, bottom row first
+
+    void merge(const Partial &rhs) {
+        rows += rhs.rows;
+        minTick = std::min(minTick, rhs.minTick);
+        maxTick = std::max(maxTick, rhs.maxTick);
+        minX = std::min(minX, rhs.minX);
+        minY = std::min(minY, rhs.minY);
+        maxX = std::max(maxX, rhs.maxX);
+        maxY = std::max(maxY, rhs.maxY);
+        sumSpeed += rhs.sumSpeed;
+        maxSpeed = std::max(maxSpeed, rhs.maxSpeed);
+        heat.resize(std::max(heat.size(), rhs.heat.size()));
+        for (size_t i = 0; i < rhs.heat.size(); i++) {
+            heat[i] += rhs.heat[i];
+        }
+    }
+};
+
+/**
+ * @brief Scan rows `[begin, end)` of a match
+ * @param withHeat If false, only the bounds and the aggregates are computed (e.g. to find the heatmap bounds)
+ */
+static Partial scan(const TelemetryReader &match, size_t begin, size_t end, const Query &q, bool withHeat) {
+    const auto *tick = match.getColumn<uint64_t>(TelemetryColumn::eTick);
+    const auto *id = match.getColumn<uint32_t>(TelemetryColumn::eId);
+    const auto *x = match.getColumn<float>(TelemetryColumn::eX);
+    const auto *y = match.getColumn<float>(TelemetryColumn::eY);
+    const auto *vx = match.getColumn<float>(TelemetryColumn::eVx);
+    const auto *vy = match.getColumn<float>(TelemetryColumn::eVy);
+
+    Partial ret;
+    if (withHeat) {
+        ret.heat.assign(static_cast<size_t>(q.cellsW) * q.cellsH, 0);
+    }
+    const float sx = static_cast<float>(q.cellsW) / (q.x1 - q.x0), sy = static_cast<float>(q.cellsH) / (q.y1 - q.y0);
+    const bool allIds = q.id < 0;
+    const auto wanted = static_cast<uint32_t>(q.id);
+
+    uint32_t cells[scanBlockRows];
+    uint32_t selected[scanBlockRows];
+    for (size_t block = begin; block < end; block += scanBlockRows) {
+        const size_t n = std::min(scanBlockRows, end - block);
+
+        // Branch-free over plain arrays, so the compiler can vectorize it. Unselected rows are masked, not skipped.
+        uint64_t rows = 0, minTick = UINT64_MAX, maxTick = 0;
+        float minX = ret.minX, minY = ret.minY, maxX = ret.maxX, maxY = ret.maxY, maxSpeed2 = 0;
+        double sumSpeed = 0;
+        for (size_t j = 0; j < n; j++) {
+            const size_t i = block + j;
+            const uint32_t sel = allIds | (id[i] == wanted);
+            const float speed2 = vx[i] * vx[i] + vy[i] * vy[i];
+            selected[j] = sel;
+            rows += sel;
+            minTick = std::min(minTick, sel ? tick[i] : UINT64_MAX);
+            maxTick = std::max(maxTick, sel ? tick[i] : 0);
+            minX = std::min(minX, sel ? x[i] : minX);
+            maxX = std::max(maxX, sel ? x[i] : maxX);
+            minY = std::min(minY, sel ? y[i] : minY);
+            maxY = std::max(maxY, sel ? y[i] : maxY);
+            maxSpeed2 = std::max(maxSpeed2, sel ? speed2 : 0.0f);
+            sumSpeed += sel ? std::sqrt(speed2) : 0.0f;
+        }
+        ret.rows += rows;
+        ret.minTick = std::min(ret.minTick, minTick);
+        ret.maxTick = std::max(ret.maxTick, maxTick);
+        ret.minX = minX;
+        ret.minY = minY;
+        ret.maxX = maxX;
+        ret.maxY = maxY;
+        ret.maxSpeed = std::max(ret.maxSpeed, std::sqrt(maxSpeed2));
+        ret.sumSpeed += sumSpeed;
+
+        if (!withHeat) {
+            continue;
+        }
+        for (size_t j = 0; j < n; j++) {
+            const size_t i = block + j;
+            int cx = std::clamp(static_cast<int>((x[i] - q.x0) * sx), 0, q.cellsW - 1);
+            int cy = std::clamp(static_cast<int>((y[i] - q.y0) * sy), 0, q.cellsH - 1);
+            cells[j] = static_cast<uint32_t>(cy * q.cellsW + cx);
+        }
+        for (size_t j = 0; j < n; j++) { // the only scattered part
+            ret.heat[cells[j]] += selected[j];
+        }
+    }
+    return ret;
+}
+
+/// Scan every row of every match on the pool, in chunks of `scanChunkRows`
+static Partial scanAll(const std::vector<std::unique_ptr<TelemetryReader>> &matches, const Query &q, bool withHeat,
+                       stms::ThreadPool &pool) {
+    struct Chunk {
+        const TelemetryReader *match;
+        size_t begin, end;
+    };
+    std::vector<Chunk> chunks;
+    for (const auto &match : matches) {
+        for (size_t begin = 0; begin < match->getNumRows(); begin += scanChunkRows) {
+            chunks.push_back(Chunk{match.get(), begin, std::min(match->getNumRows(), begin + scanChunkRows)});
+        }
+    }
+
+    std::vector<Partial> partials(chunks.size()); // one per chunk, so tasks never share anything
+    std::vector<std::future<void>> futures;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        futures.emplace_back(pool.submitTask([&, i]() {
+            partials[i] = scan(*chunks[i].match, chunks[i].begin, chunks[i].end, q, withHeat);
+        }));
+    }
+
+    Partial ret;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        futures[i].get();
+        ret.merge(partials[i]);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    Query q;
+    std::string heatmapPath;
+    unsigned threads = 0;
+    std::vector<std::string> dirs;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--id" && i + 1 < argc) {
+            q.id = std::atoll(argv[++i]);
+        } else if (arg == "--cells" && i + 2 < argc) {
+            q.cellsW = std::max(1, std::atoi(argv[++i]));
+            q.cellsH = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--bounds" && i + 4 < argc) {
+            q.x0 = std::strtof(argv[++i], nullptr);
+            q.y0 = std::strtof(argv[++i], nullptr);
+            q.x1 = std::strtof(argv[++i], nullptr);
+            q.y1 = std::strtof(argv[++i], nullptr);
+        } else if (arg == "--heatmap" && i + 1 < argc) {
+            heatmapPath = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else if (!arg.empty() && arg[0] != '-') {
+            dirs.push_back(arg);
+        } else {
+            std::fprintf(stderr, "Unknown argument `%s`\n", arg.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (dirs.empty()) {
+        std::fputs("Usage: telemetry_query <match dir>... [--id n] [--cells w h] [--bounds x0 y0 x1 y1] "
+                   "[--heatmap out.csv] [--threads n]\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    auto pool = stms::ThreadPool();
+    pool.start(threads);
+    stms::getLogPool() = &pool;
+    stms::initLogging();
+
+    std::vector<std::unique_ptr<TelemetryReader>> matches;
+    size_t totalRows = 0;
+    for (const auto &dir : dirs) {
+        matches.push_back(std::make_unique<TelemetryReader>());
+        if (!matches.back()->open(dir)) {
+            return EXIT_FAILURE;
+        }
+        totalRows += matches.back()->getNumRows();
+    }
+
+    stms::Stopwatch watch;
+    watch.start();
+    Partial result;
+    if (heatmapPath.empty()) {
+        result = scanAll(matches, q, false, pool);
+    } else {
+        if (q.x0 == 0 && q.y0 == 0 && q.x1 == 0 && q.y1 == 0) {
+            Partial bounds = scanAll(matches, q, false, pool);
+            if (bounds.rows == 0) {
+                // The bounds would be infinite, and so would the cell scale
+                FATAL("No rows selected, so there are no bounds for the heatmap. Pass `--bounds` or another `--id`.");
+                stms::quitLogging();
+                return EXIT_FAILURE;
+            }
+            q.x0 = bounds.minX;
+            q.y0 = bounds.minY;
+            q.x1 = std::max(bounds.maxX, bounds.minX + 1e-3f); // avoid empty bounds if nothing moved
+            q.y1 = std::max(bounds.maxY, bounds.minY + 1e-3f);
+        }
+        result = scanAll(matches, q, true, pool);
+    }
+    float scanMs = watch.getTime();
+
+    INFO("Scanned {} row(s) of {} match(es) in {:.2f}ms", totalRows, matches.size(), scanMs);
+    std::printf("selected rows: %llu\n", static_cast<unsigned long long>(result.rows));
+    if (result.rows > 0) {
+        std::printf("ticks:         %llu - %llu\n", static_cast<unsigned long long>(result.minTick),
+                    static_cast<unsigned long long>(result.maxTick));
+        std::printf("bounds:        (%.2f, %.2f) - (%.2f, %.2f)\n", result.minX, result.minY, result.maxX,
+                    result.maxY);
+        std::printf("speed:         mean %.2f, max %.2f\n", result.sumSpeed / static_cast<double>(result.rows),
+                    result.maxSpeed);
+    }
+
+    if (!heatmapPath.empty()) {
+        std::FILE *out = std::fopen(heatmapPath.c_str(), "w");
+        if (out == nullptr) {
+            FATAL("Failed to open `{}`: {}", heatmapPath, std::strerror(errno));
+            return EXIT_FAILURE;
+        }
+        for (int cy = q.cellsH - 1; cy >= 0; cy--) {
+            for (int cx = 0; cx < q.cellsW; cx++) {
+                std::fprintf(out, cx == 0 ? "%llu" : ",%llu",
+                             static_cast<unsigned long long>(result.heat[static_cast<size_t>(cy) * q.cellsW + cx]));
+            }
+            std::fputc('\n', out);
+        }
+        std::fclose(out);
+        INFO("Wrote a {}x{} heatmap of ({:.2f}, {:.2f}) - ({:.2f}, {:.2f}) to `{}`", q.cellsW, q.cellsH, q.x0, q.y0,
+             q.x1, q.y1, heatmapPath);
+    }
+
+    stms::quitLogging();
+    return EXIT_SUCCESS;
+}